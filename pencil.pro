@@ -3,6 +3,7 @@
 ######################################################################
 
 CONFIG += qt debug console
+# DEFINES += CHECK_STROKE_RASTERIZER # compares each stroke drawn by StrokeRasterizer with the path filler of QPainter (slow)
 TEMPLATE = app
 TARGET = Pencil
 MOC_DIR = .moc
@@ -22,12 +23,16 @@ INCLUDEPATH += . 	src \
 # Input
 HEADERS += src/interfaces.h \
            src/graphics/bitmap/bitmapimage.h \
+           src/graphics/bitmap/tilecodec.h \
            src/graphics/vector/bezierarea.h \
            src/graphics/vector/beziercurve.h \
            src/graphics/vector/colourref.h \
            src/graphics/vector/gradient.h \
+           src/graphics/vector/rendercontext.h \
+           src/graphics/vector/strokerasterizer.h \
            src/graphics/vector/vectorimage.h \
            src/graphics/vector/vertexref.h \
+           src/structure/archive.h \
            src/structure/layer.h \
            src/structure/layerbitmap.h \
            src/structure/layercamera.h \
@@ -35,6 +40,9 @@ HEADERS += src/interfaces.h \
            src/structure/layersound.h \
            src/structure/layervector.h \
            src/structure/object.h \
+           src/structure/rastercache.h \
+           src/structure/soundfile.h \
+           src/structure/soundmixer.h \
            src/interface/editor.h \
            src/interface/mainwindow.h \
            src/interface/palette.h \
@@ -49,12 +57,16 @@ HEADERS += src/interfaces.h \
     src/interface/tooloptiondockwidget.h
 SOURCES += src/graphics/bitmap/blur.cpp \
            src/graphics/bitmap/bitmapimage.cpp \
+           src/graphics/bitmap/tilecodec.cpp \
            src/graphics/vector/bezierarea.cpp \
            src/graphics/vector/beziercurve.cpp \
            src/graphics/vector/colourref.cpp \
            src/graphics/vector/gradient.cpp \
+           src/graphics/vector/rendercontext.cpp \
+           src/graphics/vector/strokerasterizer.cpp \
            src/graphics/vector/vectorimage.cpp \
            src/graphics/vector/vertexref.cpp \
+           src/structure/archive.cpp \
            src/structure/layer.cpp \
            src/structure/layerbitmap.cpp \
            src/structure/layercamera.cpp \
@@ -62,6 +74,9 @@ SOURCES += src/graphics/bitmap/blur.cpp \
            src/structure/layersound.cpp \
            src/structure/layervector.cpp \
            src/structure/object.cpp \
+           src/structure/rastercache.cpp \
+           src/structure/soundfile.cpp \
+           src/structure/soundmixer.cpp \
            src/interface/editor.cpp \
            src/interface/mainwindow.cpp \
            src/interface/palette.cpp \
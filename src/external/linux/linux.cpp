@@ -18,24 +18,14 @@ GNU General Public License for more details.
 #include <QProcess>
 #include <QDir>
 #include <QString>
+#include <ctype.h>
 #include "object.h"
 #include "mainwindow.h"
 #include "layersound.h"
+#include "soundmixer.h"
 
-#define MIN(a,b) ((a)>(b)?(b):(a))
 
 
-
-
-qint16 safeSum ( qint16 a, qint16 b)
-{
-    if (((int)a + (int)b) > 32767)
-        return 32767;
-    if (((int)a + (int)b) < -32768)
-        return -32768;
-    return a+b;
-}
-
 void initialise()
 {
     qDebug() << "Initialize linux: <nothing, for now>";
@@ -81,7 +71,7 @@ void Object::exportMovie(int startFrame, int endFrame, QMatrix view, Layer* curr
     {ffmpegParameter = "";}
 
     qDebug() << "-------VIDEO------";
-    // --------- Export all the temporary frames ----------
+    // --------- Temporary directory for the sound ----------
     QDir::temp().mkdir("pencil");
     QString tempPath = QDir::temp().absolutePath()+"/pencil/";
     QProgressDialog progress("Exporting movie...", "Abort", 0, 100, NULL);
@@ -90,7 +80,6 @@ void Object::exportMovie(int startFrame, int endFrame, QMatrix view, Layer* curr
 
     QDir dir2(filePath);
     if (QFile::exists(filePath) == true) { dir2.remove(filePath); }
-    exportFrames1(startFrame, endFrame, view, currentLayer, exportSize, tempPath+"tmp", "png", 100, true, true, 2,&progress,50,fps,exportFps);
     // --------- Quicktime assemble call ----------
     QDir sampledir;
     qDebug() << "testmic:" << sampledir.filePath(filePath);
@@ -98,11 +87,9 @@ void Object::exportMovie(int startFrame, int endFrame, QMatrix view, Layer* curr
     QProcess ffmpeg;
 
     qDebug() << "Trying to export VIDEO";
-    qint32 audioDataSize = 44100*2*2*(endFrame-1)/fps;
-    qint16* audioData =(qint16*) malloc(audioDataSize);
-    for (int i = 0; i < audioDataSize/2; i++ ) audioData[i] = 0;
-    quint16 header1[22];
-    bool audioDataValid = false;
+    // the sound clips are mixed into a single file, reading them a piece at a time ( will be used as audio stream )
+    // audio output: 44100Hz sampling rate, stereo, signed 16 bit little endian
+    SoundMixer mixer(44100, 2);
     for(int i = 0; i < this->getLayerCount() ; i++)
     {
         Layer* layer = this->getLayer(i);
@@ -112,71 +99,18 @@ void Object::exportMovie(int startFrame, int endFrame, QMatrix view, Layer* curr
             {
                 if (((LayerSound*)layer)->soundIsNotNull(l))
                 {
-                    // convert audio file: 44100Hz sampling rate, stereo, signed 16 bit little endian
-                    // supported audio file types: wav, mp3, ogg... ( all file types supported by ffmpeg )
-                    qDebug() << "ffmpeg -i \"" + ((LayerSound*)layer)->getSoundFilepathAt(l) + "\" -ar 44100 -acodec pcm_s16le -ac 2 -y \"" + tempPath + "tmpaudio0.wav\"";
-                    ffmpeg.start("ffmpeg -i \"" + ((LayerSound*)layer)->getSoundFilepathAt(l) + "\" -ar 44100 -acodec pcm_s16le -ac 2 -y \"" + tempPath + "tmpaudio0.wav\"");
-                    if (ffmpeg.waitForStarted() == true)
-                    {
-                        if (ffmpeg.waitForFinished() == true)
-                        {
-                            QByteArray sErr = ffmpeg.readAllStandardError();
-                            if (sErr == "")
-                            {
-                                qDebug() << "ERROR: Could not execute FFmpeg.";
-                            }
-                            else
-                            {
-                                qDebug() << "stdout: " << ffmpeg.readAllStandardOutput();
-                                qDebug() << "stderr: " << sErr;
-                                qDebug() << "AUDIO conversion done. ( file: " << ((LayerSound*)layer)->getSoundFilepathAt(l) << ")";
-                            }
-                        }
-                        else
-                        {
-                            qDebug() << "ERROR: FFmpeg did not finish executing.";
-                        }
-                    }
-                    else
-                    {
-                        qDebug() << "ERROR: Could not execute FFmpeg.";
-                    }
                     int frame = ((LayerSound*)layer)->getFramePositionAt(l)-1;
-                    float fframe = (float)frame/(float)fps;
-                    QFile file(tempPath+"tmpaudio0.wav");
-                    qDebug() << "audio file " + tempPath+"tmpaudio0.wav";
-                    file.open(QIODevice::ReadOnly);
-                    file.read((char*)header1,sizeof(header1));
-                    quint32 audioSize = header1[21];
-                    audioSize = audioSize * 65536 + header1[20];
-                    qDebug() << "audio len " << audioSize;
-                    // before calling malloc should check: audioSize < max credible value
-                    qint16* data = (qint16*) malloc(audioSize);
-                    file.read((char*)data,audioSize);
-                    audioDataValid = true;
-                    int delta = fframe*44100*2;
-                    qDebug() << "audio delta " << delta;
-                    int indexMax = MIN(audioSize/2,audioDataSize/2-delta);
-                    // audio files 'mixing': 'higher' sound layers overwrite 'lower' sound layers
-                    for (int index = 0; index < indexMax; index++)
-                    {
-                        audioData[index+delta] = safeSum(audioData[index+delta],data[index]);
-                    }
-                    free(data);
-                    file.close();
+                    mixer.addClip(((LayerSound*)layer)->getSoundFilepathAt(l), qint64(frame)*44100/fps, &progress);
                 }
             }
         }
     }
-    if ( audioDataValid )
+    if (progress.wasCanceled()) return;
+    bool audioDataValid = false;
+    if ( !mixer.isEmpty() )
     {
-        // save mixed audio file ( will be used as audio stream )
         QFile file(tempPath+"tmpaudio.wav");
-        file.open(QIODevice::WriteOnly);
-        header1[20] = audioDataSize % 65536;
-        header1[21] = audioDataSize / 65536;
-        file.write((char*)header1,sizeof(header1));
-        file.write((char*)audioData,audioDataSize);
+        if (file.open(QIODevice::WriteOnly)) audioDataValid = mixer.writeWave(&file, qint64(endFrame-1)*44100/fps);
         file.close();
     }
 
@@ -195,24 +129,31 @@ void Object::exportMovie(int startFrame, int endFrame, QMatrix view, Layer* curr
     	}
     }*/
 
-    // video input:  frame sequence ( -i tmp%03d.png )
+    // video input:  raw frames on the standard input ( -f rawvideo -i - )
+    //               pixel format   ( -pix_fmt bgra: the bytes of QImage::Format_ARGB32_Premultiplied on a little-endian machine )
+    //               frame size     ( -s 640x480 )
     //               frame rate     ( -r fps )
     // audio input:                 ( -i tmpaudio.wav )
     // movie output:                ( filePath )
     //               frame rate     ( -r 25 )
+    QString pixelFormat = (QSysInfo::ByteOrder == QSysInfo::LittleEndian) ? "bgra" : "argb";
+    QString videoInput = "-f rawvideo -pix_fmt " + pixelFormat + " -s " + QString::number(exportSize.width()) + "x" + QString::number(exportSize.height()) + " -r " + QString::number(exportFps) + " -i - ";
+    QString command;
     if ( audioDataValid )
     {
-        qDebug() << "ffmpeg -r " + QString::number(exportFps) + " -i " + tempPath + "tmp%4d.png -i " + tempPath + "tmpaudio.wav -r " + QString::number(exportFps) + " -y " + ffmpegParameter + "\"" + filePath + "\"";
-        ffmpeg.start("ffmpeg -r " + QString::number(exportFps) + " -i " + tempPath + "tmp%4d.png -i " + tempPath + "tmpaudio.wav -r " + QString::number(exportFps) + " -y " + ffmpegParameter + "\"" + filePath + "\"");
+        command = "ffmpeg " + videoInput + "-i " + tempPath + "tmpaudio.wav -r " + QString::number(exportFps) + " -y " + ffmpegParameter + "\"" + filePath + "\"";
     }
     else
     {
-        qDebug() << "ffmpeg -r " + QString::number(exportFps) + " -i " + tempPath + "tmp%4d.png -r " + QString::number(exportFps) + " -y " + ffmpegParameter + "\"" + filePath + "\"";
-        ffmpeg.start("ffmpeg -r " + QString::number(exportFps) + " -i " + tempPath + "tmp%4d.png -r " + QString::number(exportFps) + " -y " + ffmpegParameter + "\"" + filePath + "\"");
+        command = "ffmpeg " + videoInput + "-r " + QString::number(exportFps) + " -y " + ffmpegParameter + "\"" + filePath + "\"";
     }
+    ffmpeg.start(command);
     if (ffmpeg.waitForStarted() == true)
     {
-        if (ffmpeg.waitForFinished() == true)
+        // the frames are piped to ffmpeg as they are rendered (no temporary image files)
+        exportFrames1(startFrame, endFrame, view, currentLayer, exportSize, "", "png", 100, true, true, 2,&progress,50,fps,exportFps,&ffmpeg);
+        ffmpeg.closeWriteChannel();
+        if (ffmpeg.waitForFinished(-1) == true)
         {
             QByteArray sErr = ffmpeg.readAllStandardError();
             if (sErr == "")
@@ -225,7 +166,6 @@ void Object::exportMovie(int startFrame, int endFrame, QMatrix view, Layer* curr
                 qDebug() << "stderr: " << sErr;
 
                 qDebug() << "dbg:" << QDir::current().currentPath() +"/plugins/";
-                qDebug() << ":" << tempPath + "tmp%03d.png";
                 qDebug() << ":\"" + filePath + "\"";
                 qDebug() << "VIDEO export done.";
             }
@@ -241,7 +181,6 @@ void Object::exportMovie(int startFrame, int endFrame, QMatrix view, Layer* curr
     }
 
     progress.setValue(100);
-    free(audioData);
 
 
     // --------- Clean up temp directory ---------
@@ -257,66 +196,128 @@ void Object::exportMovie(int startFrame, int endFrame, QMatrix view, Layer* curr
 
 
 
-void Editor::importMovie (QString filePath, int fps)
+// takes the first complete image from the frames written by ffmpeg ( -f image2pipe -vcodec ppm ), if there is one
+// a frame is a header ( P6 width height 255 ) followed by the RGB pixels
+static bool takeMovieFrame(QByteArray& data, QImage& image)
 {
+    if(data.size() < 2) return false;
+    if(!data.startsWith("P6"))
+    {
+        qDebug() << "ERROR: Unexpected data from FFmpeg.";
+        data.clear();
+        return false;
+    }
+    QList<int> fields;
+    int pos = 2;
+    while(fields.size() < 3)
+    {
+        while(pos < data.size() && isspace(data.at(pos))) pos++;
+        int start = pos;
+        while(pos < data.size() && isdigit(data.at(pos))) pos++;
+        if(pos >= data.size()) return false; // the header is not complete yet
+        fields << data.mid(start, pos-start).toInt();
+    }
+    pos++; // a single white space before the pixels
+    int width = fields.at(0);
+    int height = fields.at(1);
+    qint64 size = pos + qint64(width)*height*3;
+    if(data.size() < size) return false;
+    image = QImage(width, height, QImage::Format_RGB32);
+    const uchar* p = (const uchar*)data.constData() + pos;
+    for(int y=0; y < height; y++)
+    {
+        QRgb* line = (QRgb*)image.scanLine(y);
+        for(int x=0; x < width; x++, p += 3) line[x] = qRgb(p[0], p[1], p[2]);
+    }
+    data.remove(0, size);
+    return true;
+}
 
-    int i;
-    QSettings settings("Pencil","Pencil");
-
+void Editor::importMovie (QString filePath, int fps, int firstFrame, int frameCount, int width)
+{
     qDebug() << "-------IMPORT VIDEO------" << filePath;
 
-    // --------- Import all the temporary frames ----------
-    QDir::temp().mkdir("pencil");
-    QString tempPath = QDir::temp().absolutePath()+"/pencil/";
+    Layer* layer = object->getLayer(currentLayer);
+    if(layer == NULL || layer->type != Layer::BITMAP)
+    {
+        QMessageBox::warning(this, tr("Warning"),
+                             tr("Unable to import the movie.<br><b>TIP:</b> Use Bitmap layer to import movies."),
+                             QMessageBox::Ok,
+                             QMessageBox::Ok);
+        return;
+    }
+    LayerBitmap* layerBitmap = (LayerBitmap*)layer;
 
-    QProgressDialog progress("Importing movie...", "Abort", 0, 100, NULL);
+    QProgressDialog progress("Importing movie...", "Abort", 0, 0, NULL);
     progress.setWindowModality(Qt::WindowModal);
     progress.show();
-    progress.setValue(10);
+
+    // the decoded frames are read from the standard output of ffmpeg ( no temporary image files )
+    // frame range:   start  ( -ss seconds )
+    //                count  ( -vframes n )
+    // scaling:              ( -vf scale=width:-1 )
+    QString command = "ffmpeg";
+    if (firstFrame > 1) command += " -ss " + QString::number(double(firstFrame-1)/fps);
+    command += " -i \"" + filePath + "\" -r " + QString::number(fps);
+    if (frameCount > 0) command += " -vframes " + QString::number(frameCount);
+    if (width > 0) command += " -vf scale=" + QString::number(width) + ":-1";
+    command += " -f image2pipe -vcodec ppm -";
+    qDebug() << command;
     QProcess ffmpeg;
-    qDebug() << "ffmpeg -i \"" << filePath << "\" -r " << QString::number(fps) << " -f image2 \"" << tempPath << "tmp_import%4d.png\"";
-    ffmpeg.start("ffmpeg -i \"" + filePath + "\" -r " + QString::number(fps) + " -f image2 \"" + tempPath + "tmp_import%4d.png\"");
-    progress.setValue(20);
-    if (ffmpeg.waitForStarted() == true)
+    ffmpeg.start(command);
+    if (ffmpeg.waitForStarted() == false)
+    {
+        qDebug() << "Please install FFMPEG: sudo apt-get install ffmpeg";
+        return;
+    }
+
+    // a single undo step and a single update for the whole movie
+    backup(tr("ImportMovie"));
+    int frameNumber = currentFrame;
+    QPoint centre = scribbleArea->getCentralPoint().toPoint();
+    QByteArray data;
+    QImage image;
+    bool running = true;
+    while (running)
     {
-        if (ffmpeg.waitForFinished() == true)
+        // the wait is bounded, so that the Abort button still responds if ffmpeg stalls;
+        // the output is read once more after ffmpeg has exited
+        running = ffmpeg.state() != QProcess::NotRunning;
+        ffmpeg.waitForReadyRead(100);
+        data.append(ffmpeg.readAllStandardOutput());
+        while (takeMovieFrame(data, image))
         {
-            QByteArray sErr = ffmpeg.readAllStandardError();
-            if (sErr == "")
-            {qDebug() << "ERROR: Could not execute FFmpeg.";}
-            else
+            BitmapImage* bitmapImage = layerBitmap->getBitmapImageAtFrame(frameNumber);
+            if(bitmapImage == NULL)
             {
-                qDebug() << "stderr: " + ffmpeg.readAllStandardOutput();
-                qDebug() << "stdout: " << sErr;
+                layerBitmap->addImageAtFrame(frameNumber);
+                bitmapImage = layerBitmap->getBitmapImageAtFrame(frameNumber);
             }
+            QRect boundaries = image.rect();
+            boundaries.moveTopLeft( centre - QPoint(boundaries.width()/2, boundaries.height()/2) );
+            BitmapImage importedBitmapImage(NULL, boundaries, image);
+            bitmapImage->paste(&importedBitmapImage);
+            layerBitmap->setModified(frameNumber, true);
+            frameNumber++;
+            progress.setLabelText("Importing movie... (" + QString::number(frameNumber-currentFrame) + " frames)");
+        }
+        qApp->processEvents();
+        if (progress.wasCanceled())
+        {
+            ffmpeg.kill();
+            running = false;
         }
-        else
-        {qDebug() << "ERROR: FFmpeg did not finish executing.";}
     }
-    else
-    {qDebug() << "Please install FFMPEG: sudo apt-get install ffmpeg";}
-    progress.setValue(50);
-    QDir dir1(tempPath);
-    int nFiles = dir1.entryList().count();
-    i=1;
-    QString frameNumberString = QString::number(i);
-    while( frameNumberString.length() < 4) frameNumberString.prepend("0");
-    while (QFile::exists(tempPath+"tmp_import"+frameNumberString+".png"))
+    ffmpeg.waitForFinished(-1);
+    qDebug() << "stderr: " << ffmpeg.readAllStandardError();
+    if (frameNumber == currentFrame)
     {
-        progress.setValue(50+i*50/nFiles);
-        if(i>1) scrubForward();
-        importImage(tempPath+"tmp_import"+frameNumberString+".png");
-        i++;
-        frameNumberString = QString::number(i);
-        while( frameNumberString.length() < 4) frameNumberString.prepend("0");
+        qDebug() << "ERROR: No frame was imported.";
+        return;
     }
-    progress.setValue(100);
-    // --------- Clean up temp directory ---------
-    QDir dir(tempPath);
-    QStringList filtername("*.*");
-    QStringList entries = dir.entryList(filtername,QDir::Files,QDir::Type);
-    for(int i=0; i<entries.size(); i++)
-        dir.remove(entries[i]);
 
+    scribbleArea->setModified(currentLayer, currentFrame);
+    updateMaxFrame();
+    timeLine->updateContent();
+    scrubTo(frameNumber-1);
 }
-
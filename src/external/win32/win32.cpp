@@ -247,7 +247,7 @@ void Object::exportMovie(int startFrame, int endFrame, QMatrix view, Layer* curr
 
 
 
-void Editor::importMovie (QString filePath, int fps)
+void Editor::importMovie (QString filePath, int fps, int firstFrame, int frameCount, int width)
 {
 
     int i;
@@ -266,8 +266,13 @@ void Editor::importMovie (QString filePath, int fps)
         progress.show();
         progress.setValue(10);
         QProcess ffmpeg;
-        qDebug() << "./plugins/ffmpeg.exe -i \"" << filePath << "\" -r " << QString::number(fps) << " -f image2 \"" << tempPath << "tmp_import%4d.png\"";
-        ffmpeg.start("./plugins/ffmpeg.exe -i \"" + filePath + "\" -r " + QString::number(fps) + " -f image2 \"" + tempPath + "tmp_import%4d.png\"");
+        QString options = "";
+        if (firstFrame > 1) options += " -ss " + QString::number(double(firstFrame-1)/fps);
+        options += " -i \"" + filePath + "\" -r " + QString::number(fps);
+        if (frameCount > 0) options += " -vframes " + QString::number(frameCount);
+        if (width > 0) options += " -vf scale=" + QString::number(width) + ":-1";
+        qDebug() << "./plugins/ffmpeg.exe" + options + " -f image2 \"" + tempPath + "tmp_import%4d.png\"";
+        ffmpeg.start("./plugins/ffmpeg.exe" + options + " -f image2 \"" + tempPath + "tmp_import%4d.png\"");
         progress.setValue(20);
         if (ffmpeg.waitForStarted() == true)
         {
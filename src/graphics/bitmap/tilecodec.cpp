@@ -0,0 +1,223 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#include "tilecodec.h"
+#include <QVector>
+#include <QtEndian>
+#include <string.h>
+
+// file layout: magic, version, width, height and format of the image (little-endian 32-bit integers),
+// then the tiles, row by row, each starting with its kind
+static const char magic[] = "PTIL";
+static const quint32 version = 1;
+static const int headerSize = 20;
+enum { EMPTY_TILE = 0, UNIFORM_TILE = 1, RUN_TILE = 2 };
+
+const int TileCodec::TILE_SIZE;
+
+static void appendUInt(QByteArray& out, quint32 value)
+{
+    uchar bytes[4];
+    qToLittleEndian(value, bytes);
+    out.append((const char*)bytes, 4);
+}
+
+static void appendVarint(QByteArray& out, quint32 value)
+{
+    while(value >= 0x80)
+    {
+        out.append(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+static bool readVarint(const uchar*& data, const uchar* end, quint32& value)
+{
+    value = 0;
+    for(int shift=0; shift < 35 && data < end; shift += 7)
+    {
+        uchar byte = *data++;
+        value |= quint32(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+static bool isNativeFormat(int format)
+{
+    return format == QImage::Format_ARGB32_Premultiplied || format == QImage::Format_ARGB32 || format == QImage::Format_RGB32;
+}
+
+bool TileCodec::canRead(const QByteArray& data)
+{
+    return data.startsWith(magic);
+}
+
+bool TileCodec::write(const QImage& image, QIODevice* device)
+{
+    // the other formats have at most 32 bits per pixel, and are converted without loss
+    const QImage source = isNativeFormat(image.format()) ? image : image.convertToFormat(QImage::Format_ARGB32);
+    int width = source.width();
+    int height = source.height();
+    QByteArray out;
+    out.append(magic, 4);
+    appendUInt(out, version);
+    appendUInt(out, width);
+    appendUInt(out, height);
+    appendUInt(out, source.format());
+
+    QVector<quint32> tile(TILE_SIZE * TILE_SIZE);
+    quint32* pixels = tile.data();
+    for(int ty=0; ty < height; ty += TILE_SIZE)
+    {
+        for(int tx=0; tx < width; tx += TILE_SIZE)
+        {
+            int w = qMin(TILE_SIZE, width - tx);
+            int h = qMin(TILE_SIZE, height - ty);
+            int count = w * h;
+            for(int y=0; y < h; y++)
+            {
+                memcpy(pixels + y * w, (const quint32*)source.scanLine(ty + y) + tx, w * sizeof(quint32));
+            }
+            int i = 1;
+            while(i < count && pixels[i] == pixels[0]) i++;
+            if(i == count && pixels[0] == 0)
+            {
+                out.append(char(EMPTY_TILE));
+            }
+            else if(i == count)
+            {
+                out.append(char(UNIFORM_TILE));
+                appendUInt(out, pixels[0]);
+            }
+            else
+            {
+                out.append(char(RUN_TILE));
+                encodeRuns(pixels, count, out);
+            }
+        }
+    }
+    return device->write(out) == out.size();
+}
+
+void TileCodec::encodeRuns(const quint32* pixels, int count, QByteArray& out)
+{
+    // each run starts with its length and its kind: a pixel repeated, or pixels written as they are
+    int i = 0;
+    while(i < count)
+    {
+        int j = i + 1;
+        while(j < count && pixels[j] == pixels[i]) j++;
+        if(j - i > 1)
+        {
+            appendVarint(out, (quint32(j - i - 1) << 1) | 1);
+            appendUInt(out, pixels[i]);
+        }
+        else
+        {
+            // a literal run goes on until two equal pixels start a repeated run
+            while(j < count && !(j + 1 < count && pixels[j] == pixels[j + 1])) j++;
+            appendVarint(out, quint32(j - i - 1) << 1);
+            for(int k=i; k < j; k++) appendUInt(out, pixels[k]);
+        }
+        i = j;
+    }
+}
+
+bool TileCodec::decodeRuns(const uchar*& data, const uchar* end, quint32* pixels, int count)
+{
+    int i = 0;
+    while(i < count)
+    {
+        quint32 header;
+        if(!readVarint(data, end, header)) return false;
+        if((header >> 1) >= quint32(count - i)) return false;
+        int length = (header >> 1) + 1;
+        if(header & 1)
+        {
+            if(end - data < 4) return false;
+            quint32 pixel = qFromLittleEndian<quint32>(data);
+            data += 4;
+            for(int k=0; k < length; k++) pixels[i++] = pixel;
+        }
+        else
+        {
+            if(end - data < 4 * length) return false;
+            for(int k=0; k < length; k++)
+            {
+                pixels[i++] = qFromLittleEndian<quint32>(data);
+                data += 4;
+            }
+        }
+    }
+    return true;
+}
+
+QImage TileCodec::read(const QByteArray& data)
+{
+    if(!canRead(data) || data.size() < headerSize) return QImage();
+    const uchar* p = (const uchar*)data.constData();
+    const uchar* end = p + data.size();
+    quint32 fileVersion = qFromLittleEndian<quint32>(p + 4);
+    int width = qFromLittleEndian<quint32>(p + 8);
+    int height = qFromLittleEndian<quint32>(p + 12);
+    int format = qFromLittleEndian<quint32>(p + 16);
+    p += headerSize;
+    if(fileVersion > version || width < 0 || height < 0 || !isNativeFormat(format)) return QImage();
+
+    QImage image(width, height, QImage::Format(format));
+    if(image.isNull()) return image;
+    QVector<quint32> tile(TILE_SIZE * TILE_SIZE);
+    quint32* pixels = tile.data();
+    for(int ty=0; ty < height; ty += TILE_SIZE)
+    {
+        for(int tx=0; tx < width; tx += TILE_SIZE)
+        {
+            int w = qMin(TILE_SIZE, width - tx);
+            int h = qMin(TILE_SIZE, height - ty);
+            if(p >= end) return QImage();
+            uchar kind = *p++;
+            if(kind == EMPTY_TILE || kind == UNIFORM_TILE)
+            {
+                quint32 pixel = 0;
+                if(kind == UNIFORM_TILE)
+                {
+                    if(end - p < 4) return QImage();
+                    pixel = qFromLittleEndian<quint32>(p);
+                    p += 4;
+                }
+                for(int y=0; y < h; y++)
+                {
+                    quint32* line = (quint32*)image.scanLine(ty + y) + tx;
+                    for(int x=0; x < w; x++) line[x] = pixel;
+                }
+            }
+            else if(kind == RUN_TILE)
+            {
+                if(!decodeRuns(p, end, pixels, w * h)) return QImage();
+                for(int y=0; y < h; y++)
+                {
+                    memcpy((quint32*)image.scanLine(ty + y) + tx, pixels + y * w, w * sizeof(quint32));
+                }
+            }
+            else
+            {
+                return QImage();
+            }
+        }
+    }
+    return image;
+}
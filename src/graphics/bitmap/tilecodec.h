@@ -0,0 +1,40 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#ifndef TILECODEC_H
+#define TILECODEC_H
+
+#include <QImage>
+#include <QByteArray>
+#include <QIODevice>
+
+// fast lossless codec for the bitmap frames ("PTL"), much cheaper to encode and decode than PNG
+// the image is cut into tiles: the empty tiles and the tiles of a single colour take a few bytes,
+// and the others are run-length encoded, which suits line art with large transparent regions
+class TileCodec
+{
+public:
+    static const int TILE_SIZE = 64;
+
+    static bool canRead(const QByteArray& data); // true if the data starts with the magic of the codec
+    static QImage read(const QByteArray& data); // returns a null image if the data is not valid
+    static bool write(const QImage& image, QIODevice* device); // the 32-bit formats are kept as they are, so that the image is read back bit for bit
+
+private:
+    static void encodeRuns(const quint32* pixels, int count, QByteArray& out);
+    static bool decodeRuns(const uchar*& data, const uchar* end, quint32* pixels, int count);
+};
+
+#endif
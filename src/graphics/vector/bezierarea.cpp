@@ -50,36 +50,54 @@ void BezierArea::setSelected(bool YesOrNo)
     selected = YesOrNo;
 }
 
-QDomElement BezierArea::createDomElement(QDomDocument& doc)
+void BezierArea::saveXml(QXmlStreamWriter& xml) const
 {
-    QDomElement areaTag = doc.createElement("area");
-    areaTag.setAttribute("colourNumber", colourNumber);
+    xml.writeStartElement("area");
+    xml.writeAttribute("colourNumber", QString::number(colourNumber));
 
     for(int i=0; i < vertex.size() ; i++)
     {
-        QDomElement vertexTag = doc.createElement("vertex");
-        vertexTag.setAttribute("curve", vertex.at(i).curveNumber);
-        vertexTag.setAttribute("vertex", vertex.at(i).vertexNumber);
-        areaTag.appendChild(vertexTag);
+        xml.writeEmptyElement("vertex");
+        xml.writeAttribute("curve", QString::number(vertex.at(i).curveNumber));
+        xml.writeAttribute("vertex", QString::number(vertex.at(i).vertexNumber));
     }
-    return areaTag;
+    xml.writeEndElement();
 }
 
-void BezierArea::loadDomElement(QDomElement element)
+void BezierArea::loadXml(QXmlStreamReader& xml)
 {
-    colourNumber = element.attribute("colourNumber").toInt();
+    colourNumber = xml.attributes().value("colourNumber").toString().toInt();
 
-    QDomNode vertexTag = element.firstChild();
-    while(!vertexTag.isNull())
+    while(xml.readNextStartElement())
     {
-        QDomElement vertexElement = vertexTag.toElement();
-        if(!vertexElement.isNull())
+        if(xml.name() == "vertex")
         {
-            if(vertexElement.tagName() == "vertex")
-            {
-                vertex.append( VertexRef(vertexElement.attribute("curve").toInt() , vertexElement.attribute("vertex").toInt() )  );
-            }
+            QXmlStreamAttributes attributes = xml.attributes();
+            vertex.append( VertexRef(attributes.value("curve").toString().toInt() , attributes.value("vertex").toString().toInt() )  );
         }
-        vertexTag = vertexTag.nextSibling();
+        xml.skipCurrentElement();
+    }
+}
+
+void BezierArea::saveData(QDataStream& out) const
+{
+    out << qint32(colourNumber) << quint32(vertex.size());
+    for(int i=0; i < vertex.size() ; i++)
+    {
+        out << qint32(vertex.at(i).curveNumber) << qint32(vertex.at(i).vertexNumber);
+    }
+}
+
+void BezierArea::loadData(QDataStream& in)
+{
+    qint32 colour;
+    quint32 size;
+    in >> colour >> size;
+    colourNumber = colour;
+    for(quint32 i=0; i < size && in.status() == QDataStream::Ok; i++)
+    {
+        qint32 curveNumber, vertexNumber;
+        in >> curveNumber >> vertexNumber;
+        vertex.append( VertexRef(curveNumber, vertexNumber) );
     }
 }
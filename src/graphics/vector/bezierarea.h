@@ -31,8 +31,10 @@ public:
     //BezierArea(QList<QList<int> > pointList, VectorImage* vectorImage);
     BezierArea(QList<VertexRef> vertexList, int colour);
 
-    QDomElement createDomElement(QDomDocument& doc);
-    void loadDomElement(QDomElement element);
+    void saveXml(QXmlStreamWriter& xml) const;
+    void loadXml(QXmlStreamReader& xml);
+    void saveData(QDataStream& out) const;
+    void loadData(QDataStream& in);
 
     VertexRef getVertexRef(int i);
     int getColourNumber() { return colourNumber; }
@@ -16,7 +16,12 @@ GNU General Public License for more details.
 #include <QtGui>
 #include <math.h>
 #include "beziercurve.h"
-#include "object.h"
+#include "rendercontext.h"
+#include "strokerasterizer.h"
+
+const qreal BezierCurve::LOD_SKIP_SIZE = 0.5;
+const qreal BezierCurve::LOD_POLYLINE_SIZE = 4.0;
+const qreal BezierCurve::LOD_SEGMENT_SIZE = 2.0;
 
 BezierCurve::BezierCurve()
 {
@@ -73,74 +78,120 @@ BezierCurve::BezierCurve(QList<QPointF> pointList, QList<qreal> pressureList, do
 }
 
 
-QDomElement BezierCurve::createDomElement(QDomDocument& doc)
+void BezierCurve::saveXml(QXmlStreamWriter& xml) const
 {
-    QDomElement curveTag = doc.createElement("curve");
-    curveTag.setAttribute("width", width);
-    curveTag.setAttribute("variableWidth", variableWidth);
-    if(feather>0) curveTag.setAttribute("feather", feather);
-    curveTag.setAttribute("invisible", invisible);
-    curveTag.setAttribute("colourNumber", colourNumber);
-    curveTag.setAttribute("originX", origin.x());
-    curveTag.setAttribute("originY", origin.y());
-    curveTag.setAttribute("originPressure", pressure.at(0));
+    xml.writeStartElement("curve");
+    xml.writeAttribute("width", QString::number(width));
+    xml.writeAttribute("variableWidth", QString::number(int(variableWidth)));
+    if(feather>0) xml.writeAttribute("feather", QString::number(feather));
+    xml.writeAttribute("invisible", QString::number(int(invisible)));
+    xml.writeAttribute("colourNumber", QString::number(colourNumber));
+    xml.writeAttribute("originX", QString::number(origin.x()));
+    xml.writeAttribute("originY", QString::number(origin.y()));
+    xml.writeAttribute("originPressure", QString::number(pressure.at(0)));
     for(int i=0; i < c1.size() ; i++)
     {
-        QDomElement segementTag = doc.createElement("segment");
-        segementTag.setAttribute("c1x", c1.at(i).x());
-        segementTag.setAttribute("c1y", c1.at(i).y());
-        segementTag.setAttribute("c2x", c2.at(i).x());
-        segementTag.setAttribute("c2y", c2.at(i).y());
-        segementTag.setAttribute("vx", vertex.at(i).x());
-        segementTag.setAttribute("vy", vertex.at(i).y());
-        segementTag.setAttribute("pressure", pressure.at(i+1));
-        curveTag.appendChild(segementTag);
+        xml.writeEmptyElement("segment");
+        xml.writeAttribute("c1x", QString::number(c1.at(i).x()));
+        xml.writeAttribute("c1y", QString::number(c1.at(i).y()));
+        xml.writeAttribute("c2x", QString::number(c2.at(i).x()));
+        xml.writeAttribute("c2y", QString::number(c2.at(i).y()));
+        xml.writeAttribute("vx", QString::number(vertex.at(i).x()));
+        xml.writeAttribute("vy", QString::number(vertex.at(i).y()));
+        xml.writeAttribute("pressure", QString::number(pressure.at(i+1)));
     }
-    return curveTag;
+    xml.writeEndElement();
 }
 
-void BezierCurve::loadDomElement(QDomElement element)
+void BezierCurve::loadXml(QXmlStreamReader& xml)
 {
-    width = element.attribute("width").toDouble();
-    variableWidth = (element.attribute("variableWidth") == "1");
-    feather = element.attribute("feather").toDouble();
-    invisible = (element.attribute("invisible") == "1");
+    QXmlStreamAttributes attributes = xml.attributes();
+    width = attributes.value("width").toString().toDouble();
+    variableWidth = (attributes.value("variableWidth") == "1");
+    feather = attributes.value("feather").toString().toDouble();
+    invisible = (attributes.value("invisible") == "1");
     if(width == 0) invisible = true;
-    colourNumber = element.attribute("colourNumber").toInt();
-    origin = QPointF( element.attribute("originX").toFloat(), element.attribute("originY").toFloat() );
-    pressure.append( element.attribute("originPressure").toFloat() );
-    selected.append(false);
+    colourNumber = attributes.value("colourNumber").toString().toInt();
+    origin = QPointF( attributes.value("originX").toString().toFloat(), attributes.value("originY").toString().toFloat() );
+    invalidateLod();
+    pressure.append( attributes.value("originPressure").toString().toFloat() );
+    insertSelected(selected.size(), false);
 
-    QDomNode segmentTag = element.firstChild();
-    while(!segmentTag.isNull())
+    while(xml.readNextStartElement())
     {
-        QDomElement segmentElement = segmentTag.toElement();
-        if(!segmentElement.isNull())
+        if(xml.name() == "segment")
         {
-            if(segmentElement.tagName() == "segment")
-            {
-                QPointF c1Point = QPointF(segmentElement.attribute("c1x").toFloat(), segmentElement.attribute("c1y").toFloat());
-                QPointF c2Point = QPointF(segmentElement.attribute("c2x").toFloat(), segmentElement.attribute("c2y").toFloat());
-                QPointF vertexPoint = QPointF(segmentElement.attribute("vx").toFloat(), segmentElement.attribute("vy").toFloat());
-                qreal pressureValue = segmentElement.attribute("pressure").toFloat();
-                appendCubic(c1Point, c2Point, vertexPoint, pressureValue);
-            }
+            QXmlStreamAttributes segment = xml.attributes();
+            QPointF c1Point = QPointF(segment.value("c1x").toString().toFloat(), segment.value("c1y").toString().toFloat());
+            QPointF c2Point = QPointF(segment.value("c2x").toString().toFloat(), segment.value("c2y").toString().toFloat());
+            QPointF vertexPoint = QPointF(segment.value("vx").toString().toFloat(), segment.value("vy").toString().toFloat());
+            qreal pressureValue = segment.value("pressure").toString().toFloat();
+            appendCubic(c1Point, c2Point, vertexPoint, pressureValue);
         }
-        segmentTag = segmentTag.nextSibling();
+        xml.skipCurrentElement();
+    }
+}
+
+void BezierCurve::saveData(QDataStream& out) const
+{
+    // the values are written as doubles, so that nothing is rounded
+    out << double(width) << variableWidth << double(feather) << invisible << qint32(colourNumber);
+    out << double(origin.x()) << double(origin.y()) << quint32(vertex.size());
+    for(int i=0; i < pressure.size(); i++) out << double(pressure.at(i));
+    for(int i=0; i < vertex.size(); i++)
+    {
+        out << double(c1.at(i).x()) << double(c1.at(i).y());
+        out << double(c2.at(i).x()) << double(c2.at(i).y());
+        out << double(vertex.at(i).x()) << double(vertex.at(i).y());
+    }
+}
+
+bool BezierCurve::loadData(QDataStream& in)
+{
+    double widthValue, featherValue, originX, originY;
+    qint32 colour;
+    quint32 size;
+    in >> widthValue >> variableWidth >> featherValue >> invisible >> colour >> originX >> originY >> size;
+    width = widthValue;
+    feather = featherValue;
+    if(width == 0) invisible = true;
+    colourNumber = colour;
+    origin = QPointF(originX, originY);
+    invalidateLod();
+
+    QVector<double> pressureValues;
+    for(quint32 i=0; i <= size && in.status() == QDataStream::Ok; i++)
+    {
+        double value;
+        in >> value;
+        pressureValues.append(value);
     }
+    if(in.status() != QDataStream::Ok) return false;
+    pressure.append(pressureValues.at(0));
+    insertSelected(selected.size(), false);
+    for(quint32 i=0; i < size; i++)
+    {
+        double c1x, c1y, c2x, c2y, vx, vy;
+        in >> c1x >> c1y >> c2x >> c2y >> vx >> vy;
+        if(in.status() != QDataStream::Ok) return false; // a segment cut short is not appended
+        appendCubic(QPointF(c1x, c1y), QPointF(c2x, c2y), QPointF(vx, vy), pressureValues.at(i+1));
+    }
+    return true;
 }
 
 
 void BezierCurve::setOrigin(const QPointF& point)
 {
     origin = point;
+    invalidateLod();
 }
 
 void BezierCurve::setOrigin(const QPointF& point, const qreal& pressureValue, const bool& trueOrFalse)
 {
     origin = point;
     pressure[0] = pressureValue;
-    selected[0] = trueOrFalse;
+    invalidateLod();
+    selected.setBit(0, trueOrFalse);
 }
 
 void BezierCurve::setC1(int i, const QPointF& point)
@@ -148,6 +199,7 @@ void BezierCurve::setC1(int i, const QPointF& point)
     if( i >= 0 || i < c1.size() )
     {
         c1[i] = point;
+        invalidateLod();
     }
     else
     {
@@ -160,6 +212,7 @@ void BezierCurve::setC2(int i, const QPointF& point)
     if( i >= 0 || i < c2.size() )
     {
         c2[i] = point;
+        invalidateLod();
     }
     else
     {
@@ -169,12 +222,13 @@ void BezierCurve::setC2(int i, const QPointF& point)
 
 void BezierCurve::setVertex(int i, const QPointF& point)
 {
-    if(i==-1) { origin = point; }
+    if(i==-1) { origin = point; invalidateLod(); }
     else
     {
         if( i >= 0 || i < vertex.size() )
         {
             vertex[i] = point;
+            invalidateLod();
         }
         else
         {
@@ -188,6 +242,7 @@ void BezierCurve::setLastVertex(const QPointF& point)
     if(vertex.size()>0)
     {
         vertex[vertex.size()-1] = point;
+        invalidateLod();
     }
     else
     {
@@ -218,7 +273,29 @@ void BezierCurve::setInvisibility(bool YesOrNo)
 
 void BezierCurve::setSelected(int i, bool YesOrNo)
 {
-    selected[i+1] = YesOrNo;
+    selected.setBit(i+1, YesOrNo);
+}
+
+void BezierCurve::insertSelected(int i, bool YesOrNo)
+{
+    // QBitArray has no insert(), so we shift the bits after i by hand
+    int n = selected.size();
+    selected.resize(n+1);
+    for(int k=n; k>i; k--)
+    {
+        selected.setBit(k, selected.testBit(k-1));
+    }
+    selected.setBit(i, YesOrNo);
+}
+
+void BezierCurve::removeSelected(int i)
+{
+    int n = selected.size();
+    for(int k=i; k<n-1; k++)
+    {
+        selected.setBit(k, selected.testBit(k+1));
+    }
+    selected.resize(n-1);
 }
 
 BezierCurve BezierCurve::transformed(QMatrix transformation)
@@ -266,6 +343,7 @@ void BezierCurve::transform(QMatrix transformation)
             vertex[i] = transformation.map(vertex.at(i));
         }
     }
+    invalidateLod();
     //smoothCurve();
 }
 
@@ -275,7 +353,8 @@ void BezierCurve::appendCubic(const QPointF& c1Point, const QPointF& c2Point, co
     c2.append(c2Point);
     vertex.append(vertexPoint);
     pressure.append(pressureValue);
-    selected.append(false);
+    insertSelected(selected.size(), false);
+    invalidateLod();
 }
 
 void BezierCurve::addPoint(int position, const QPointF point)
@@ -294,7 +373,8 @@ void BezierCurve::addPoint(int position, const QPointF point)
         c2.insert(position, point - 0.2*(v2-v1));
         vertex.insert(position, point);
         pressure.insert(position, getPressure(position));
-        selected.insert(position, isSelected(position) && isSelected(position-1));
+        insertSelected(position, isSelected(position) && isSelected(position-1));
+        invalidateLod();
 
         //smoothCurve();
     }
@@ -329,7 +409,8 @@ void BezierCurve::addPoint(int position, const qreal t)    // t is the fraction
         c2.insert(position, cA2);
         vertex.insert(position, vM);
         pressure.insert(position, getPressure(position));
-        selected.insert(position, isSelected(position) && isSelected(position-1));
+        insertSelected(position, isSelected(position) && isSelected(position-1));
+        invalidateLod();
 
         //smoothCurve();
     }
@@ -347,48 +428,88 @@ void BezierCurve::removeVertex(int i)
         if(i== -1)
         {
             origin = vertex.at(0);
-            vertex.removeAt(0);
-            c1.removeAt(0);
-            c2.removeAt(0);
-            pressure.removeAt(0);
-            selected.removeAt(0);
+            vertex.remove(0);
+            c1.remove(0);
+            c2.remove(0);
+            pressure.remove(0);
+            removeSelected(0);
         }
         else
         {
-            vertex.removeAt(i);
-            c2.removeAt(i);
-            pressure.removeAt(i+1);
-            selected.removeAt(i+1);
+            vertex.remove(i);
+            c2.remove(i);
+            pressure.remove(i+1);
+            removeSelected(i+1);
             if( i != n-1 )
             {
-                c1.removeAt(i+1);
+                c1.remove(i+1);
             }
             else
             {
-                c1.removeAt(i);
+                c1.remove(i);
             }
         }
+        invalidateLod();
     }
 }
 
-void BezierCurve::drawPath(QPainter& painter, Object* object, QMatrix transformation, bool simplified, bool showThinLines, qreal opacity)
+void BezierCurve::drawPath(QPainter& painter, const RenderContext& context, QMatrix transformation, bool simplified, bool showThinLines, qreal opacity)
 {
     if(!simplified) painter.setOpacity(opacity);
-    QColor colour = object->getColour(colourNumber).colour;
+    QColor colour = context.getColour(colourNumber);
+    QPen pen = context.getPen(colourNumber);
 
     //simplified = true;
     //if(selected) { painter.setMatrix(transformation); } else { painter.setMatrix(QMatrix()); }
     //QColor colour = object->getColour(colourNumber).colour;
-    if(!simplified) painter.setOpacity(opacity);
     BezierCurve myCurve;
     if(isPartlySelected()) { myCurve = (transformed(transformation)); }
     else { myCurve = *this; }
+
+    // level of detail: curves which are small on screen are skipped or drawn as polylines (selected curves are always drawn in full)
+    QPolygonF lodPolygon;
+    if(!isPartlySelected() && !vertex.isEmpty())
+    {
+        qreal scale = qAbs(painter.worldMatrix().m11()) + qAbs(painter.worldMatrix().m12()); // overestimates the zoom factor, so curves are never wrongly skipped
+        QRectF rect = getControlPointRect();
+        qreal screenSize = scale*qMax(rect.width(), rect.height()) + scale*width;
+        if(screenSize < LOD_SKIP_SIZE) return;
+        if(screenSize < LOD_POLYLINE_SIZE)
+        {
+            lodPolygon << origin;
+            for(int i=0; i<vertex.size(); i++) lodPolygon << vertex.at(i);
+        }
+        else if(screenSize < LOD_SEGMENT_SIZE*vertex.size() && scale > 0.0)
+        {
+            lodPolygon = getLodPolygon(0.5/scale); // half a pixel
+        }
+    }
     //if(variableWidth && !simplified && width != 0) {
     if( variableWidth && !simplified && !invisible)
     {
-        painter.setPen(QPen(QBrush(colour), 1, Qt::NoPen, Qt::RoundCap,Qt::RoundJoin));
-        painter.setBrush(colour);
-        painter.drawPath(myCurve.getStrokedPath());
+        painter.setPen(Qt::NoPen);
+        painter.setBrush(context.getBrush(colourNumber));
+        if(!lodPolygon.isEmpty())
+        {
+            // draws the polyline with the average width of the variable width stroke (getStrokedPath draws it at 2*width*pressure)
+            qreal averagePressure = 0.0;
+            for(int i=0; i<pressure.size(); i++) averagePressure += pressure.at(i);
+            averagePressure = averagePressure/pressure.size();
+            pen.setWidthF(2.0*width*averagePressure);
+            painter.setPen(pen);
+            painter.setBrush(Qt::NoBrush);
+            painter.drawPolyline(lodPolygon);
+        }
+        else if( !StrokeRasterizer::drawVariableWidthCurve(painter, myCurve, context.getPremultipliedColour(colourNumber)) )
+        {
+            painter.drawPath(myCurve.getStrokedPath());
+        }
+#ifdef CHECK_STROKE_RASTERIZER
+        else
+        {
+            StrokeRasterizer::matchesPathFiller(myCurve, painter.worldMatrix(), QSize(painter.device()->width(), painter.device()->height()), 16);
+        }
+#endif
         /*QPen pen;
         pen.setColor(colour);
         QPointF P1 = origin;
@@ -421,12 +542,14 @@ void BezierCurve::drawPath(QPainter& painter, Object* object, QMatrix transforma
             {
                 if(simplified)
                 {
-                    painter.setPen(QPen(QBrush(colour), renderedWidth, Qt::SolidLine, Qt::RoundCap,Qt::RoundJoin));
+                    pen.setWidthF(renderedWidth);
                 }
                 else
                 {
-                    painter.setPen(QPen(QBrush(colour), 0, Qt::DotLine, Qt::RoundCap,Qt::RoundJoin));
+                    pen.setWidthF(0);
+                    pen.setStyle(Qt::DotLine);
                 }
+                painter.setPen(pen);
             }
             else
             {
@@ -435,9 +558,17 @@ void BezierCurve::drawPath(QPainter& painter, Object* object, QMatrix transforma
         }
         else
         {
-            painter.setPen(QPen(QBrush(colour), renderedWidth, Qt::SolidLine, Qt::RoundCap,Qt::RoundJoin));
+            pen.setWidthF(renderedWidth);
+            painter.setPen(pen);
+        }
+        if(!lodPolygon.isEmpty())
+        {
+            painter.drawPolyline(lodPolygon);
+        }
+        else
+        {
+            painter.drawPath(myCurve.getSimplePath());
         }
-        painter.drawPath(myCurve.getSimplePath());
     }
 
     if(!simplified)
@@ -564,20 +695,90 @@ QRectF BezierCurve::getBoundingRect()
     return getSimplePath().boundingRect();
 }
 
+QRectF BezierCurve::getControlPointRect() const
+{
+    // the curve is contained in the convex hull of its control points, so this is a cheap (slightly larger) bounding box
+    qreal left = origin.x();
+    qreal right = origin.x();
+    qreal top = origin.y();
+    qreal bottom = origin.y();
+    for(int i=0; i<vertex.size(); i++)
+    {
+        const QPointF points[3] = { c1.at(i), c2.at(i), vertex.at(i) };
+        for(int k=0; k<3; k++)
+        {
+            if(points[k].x() < left) left = points[k].x();
+            if(points[k].x() > right) right = points[k].x();
+            if(points[k].y() < top) top = points[k].y();
+            if(points[k].y() > bottom) bottom = points[k].y();
+        }
+    }
+    return QRectF(QPointF(left, top), QPointF(right, bottom));
+}
+
+QPolygonF BezierCurve::getLodPolygon(qreal tolerance) const
+{
+    // the tolerance is rounded down to a power of two, so that a few cached variants cover all the zoom levels
+    int level = (int)floor( log(tolerance)/log(2.0) );
+    QMutexLocker locker(&lodCache.mutex); // held during the computation, so that a polygon is only computed once (only the threads painting this curve wait)
+    QMap<int, QPolygonF>::const_iterator cached = lodCache.polygons.constFind(level);
+    if(cached != lodCache.polygons.constEnd()) return cached.value();
+    qreal levelTolerance = pow(2.0, level);
+
+    // flattens each cubic section into a number of points depending on its length (measured along the control polygon)
+    QList<QPointF> pointList;
+    pointList << origin;
+    for(int i=0; i<vertex.size(); i++)
+    {
+        qreal length = mLength(c1.at(i)-getVertex(i-1)) + mLength(c2.at(i)-c1.at(i)) + mLength(vertex.at(i)-c2.at(i));
+        int nSteps = qBound(1, (int)sqrt(length/levelTolerance), 16);
+        for(int k=1; k<=nSteps; k++)
+        {
+            pointList << getPointOnCubic(i, (k+0.0)/nSteps);
+        }
+    }
+
+    // then removes the points which are not needed with the Douglas-Peucker algorithm
+    int n = pointList.size();
+    QList<bool> markList;
+    for(int i=0; i<n; i++) { markList.append(false); }
+    markList.replace(0, true);
+    markList.replace(n-1, true);
+    simplify(levelTolerance, pointList, 0, n-1, markList);
+
+    QPolygonF polygon;
+    for(int i=0; i<n; i++)
+    {
+        if(markList.at(i)) polygon << pointList.at(i);
+    }
+    lodCache.polygons.insert(level, polygon);
+    return polygon;
+}
+
+void BezierCurve::invalidateLod()
+{
+    QMutexLocker locker(&lodCache.mutex); // a lock of this curve only, so it is not contended
+    if(!lodCache.polygons.isEmpty()) lodCache.polygons.clear();
+}
+
 void BezierCurve::createCurve(QList<QPointF>& pointList, QList<qreal>& pressureList )
 {
     int p = 0;
     int n = pointList.size();
     // generate the Bezier (cubic) curve from the simplified path and mouse pressure
     // first, empty everything
-    while(c1.size()>0) c1.removeAt(0);
-    while(c2.size()>0) c2.removeAt(0);
-    while(vertex.size()>0) vertex.removeAt(0);
-    while(selected.size()>0) selected.removeAt(0);
-    while(pressure.size()>0) pressure.removeAt(0);
+    c1.clear();
+    c2.clear();
+    vertex.clear();
+    pressure.clear();
+    invalidateLod();
+    c1.reserve(n-1);
+    c2.reserve(n-1);
+    vertex.reserve(n-1);
+    pressure.reserve(n);
+    selected.fill(false, n); // resizes the bitset to n elements, all unselected
 
     setOrigin( pointList.at(0) );
-    selected.append(false);
     pressure.append(pressureList.at(0));
 
     for(p=1; p<n; p++)
@@ -586,8 +787,6 @@ void BezierCurve::createCurve(QList<QPointF>& pointList, QList<qreal>& pressureL
         c2.append(pointList.at(p));
         vertex.append(pointList.at(p));
         pressure.append(pressureList.at(p));
-        selected.append(false);
-
     }
     smoothCurve();
     //colourNumber = 0;
@@ -638,6 +837,7 @@ void BezierCurve::smoothCurve()
         this->c1[n-1] = c2old;
         this->c2[n-1] = 0.5*(c2old+vertex.at(n-1));
     }
+    invalidateLod();
 }
 
 /* --- old code ---
@@ -761,7 +961,7 @@ void BezierCurve::normalise(QPointF& point)
     }
 }
 
-qreal BezierCurve::findDistance(BezierCurve curve, int i, QPointF P, QPointF& nearestPoint, qreal& t)   //finds the distance between a cubic section and a point
+qreal BezierCurve::findDistance(const BezierCurve& curve, int i, QPointF P, QPointF& nearestPoint, qreal& t)   //finds the distance between a cubic section and a point
 {
     //qDebug() << "---- INTER CUBIC SEGMENT";
     int nSteps = 24;
@@ -788,7 +988,7 @@ qreal BezierCurve::findDistance(BezierCurve curve, int i, QPointF P, QPointF& ne
     return distMin;
 }
 
-QPointF BezierCurve::getPointOnCubic(int i, qreal t)
+QPointF BezierCurve::getPointOnCubic(int i, qreal t) const
 {
     return (1.0-t)*(1.0-t)*(1.0-t)*getVertex(i-1)
            + 3*t*(1.0-t)*(1.0-t)*getC1(i)
@@ -821,7 +1021,7 @@ bool BezierCurve::intersects(QRectF rectangle)
     return result;
 }
 
-bool BezierCurve::findIntersection(BezierCurve curve1, int i1, BezierCurve curve2, int i2, QList<Intersection>& intersections)   //finds the intersection between two cubic sections
+bool BezierCurve::findIntersection(const BezierCurve& curve1, int i1, const BezierCurve& curve2, int i2, QList<Intersection>& intersections)   //finds the intersection between two cubic sections
 {
     bool result = false;
     //qDebug() << "---- INTER CUBIC CUBIC"  << i1 << i2;
@@ -19,7 +19,7 @@ GNU General Public License for more details.
 #include <QtGui>
 #include <QtXml>
 
-class Object;
+class RenderContext;
 
 struct Intersection
 {
@@ -37,8 +37,10 @@ public:
     BezierCurve(QList<QPointF> pointList);
     BezierCurve(QList<QPointF> pointList, QList<qreal> pressureList, double tol);
 
-    QDomElement createDomElement(QDomDocument& doc);
-    void loadDomElement(QDomElement element);
+    void saveXml(QXmlStreamWriter& xml) const;
+    void loadXml(QXmlStreamReader& xml);
+    void saveData(QDataStream& out) const;
+    bool loadData(QDataStream& in); // returns false if the stream ends before the curve (which must then be discarded)
 
     qreal getWidth() const { return width; }
     qreal getFeather() const { return feather; }
@@ -51,9 +53,9 @@ public:
     QPointF getC1(int i) const { return c1.at(i); }
     QPointF getC2(int i) const { return c2.at(i); }
     qreal getPressure(int i) const { return pressure.at(i); }
-    bool isSelected(int i) const { return selected.at(i+1); }
-    bool isSelected() const { bool result=true; for(int i=0; i<selected.size(); i++) result = result && selected[i]; return result; }
-    bool isPartlySelected() const { bool result=false; for(int i=0; i<selected.size(); i++) result = result || selected[i]; return result; }
+    bool isSelected(int i) const { return selected.testBit(i+1); }
+    bool isSelected() const { return selected.count(true) == selected.size(); }
+    bool isPartlySelected() const { return selected.count(true) > 0; }
     bool isInvisible() const { return invisible; }
     bool intersects(QPointF point, qreal distance);
     bool intersects(QRectF rectangle);
@@ -69,7 +71,7 @@ public:
     void setVariableWidth(bool YesOrNo);
     void setInvisibility(bool YesOrNo);
     void setColourNumber(int colourNumber) { this->colourNumber = colourNumber; }
-    void setSelected(bool YesOrNo) { for(int i=0; i<selected.size(); i++) { selected[i] = YesOrNo; } }
+    void setSelected(bool YesOrNo) { selected.fill(YesOrNo); }
     void setSelected(int i, bool YesOrNo);
 
     BezierCurve transformed(QMatrix transformation);
@@ -78,15 +80,17 @@ public:
     void appendCubic(const QPointF& c1Point, const QPointF& c2Point, const QPointF& vertexPoint, qreal pressureValue);
     void addPoint(int position, const QPointF point);
     void addPoint(int position, const qreal t);
-    QPointF getPointOnCubic(int i, qreal t);
+    QPointF getPointOnCubic(int i, qreal t) const;
     void removeVertex(int i);
     QPainterPath getSimplePath();
     QPainterPath getStrokedPath();
     QPainterPath getStrokedPath(qreal width);
     QPainterPath getStrokedPath(qreal width, bool pressure);
     QRectF getBoundingRect();
+    QRectF getControlPointRect() const;
+    QPolygonF getLodPolygon(qreal tolerance) const; // returns a polyline approximating the curve within tolerance (cached per level of detail)
 
-    void drawPath(QPainter& painter, Object* object, QMatrix transformation, bool simplified, bool showThinLines, qreal opacity);
+    void drawPath(QPainter& painter, const RenderContext& context, QMatrix transformation, bool simplified, bool showThinLines, qreal opacity);
     void createCurve(QList<QPointF>& pointList, QList<qreal>& pressureList );
     void smoothCurve();
 
@@ -96,22 +100,45 @@ public:
     static qreal eLength(const QPointF point); // returns the Euclidean length of a point (seen as a vector)
     static qreal mLength(const QPointF point); // returns the Manhattan length of a point (seen as a vector)
     static void normalise(QPointF& point); // normalises a point (seen as a vector);
-    static qreal findDistance(BezierCurve curve, int i, QPointF P, QPointF& nearestPoint, qreal& t); //finds the distance between a cubic section and a point
-    static bool findIntersection(BezierCurve curve1, int i1, BezierCurve curve2, int i2, QList<Intersection>& intersections); //finds the intersection between two cubic sections
+    static qreal findDistance(const BezierCurve& curve, int i, QPointF P, QPointF& nearestPoint, qreal& t); //finds the distance between a cubic section and a point
+    static bool findIntersection(const BezierCurve& curve1, int i1, const BezierCurve& curve2, int i2, QList<Intersection>& intersections); //finds the intersection between two cubic sections
+
+    // level of detail used when the curve is small on screen (sizes are in pixels)
+    static const qreal LOD_SKIP_SIZE; // curves smaller than this are not drawn
+    static const qreal LOD_POLYLINE_SIZE; // curves smaller than this are drawn as a polyline through their vertices
+    static const qreal LOD_SEGMENT_SIZE; // curves whose sections are smaller than this on average are drawn with a simplified polyline
 
 private:
+    void invalidateLod();
+    void insertSelected(int i, bool YesOrNo); // inserts a bit at position i in the selection bitset
+    void removeSelected(int i); // removes the bit at position i in the selection bitset
+
+    // the points are stored as separate contiguous arrays (QVector is implicitly shared, so copying a curve is cheap)
     QPointF origin;
-    QList<QPointF> c1;
-    QList<QPointF> c2;
-    QList<QPointF> vertex;
-    QList<qreal> pressure; // this list has one more element than the other list (the first element is for the origin)
+    QVector<QPointF> c1;
+    QVector<QPointF> c2;
+    QVector<QPointF> vertex;
+    QVector<qreal> pressure; // this array has one more element than the other arrays (the first element is for the origin)
     int colourNumber;
     qreal width;
     qreal feather;
     bool variableWidth;
     //bool selected;
     bool invisible;
-    QList<bool> selected; // this list has one more element than the other list (the first element is for the origin)
+    QBitArray selected; // this bitset has one more element than the other arrays (the first element is for the origin)
+
+    // simplified polylines, indexed by log2 of their tolerance, with a lock of their own
+    // (the curves of a drawing held across frames may be painted by several export threads; copying a curve copies the polylines, not the lock)
+    struct LodCache
+    {
+        LodCache() {}
+        LodCache(const LodCache& other) : polygons(other.copy()) {}
+        LodCache& operator=(const LodCache& other) { QMap<int, QPolygonF> p = other.copy(); QMutexLocker locker(&mutex); polygons = p; return *this; }
+        QMap<int, QPolygonF> copy() const { QMutexLocker locker(&mutex); return polygons; }
+        mutable QMutex mutex;
+        QMap<int, QPolygonF> polygons;
+    };
+    mutable LodCache lodCache;
 };
 
 #endif
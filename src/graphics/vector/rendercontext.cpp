@@ -0,0 +1,44 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#include <QtGui>
+#include "rendercontext.h"
+
+RenderContext::RenderContext()
+{
+    append(Qt::white);
+}
+
+RenderContext::RenderContext(const QList<ColourRef>& palette)
+{
+    colours.reserve(palette.size()+1);
+    premultipliedColours.reserve(palette.size()+1);
+    brushes.reserve(palette.size()+1);
+    pens.reserve(palette.size()+1);
+    for(int i=0; i<palette.size(); i++)
+    {
+        append(palette.at(i).colour);
+    }
+    append(Qt::white);
+}
+
+void RenderContext::append(const QColor& colour)
+{
+    int alpha = colour.alpha();
+    colours.append(colour);
+    premultipliedColours.append( qRgba(colour.red()*alpha/255, colour.green()*alpha/255, colour.blue()*alpha/255, alpha) );
+    brushes.append( QBrush(colour) );
+    pens.append( QPen(QBrush(colour), 1, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin) );
+}
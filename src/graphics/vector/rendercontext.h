@@ -0,0 +1,48 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#ifndef RENDERCONTEXT_H
+#define RENDERCONTEXT_H
+
+#include <QtGui>
+#include "colourref.h"
+
+// the palette of an object resolved into ready-made colours, pens and brushes
+// it is built once (see Object::paletteModification) and only rebuilt when the palette changes;
+// all the members are implicitly shared, so a copy can be handed to another thread
+class RenderContext
+{
+public:
+    RenderContext();
+    RenderContext(const QList<ColourRef>& palette);
+
+    int getColourCount() const { return colours.size()-1; }
+    const QColor& getColour(int i) const { return colours.at(index(i)); }
+    QRgb getPremultipliedColour(int i) const { return premultipliedColours.at(index(i)); }
+    const QBrush& getBrush(int i) const { return brushes.at(index(i)); }
+    const QPen& getPen(int i) const { return pens.at(index(i)); } // solid round pen of width 1, to be adjusted by the caller
+
+private:
+    // out of range colour numbers are mapped to the last entry, which is white (as in Object::getColour)
+    int index(int i) const { return (i > -1 && i < colours.size()-1) ? i : colours.size()-1; }
+    void append(const QColor& colour);
+
+    QVector<QColor> colours;
+    QVector<QRgb> premultipliedColours;
+    QVector<QBrush> brushes;
+    QVector<QPen> pens;
+};
+
+#endif
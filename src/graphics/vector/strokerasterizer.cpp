@@ -0,0 +1,220 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#include <QtGui>
+#include <math.h>
+#include "strokerasterizer.h"
+#include "beziercurve.h"
+
+StrokeRasterizer::StrokeRasterizer()
+{
+    // nothing
+}
+
+bool StrokeRasterizer::drawVariableWidthCurve(QPainter& painter, const BezierCurve& curve, QRgb premultipliedColour)
+{
+    int n = curve.getVertexSize();
+    QPaintDevice* device = painter.device();
+    if(n == 0 || device == NULL) return false;
+    // the other engines (printer, PDF, SVG) keep the stroke as a vector path
+    if(painter.paintEngine() == NULL || painter.paintEngine()->type() != QPaintEngine::Raster) return false;
+    // without antialiasing, the path filler gives the expected (aliased) result
+    if( !(painter.renderHints() & QPainter::Antialiasing) ) return false;
+    if( painter.viewTransformEnabled() ) return false;
+
+    // only similarity transformations (rotation and uniform scaling) are supported, so that round caps stay round
+    QMatrix matrix = painter.worldMatrix();
+    if( qAbs(matrix.m11()-matrix.m22()) > 0.0001 || qAbs(matrix.m12()+matrix.m21()) > 0.0001 ) return false;
+    qreal scale = sqrt( matrix.m11()*matrix.m11() + matrix.m12()*matrix.m12() );
+    if(scale == 0.0) return false;
+
+    // flattens the curve in device coordinates, with the same half widths as BezierCurve::getStrokedPath() (which strokes at 2*width)
+    qreal width = curve.getWidth();
+    QVector<QPointF> points;
+    QVector<qreal> radii;
+    qreal previousRadius = width*curve.getPressure(0);
+    if(n==1 && previousRadius == 0.0) previousRadius = 0.3*width;
+    points.append( matrix.map(curve.getOrigin()) );
+    radii.append( scale*previousRadius );
+    for(int i=0; i<n; i++)
+    {
+        qreal radius = width*curve.getPressure(i);
+        if(n==1 && radius == 0.0) radius = 0.3*width;
+        QPointF P0 = matrix.map(curve.getVertex(i-1));
+        QPointF C1 = matrix.map(curve.getC1(i));
+        QPointF C2 = matrix.map(curve.getC2(i));
+        QPointF P1 = matrix.map(curve.getVertex(i));
+        qreal length = BezierCurve::eLength(C1-P0) + BezierCurve::eLength(C2-C1) + BezierCurve::eLength(P1-C2);
+        int nSteps = qBound(1, (int)(length/4.0), 64); // one segment every 4 pixels or so
+        for(int k=1; k<=nSteps; k++)
+        {
+            qreal t = (k+0.0)/nSteps;
+            points.append( matrix.map(curve.getPointOnCubic(i, t)) );
+            radii.append( scale*( (1.0-t)*previousRadius + t*radius ) );
+        }
+        previousRadius = radius;
+    }
+
+    // bounding box of the stroke on the device
+    qreal left = points.at(0).x();
+    qreal right = left;
+    qreal top = points.at(0).y();
+    qreal bottom = top;
+    for(int i=0; i<points.size(); i++)
+    {
+        qreal r = radii.at(i) + 1.0;
+        left = qMin(left, points.at(i).x() - r);
+        right = qMax(right, points.at(i).x() + r);
+        top = qMin(top, points.at(i).y() - r);
+        bottom = qMax(bottom, points.at(i).y() + r);
+    }
+    QRect box = QRect( QPoint((int)floor(left), (int)floor(top)), QPoint((int)ceil(right), (int)ceil(bottom)) );
+    box = box.intersected( QRect(0, 0, device->width(), device->height()) );
+    if(box.isEmpty()) return true; // nothing to draw
+    if(box.width() > 4096 || box.height() > 4096) return false;
+
+    // sweeps the segments into a coverage buffer (the union of the segments is the maximum of their coverages)
+    QVector<uchar> coverage(box.width()*box.height(), 0);
+    for(int i=1; i<points.size(); i++)
+    {
+        sweepSegment(coverage.data(), box, points.at(i-1), radii.at(i-1), points.at(i), radii.at(i));
+    }
+
+    // converts the coverage into premultiplied pixels of the stroke colour
+    QRgb lut[256];
+    for(int c=0; c<256; c++)
+    {
+        lut[c] = qRgba( qRed(premultipliedColour)*c/255, qGreen(premultipliedColour)*c/255, qBlue(premultipliedColour)*c/255, qAlpha(premultipliedColour)*c/255 );
+    }
+    QImage image(box.size(), QImage::Format_ARGB32_Premultiplied);
+    const uchar* source = coverage.constData();
+    for(int y=0; y<box.height(); y++)
+    {
+        QRgb* line = (QRgb*)image.scanLine(y);
+        for(int x=0; x<box.width(); x++)
+        {
+            line[x] = lut[ *source++ ];
+        }
+    }
+
+    painter.save();
+    painter.resetMatrix();
+    painter.drawImage(box.topLeft(), image);
+    painter.restore();
+    return true;
+}
+
+bool StrokeRasterizer::matchesPathFiller(const BezierCurve& curve, const QMatrix& matrix, QSize size, int tolerance)
+{
+    // draws the stroke in black with this rasterizer and with the path filler of QPainter, then compares the coverages
+    QImage swept(size, QImage::Format_ARGB32_Premultiplied);
+    swept.fill(0);
+    QPainter painter1(&swept);
+    painter1.setRenderHint(QPainter::Antialiasing, true);
+    painter1.setWorldMatrix(matrix);
+    bool drawn = drawVariableWidthCurve(painter1, curve, qRgba(0, 0, 0, 255));
+    painter1.end();
+    if(!drawn) return true; // the path filler is used anyway
+
+    QImage filled(size, QImage::Format_ARGB32_Premultiplied);
+    filled.fill(0);
+    BezierCurve stroke = curve;
+    QPainter painter2(&filled);
+    painter2.setRenderHint(QPainter::Antialiasing, true);
+    painter2.setWorldMatrix(matrix);
+    painter2.setPen(Qt::NoPen);
+    painter2.setBrush(Qt::black);
+    painter2.drawPath(stroke.getStrokedPath());
+    painter2.end();
+
+    // the end caps are not exactly the same shape (the path ends with a cubic, not a half disc): a few pixels may differ more
+    int covered = 0;
+    int different = 0;
+    for(int y=0; y<size.height(); y++)
+    {
+        const QRgb* line1 = (const QRgb*)swept.scanLine(y);
+        const QRgb* line2 = (const QRgb*)filled.scanLine(y);
+        for(int x=0; x<size.width(); x++)
+        {
+            int alpha1 = qAlpha(line1[x]);
+            int alpha2 = qAlpha(line2[x]);
+            if(alpha1 != 0 || alpha2 != 0) covered++;
+            if(qAbs(alpha1-alpha2) > tolerance) different++;
+        }
+    }
+    if(different > covered/50)
+    {
+        qDebug() << "StrokeRasterizer: " << different << "pixels out of" << covered << "differ from the path filler by more than" << tolerance;
+        return false;
+    }
+    return true;
+}
+
+void StrokeRasterizer::sweepSegment(uchar* coverage, const QRect& box, QPointF P0, qreal r0, QPointF P1, qreal r1)
+{
+    qreal dx = P1.x() - P0.x();
+    qreal dy = P1.y() - P0.y();
+    qreal length2 = dx*dx + dy*dy;
+    qreal rmax = qMax(r0, r1) + 1.0;
+
+    int yStart = qMax( box.top(), (int)floor(qMin(P0.y(), P1.y()) - rmax) );
+    int yEnd = qMin( box.bottom(), (int)ceil(qMax(P0.y(), P1.y()) + rmax) );
+    for(int y=yStart; y<=yEnd; y++)
+    {
+        qreal cy = y + 0.5; // pixel centre
+        // finds the part of the segment which is close enough to this scanline
+        qreal ta = 0.0;
+        qreal tb = 1.0;
+        if(dy != 0.0)
+        {
+            ta = (cy - rmax - P0.y())/dy;
+            tb = (cy + rmax - P0.y())/dy;
+            if(ta > tb) qSwap(ta, tb);
+            ta = qMax(ta, 0.0);
+            tb = qMin(tb, 1.0);
+            if(ta > tb) continue;
+        }
+        else if( qAbs(cy - P0.y()) > rmax )
+        {
+            continue;
+        }
+        qreal xa = P0.x() + ta*dx;
+        qreal xb = P0.x() + tb*dx;
+        int xStart = qMax( box.left(), (int)floor(qMin(xa, xb) - rmax) );
+        int xEnd = qMin( box.right(), (int)ceil(qMax(xa, xb) + rmax) );
+
+        uchar* pixel = coverage + (y - box.top())*box.width() + (xStart - box.left());
+        for(int x=xStart; x<=xEnd; x++, pixel++)
+        {
+            if(*pixel == 255) continue; // already covered by a previous segment (wide strokes overlap a lot from one segment to the next)
+            qreal cx = x + 0.5;
+            // nearest point of the segment, and stroke radius at that point
+            qreal t = 0.0;
+            if(length2 != 0.0) t = qBound(0.0, ((cx - P0.x())*dx + (cy - P0.y())*dy)/length2, 1.0);
+            qreal ex = cx - P0.x() - t*dx;
+            qreal ey = cy - P0.y() - t*dy;
+            qreal r = r0 + t*(r1 - r0) + 0.5;
+            qreal d2 = ex*ex + ey*ey;
+            if(d2 >= r*r) continue;
+            int c = 255;
+            if(r < 1.0 || d2 > (r-1.0)*(r-1.0)) // only the pixels on the edge need the square root
+            {
+                qreal value = r - sqrt(d2); // analytic coverage of the pixel by the stroke edge
+                c = (value >= 1.0) ? 255 : (int)(255.0*value + 0.5);
+            }
+            if(c > *pixel) *pixel = c;
+        }
+    }
+}
@@ -0,0 +1,41 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#ifndef STROKERASTERIZER_H
+#define STROKERASTERIZER_H
+
+#include <QtGui>
+
+class BezierCurve;  // forward declaration
+
+// anti-aliased scanline rasterizer for variable width (pressure) strokes
+// the stroke is swept as a chain of round-capped segments whose coverage is computed analytically,
+// which avoids going through the generic (and slow) anti-aliased path filler of QPainter
+class StrokeRasterizer
+{
+public:
+    StrokeRasterizer();
+
+    // returns false if the stroke could not be rasterized (the caller should then draw the stroked path instead)
+    static bool drawVariableWidthCurve(QPainter& painter, const BezierCurve& curve, QRgb premultipliedColour);
+    // compares the result with QPainter::drawPath(curve.getStrokedPath()) in an image of the given size: returns false
+    // if more than 2% of the covered pixels differ by more than tolerance (out of 255); see CHECK_STROKE_RASTERIZER in BezierCurve::drawPath
+    static bool matchesPathFiller(const BezierCurve& curve, const QMatrix& matrix, QSize size, int tolerance);
+
+private:
+    static void sweepSegment(uchar* coverage, const QRect& box, QPointF P0, qreal r0, QPointF P1, qreal r1);
+};
+
+#endif
@@ -20,45 +20,160 @@ GNU General Public License for more details.
 #include "gradient.h"
 //#include "beziercurve.h"
 
+// the binary vector files (VECB) start with this magic and version
+static const char binaryMagic[] = "PVEC";
+static const quint32 binaryVersion = 1;
+
 VectorImage::VectorImage()
 {
-    // nothing
+    myParent = NULL;
+    colourIndexed = false;
+    colourCounted = false;
+    unsaved = true;
+    autosaved = false;
 }
 
 VectorImage::VectorImage(Object* parent)
 {
     myParent = parent;
+    colourIndexed = (parent != NULL);
+    colourCounted = false;
+    unsaved = true;
+    autosaved = false;
     deselectAll();
 }
 
+VectorImage::VectorImage(const VectorImage& other)
+{
+    colourIndexed = false;
+    colourCounted = false;
+    *this = other;
+}
+
+VectorImage::~VectorImage()
+{
+    if(colourIndexed)
+    {
+        QMapIterator<int, int> it(colourCount);
+        while(it.hasNext())
+        {
+            it.next();
+            myParent->removeColourUser(it.key(), this);
+        }
+        myParent->colourUsageModification(this, false);
+    }
+}
+
+VectorImage& VectorImage::operator=(const VectorImage& other)
+{
+    // copies the picture, but an indexed image stays indexed (and a copy of an indexed image is not)
+    curve = other.curve;
+    area = other.area;
+    modified = other.modified;
+    unsaved = true;
+    autosaved = false;
+    if(!colourIndexed) myParent = other.myParent; // an indexed image stays in the index of its object
+    selectionRect = other.selectionRect;
+    selectionTransformation = other.selectionTransformation;
+    if(colourIndexed)
+    {
+        myParent->colourUsageModification(this, true);
+    }
+    else
+    {
+        colourCount.clear();
+        colourCounted = false;
+    }
+    return *this;
+}
+
 
 bool VectorImage::read(QString filePath)
 {
     QFileInfo fileInfo(filePath);
     if( fileInfo.isDir() ) return false;
 
-    QFile* file = new QFile(filePath);
-    if (!file->open(QFile::ReadOnly))
+    QFile file(filePath);
+    if (!file.open(QFile::ReadOnly))
     {
         //QMessageBox::warning(this, "Warning", "Cannot read file");
         return false;
     }
+    return read(&file);
+}
 
-    QDomDocument doc;
-    if (!doc.setContent(file)) return false; // this is not a XML file
-    QDomDocumentType type = doc.doctype();
-    if(type.name() != "PencilVectorImage") return false; // this is not a Pencil document
+bool VectorImage::read(QIODevice* device)
+{
+    // the format is recognised from the content, so that files of both formats can be mixed in a project
+    bool ok;
+    if(device->peek(4) == QByteArray(binaryMagic)) ok = readBinary(device);
+    else ok = readXml(device);
+    if(!ok) return false;
+    unsaved = false;
+    hash.clear();
+    return true;
+}
 
-    int layerNumber = -1;
-    QDomElement element = doc.documentElement();
-    if(element.tagName() == "image")
+bool VectorImage::readXml(QIODevice* device)
+{
+    QXmlStreamReader xml(device);
+    bool pencilDocument = false;
+    while(!xml.atEnd())
     {
-        // --- vector image ---
-        if(element.attribute("type") == "vector")
+        xml.readNext();
+        if(xml.isDTD()) pencilDocument = (xml.dtdName() == "PencilVectorImage");
+        if(xml.isStartElement())
         {
-            loadDomElement( element );
+            if(!pencilDocument) return false; // this is not a Pencil document
+            // --- vector image ---
+            if(xml.name() == "image" && xml.attributes().value("type") == "vector") loadXml(xml);
+            break;
         }
     }
+    if(xml.hasError())
+    {
+        qDebug() << "VectorImage - Cannot read XML" << xml.errorString();
+        return false;
+    }
+    return pencilDocument;
+}
+
+bool VectorImage::readBinary(QIODevice* device)
+{
+    QDataStream in(device);
+    in.setVersion(QDataStream::Qt_4_6);
+    in.skipRawData(4);
+    quint32 version;
+    in >> version;
+    if(version > binaryVersion)
+    {
+        qDebug() << "VectorImage - Unknown binary version" << version;
+        return false;
+    }
+
+    quint32 curveCount;
+    in >> curveCount;
+    for(quint32 i=0; i < curveCount && in.status() == QDataStream::Ok; i++)
+    {
+        BezierCurve newCurve = BezierCurve();
+        if(!newCurve.loadData(in)) break; // truncated: the incomplete curve is discarded
+        curve.append(newCurve);
+    }
+    quint32 areaCount;
+    in >> areaCount;
+    for(quint32 i=0; i < areaCount && in.status() == QDataStream::Ok; i++)
+    {
+        BezierArea newArea = BezierArea();
+        newArea.loadData(in);
+        addArea(newArea);
+    }
+    clean();
+    modification();
+    if(in.status() != QDataStream::Ok)
+    {
+        qDebug() << "VectorImage - Truncated binary file";
+        return false;
+    }
     return true;
 }
 
@@ -75,76 +190,135 @@ bool VectorImage::write(QString filePath, QString format)
         qDebug() << "VectorImage - Cannot write file" << filePath << file->error();
         return false;
     }
-    QTextStream out(file);
+    bool written = write(file, format);
+    file->close();
+    return written;
+}
 
+bool VectorImage::write(QIODevice* device, QString format)
+{
     if(format == "VEC")
     {
-        QDomDocument doc("PencilVectorImage");
-        //QDomElement root = doc.createElement("vectorImage");
-        //doc.appendChild(root);
-
-        QDomElement imageTag = createDomElement(doc);
-        doc.appendChild(imageTag);
-
-        int IndentSize = 2;
+        // the XML is streamed to the device, without building a document in memory
+        QXmlStreamWriter xml(device);
+        xml.setAutoFormatting(true);
+        xml.setAutoFormattingIndent(2);
         qDebug() << "--- Starting to write XML file...";
-        doc.save(out, IndentSize);
+        xml.writeDTD("<!DOCTYPE PencilVectorImage>");
+        saveXml(xml);
+        xml.writeEndDocument();
         qDebug() << "--- Writing XML file done.";
-        file->close();
+        unsaved = false;
+        return true;
+    }
+    else if(format == "VECB")
+    {
+        if(!writeBinary(device)) return false;
+        unsaved = false;
         return true;
     }
     else
     {
-        file->close();
         qDebug() << "--- Not the VEC format!";
         return false;
     }
 }
 
-QDomElement VectorImage::createDomElement(QDomDocument& doc)
+QByteArray VectorImage::contentHash() const
 {
-    QDomElement imageTag = doc.createElement("image");
-    imageTag.setAttribute("type", "vector");
     for(int i=0; i < curve.size() ; i++)
     {
-        QDomElement curveTag = curve[i].createDomElement(doc);
-        imageTag.appendChild(curveTag);
+        if(curve.at(i).isPartlySelected()) return QByteArray();
     }
     for(int i=0; i < area.size() ; i++)
     {
-        QDomElement areaTag = area[i].createDomElement(doc);
-        imageTag.appendChild(areaTag);
+        if(area.at(i).isSelected()) return QByteArray();
+    }
+    if(hash.isEmpty())
+    {
+        QBuffer buffer;
+        buffer.open(QIODevice::WriteOnly);
+        writeBinary(&buffer);
+        hash = QCryptographicHash::hash(buffer.data(), QCryptographicHash::Md5);
     }
-    return imageTag;
+    return hash;
 }
 
-void VectorImage::loadDomElement(QDomElement element)
+QRectF VectorImage::getBoundingRect() const
+{
+    // the areas are bounded by curves, and a curve is drawn at most twice its width wide (with the pressure)
+    QRectF rect;
+    for(int i=0; i < curve.size(); i++)
+    {
+        qreal margin = curve.at(i).getWidth() + 1.0;
+        rect = rect.united( curve.at(i).getControlPointRect().adjusted(-margin, -margin, margin, margin) );
+    }
+    return rect;
+}
+
+bool VectorImage::writeBinary(QIODevice* device) const
 {
-    QDomNode atomTag = element.firstChild(); // an atom in a vector picture is a curve or an area
-    while(!atomTag.isNull())
+    QDataStream out(device);
+    out.setVersion(QDataStream::Qt_4_6);
+    out.writeRawData(binaryMagic, 4);
+    out << binaryVersion;
+    out << quint32(curve.size());
+    for(int i=0; i < curve.size() ; i++) curve.at(i).saveData(out);
+    out << quint32(area.size());
+    for(int i=0; i < area.size() ; i++) area.at(i).saveData(out);
+    if(out.status() != QDataStream::Ok)
     {
-        QDomElement atomElement = atomTag.toElement();
-        if(!atomElement.isNull())
+        qDebug() << "VectorImage - Cannot write binary file";
+        return false;
+    }
+    return true;
+}
+
+void VectorImage::saveXml(QXmlStreamWriter& xml) const
+{
+    xml.writeStartElement("image");
+    xml.writeAttribute("type", "vector");
+    for(int i=0; i < curve.size() ; i++) curve.at(i).saveXml(xml);
+    for(int i=0; i < area.size() ; i++) area.at(i).saveXml(xml);
+    xml.writeEndElement();
+}
+
+void VectorImage::loadXml(QXmlStreamReader& xml)
+{
+    while(xml.readNextStartElement()) // an atom in a vector picture is a curve or an area
+    {
+        if(xml.name() == "curve")
         {
-            if(atomElement.tagName() == "curve")
-            {
-                BezierCurve newCurve = BezierCurve();
-                newCurve.loadDomElement(atomElement);
-                curve.append(newCurve);
-            }
-            if(atomElement.tagName() == "area")
-            {
-                BezierArea newArea = BezierArea();
-                newArea.loadDomElement(atomElement);
-                addArea(newArea);
-            }
+            BezierCurve newCurve = BezierCurve();
+            newCurve.loadXml(xml);
+            curve.append(newCurve);
+        }
+        else if(xml.name() == "area")
+        {
+            BezierArea newArea = BezierArea();
+            newArea.loadXml(xml);
+            addArea(newArea);
+        }
+        else
+        {
+            xml.skipCurrentElement();
         }
-        atomTag = atomTag.nextSibling();
     }
     clean();
     modification();
 }
 
+void VectorImage::loadDomElement(QDomElement element)
+{
+    // the pictures embedded in old documents are read with the same code as the files
+    QString text;
+    QTextStream out(&text);
+    element.save(out, 0);
+    out.flush();
+    QXmlStreamReader xml(text);
+    if(xml.readNextStartElement()) loadXml(xml);
+}
+
 
 
 /*void VectorImage::setView(QMatrix newView) {
@@ -811,6 +985,10 @@ void VectorImage::paste(VectorImage vectorImage)
 void VectorImage::modification()
 {
     setModified(true);
+    unsaved = true;
+    autosaved = false;
+    hash.clear();
+    if(colourIndexed) myParent->colourUsageModification(this, true); // the colour usage is counted again when it is needed
 }
 
 bool VectorImage::isModified()
@@ -825,7 +1003,7 @@ void VectorImage::setModified(bool trueOrFalse)
 
 QColor VectorImage::getColour(int colourNumber)
 {
-    return myParent->getColour(colourNumber).colour;
+    return myParent->getRenderContext().getColour(colourNumber);
     //return Qt::blue;
 }
 
@@ -863,9 +1041,64 @@ void VectorImage::removeColour(int index)
     {
         if(curve[i].getColourNumber() > index) curve[i].decreaseColourNumber();
     }
+    modification();
+}
+
+void VectorImage::remapColour(int oldIndex, int newIndex)
+{
+    for(int i=0; i< area.size(); i++)
+    {
+        if(area[i].getColourNumber() == oldIndex) area[i].setColourNumber(newIndex);
+    }
+    for(int i=0; i< curve.size(); i++)
+    {
+        if(curve[i].getColourNumber() == oldIndex) curve[i].setColourNumber(newIndex);
+    }
+    modification();
+}
+
+void VectorImage::updateColourUsage()
+{
+    QMap<int, int> newColourCount;
+    for(int i=0; i< area.size(); i++)
+    {
+        newColourCount[area[i].getColourNumber()]++;
+    }
+    for(int i=0; i< curve.size(); i++)
+    {
+        newColourCount[curve[i].getColourNumber()]++;
+    }
+    setColourCount(newColourCount);
+}
+
+void VectorImage::setColourCount(const QMap<int, int>& newColourCount)
+{
+    if(colourIndexed)
+    {
+        // only the colours which appear or disappear from this image are reported
+        QMapIterator<int, int> it(colourCount);
+        while(it.hasNext())
+        {
+            it.next();
+            if(!newColourCount.contains(it.key())) myParent->removeColourUser(it.key(), this);
+        }
+        QMapIterator<int, int> newIt(newColourCount);
+        while(newIt.hasNext())
+        {
+            newIt.next();
+            if(!colourCount.contains(newIt.key())) myParent->addColourUser(newIt.key(), this);
+        }
+    }
+    colourCount = newColourCount;
+    colourCounted = true;
 }
 
 void VectorImage::paintImage(QPainter& painter, bool simplified, bool showThinCurves, qreal curveOpacity, bool antialiasing, int gradients)
+{
+    paintImage(painter, myParent->getRenderContext(), simplified, showThinCurves, curveOpacity, antialiasing, gradients);
+}
+
+void VectorImage::paintImage(QPainter& painter, const RenderContext& context, bool simplified, bool showThinCurves, qreal curveOpacity, bool antialiasing, int gradients)
 {
     painter.setRenderHint(QPainter::Antialiasing, antialiasing);
     painter.setClipping(false);
@@ -899,7 +1132,7 @@ void VectorImage::paintImage(QPainter& painter, bool simplified, bool showThinCu
             		}
             }*/
 
-            QColor colour = getColour(area[i].colourNumber);
+            QColor colour = context.getColour(area[i].colourNumber);
             //if(buffer) painter2.fillPath( area[i].path, colour );
             //else
 
@@ -914,7 +1147,7 @@ void VectorImage::paintImage(QPainter& painter, bool simplified, bool showThinCu
             {
                 painter.setClipRect( viewRect );
                 painter.setClipping(true);
-                painter.fillPath( area[i].path, colour );
+                painter.fillPath( area[i].path, context.getBrush(area[i].colourNumber) );
             }
             if(area[i].isSelected())
             {
@@ -942,7 +1175,7 @@ void VectorImage::paintImage(QPainter& painter, bool simplified, bool showThinCu
     painter.setClipping(true);
     for(int i=0; i< curve.size(); i++)
     {
-        curve[i].drawPath(painter, myParent, selectionTransformation, simplified, showThinCurves, curveOpacity);
+        curve[i].drawPath(painter, context, selectionTransformation, simplified, showThinCurves, curveOpacity);
     }
     //painter.resetMatrix(); ?????
     painter.setClipping(false);
@@ -969,6 +1202,17 @@ void VectorImage::clear()
     modification();
 }
 
+void VectorImage::unload()
+{
+    // the file the picture is read from again has the same colours: the usage is counted once more if needed, and kept in the index
+    if(colourIndexed) updateColourUsage();
+    curve.clear();
+    area.clear();
+    hash.clear();
+    setModified(true);
+    if(colourIndexed) myParent->colourUsageModification(this, false);
+}
+
 void VectorImage::clean()
 {
     for(int i=0; i<curve.size(); i++)
@@ -23,6 +23,7 @@ GNU General Public License for more details.
 #include "vertexref.h"
 
 class Object;  // forward declaration
+class RenderContext;
 
 //class VectorImage : public QObject
 class VectorImage
@@ -32,12 +33,18 @@ class VectorImage
 public:
     VectorImage();
     VectorImage(Object* parent);
+    VectorImage(const VectorImage& other);
+    ~VectorImage();
+    VectorImage& operator=(const VectorImage& other);
     //VectorImage(QSize size, QImage::Format format, Object* parent);
     //VectorImage(QImage newImage, Object* parent);
 
     bool read(QString filePath);
+    bool read(QIODevice* device);
     bool write(QString filePath, QString format);
-    QDomElement createDomElement(QDomDocument& doc);
+    bool write(QIODevice* device, QString format);
+    void saveXml(QXmlStreamWriter& xml) const;
+    void loadXml(QXmlStreamReader& xml);
     void loadDomElement(QDomElement element);
 
     //void setView(QMatrix newView);
@@ -73,16 +80,29 @@ public:
 
     bool isModified();
     void setModified(bool);
+    QByteArray contentHash() const; // hash of the curves and areas ("" if something is selected, as the selection changes the rendering)
+    QRectF getBoundingRect() const; // contains everything the picture paints
+    bool isUnsaved() { return unsaved; }
+    void setUnsaved(bool trueOrFalse) { unsaved = trueOrFalse; }
+    bool isAutosaved() { return autosaved; }
+    void setAutosaved(bool trueOrFalse) { autosaved = trueOrFalse; }
 
     QColor getColour(int i);
     int  getColourNumber(QPointF point);
     bool usesColour(int index);
     void removeColour(int index);
-
-    void paintImage(QPainter& painter, bool simplified, bool showThinCurves, qreal curveOpacity, bool antialiasing, int gradients);
+    void remapColour(int oldIndex, int newIndex);
+    void updateColourUsage();
+    bool isColourCounted() const { return colourCounted; }
+    QMap<int, int> getColourCount() const { return colourCount; } // number of curves and areas using each colour, when counted
+    void setColourCount(const QMap<int, int>& newColourCount); // for a picture which is not read yet, from the document
+
+    void paintImage(QPainter& painter, bool simplified, bool showThinCurves, qreal curveOpacity, bool antialiasing, int gradients); // with the palette of the object
+    void paintImage(QPainter& painter, const RenderContext& context, bool simplified, bool showThinCurves, qreal curveOpacity, bool antialiasing, int gradients); // with a given palette, e.g. a copy held by another thread
     void outputImage(QImage* image, QSize size, QMatrix myView, bool simplified, bool showThinCurves, qreal curveOpacity, bool antialiasing, int gradients); // uses paintImage
 
     void clear();
+    void unload(); // releases the curves and areas of a saved picture, which is read again from its file when needed
     void clean();
     void setSelectionTransformation(QMatrix transform);
     void applySelectionTransformation();
@@ -125,10 +145,20 @@ public:
     qreal getDistance(VertexRef r1, VertexRef r2);
 
 private:
+    bool readXml(QIODevice* device);
+    bool readBinary(QIODevice* device);
+    bool writeBinary(QIODevice* device) const;
     void modification();
     bool modified;
+    bool unsaved; // true when the picture differs from the file it was last read from or written to
+    bool autosaved; // false when the picture was modified since it was last copied by an autosave
+    mutable QByteArray hash; // contentHash, until the picture is modified
 
     Object* myParent;
+    // an image created with a parent is counted in the colour usage index of that parent (copies are not)
+    bool colourIndexed;
+    QMap<int, int> colourCount; // number of curves and areas using each colour, as last reported to the index
+    bool colourCounted; // colourCount is that of the picture (or of its file, when the picture is unloaded)
 
     QRectF selectionRect;
     //, transformedSelection;
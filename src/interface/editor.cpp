@@ -22,12 +22,19 @@ GNU General Public License for more details.
 #include <QMainWindow>
 #include <QTimer>
 #include <QSvgGenerator>
+#include <QtConcurrentMap>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <stdio.h>
+#endif
 
 #include "editor.h"
 #include "layerbitmap.h"
 #include "layervector.h"
 #include "layersound.h"
 #include "layercamera.h"
+#include "archive.h"
 #include "mainwindow.h"
 #include "displayoptiondockwidget.h"
 #include "tooloptiondockwidget.h"
@@ -68,11 +75,16 @@ Editor::Editor(MainWindow* parent)
     timer = new QTimer(this);
     timer->setInterval(1000/fps);
     connect(timer, SIGNAL(timeout()), this, SLOT(playNextFrame()));
+    autosaveTimer = new QTimer(this);
+    autosaveTimer->setSingleShot(true);
+    autosaveTimer->setInterval(2000);
+    connect(autosaveTimer, SIGNAL(timeout()), this, SLOT(autosaveObject()));
+    autosaving = false;
     playing = false;
     looping = false;
     sound = true;
 
-    frameList << 1;
+    frameList.insert(1, 1);
     currentFrame = 1;
     currentLayer = 0;
 
@@ -90,6 +102,10 @@ Editor::Editor(MainWindow* parent)
     exportMovieDialog_fpsBox = NULL;
 
     exportFlashDialog_compression = NULL;
+    importMovieDialog = NULL;
+    importMovieDialog_firstFrame = NULL;
+    importMovieDialog_frameCount = NULL;
+    importMovieDialog_width = NULL;
 
     // Layouts
     QHBoxLayout* mainLayout = new QHBoxLayout();
@@ -126,8 +142,10 @@ Editor::~Editor()
     // a lot more probably needs to be cleaned here...
     if ( object != NULL )
     {
+        waitForSave();
         delete object;
     }
+    Archive::closeAll();
     clearBackup();
 }
 
@@ -163,6 +181,8 @@ void Editor::makeConnections()
     connect(scribbleArea, SIGNAL(modification()), this, SLOT(modification()));
     connect(scribbleArea, SIGNAL(modification(int)), this, SLOT(modification(int)));
     connect(timeLine, SIGNAL(modification()), this, SLOT(modification()));
+    connect(&saveWatcher, SIGNAL(progressValueChanged(int)), this, SLOT(saveProgress(int)));
+    connect(&saveWatcher, SIGNAL(finished()), this, SLOT(saveFinished()));
 
     connect(timeLine, SIGNAL(addKeyClick()), this, SLOT(addKey()));
     connect(timeLine, SIGNAL(removeKeyClick()), this, SLOT(removeKey()));
@@ -275,7 +295,10 @@ bool Editor::importMov()
     else
     {
         settings.setValue("lastExportPath", QVariant(filePath));
-        importMovie(filePath,fps);
+        if (!importMovieDialog) createImportMovieDialog();
+        importMovieDialog->exec();
+        if(importMovieDialog->result() == QDialog::Rejected) return false;
+        importMovie(filePath, fps, importMovieDialog_firstFrame->value(), importMovieDialog_frameCount->value(), importMovieDialog_width->value());
         return true;
     }
 }
@@ -306,7 +329,7 @@ bool Editor::saveDocument()
     QString myPath = settings.value("lastFilePath", QVariant(QDir::homePath())).toString();
     if(myPath.isEmpty()) myPath = QDir::homePath() + "/untitled.pcl";
 
-    QString fileName = QFileDialog::getSaveFileName(this, tr("Save As..."),myPath ,tr("PCL (*.pcl)"));
+    QString fileName = QFileDialog::getSaveFileName(this, tr("Save As..."),myPath ,tr("PCL (*.pcl);;Pencil archive (*.%1)").arg(Archive::suffix()));
 
     if (fileName.isEmpty())
     {
@@ -314,7 +337,7 @@ bool Editor::saveDocument()
     }
     else
     {
-        if(! fileName.endsWith(".pcl"))
+        if(! fileName.endsWith(".pcl") && !Archive::isArchive(fileName))
         {
             fileName =  fileName + ".pcl";
         }
@@ -608,7 +631,26 @@ void Editor::modification(int layerNumber)
     {
         numberOfModifications = 0;
         //saveForce();
-        if (savedName!="") saveObject(savedName);
+        delayAutosave();
+    }
+    else if(autosaveTimer->isActive())
+    {
+        delayAutosave();
+    }
+}
+
+void Editor::delayAutosave()
+{
+    // the recovery document is written when the burst of modifications ends, or after 30 seconds of continuous modifications
+    if(!autosaveTimer->isActive()) autosaveDelay.start();
+    if(autosaveDelay.elapsed() > 30000)
+    {
+        autosaveTimer->stop();
+        autosaveObject();
+    }
+    else
+    {
+        autosaveTimer->start();
     }
 }
 
@@ -654,6 +696,7 @@ void Editor::backup(int backupLayer, int backupFrame, QString undoText)
                 element->bitmapImage =  bitmapImage->copy();  // copy the image
                 backupList.append(element);
                 backupIndex++;
+                ((LayerBitmap*)layer)->markModified(backupFrame); // the image is backed up because it is about to be modified
             }
         }
         if(layer->type == Layer::VECTOR)
@@ -685,6 +728,7 @@ void BackupBitmapElement::restore(Editor* editor)
         if(layer->type == Layer::BITMAP)
         {
             *(   ((LayerBitmap*)layer)->getLastBitmapImageAtFrame(this->frame, 0)    ) = this->bitmapImage;  // restore the image
+            ((LayerBitmap*)layer)->markModified(this->frame);
         }
     }
     editor->getScribbleArea()->somethingSelected = this->somethingSelected;
@@ -704,6 +748,7 @@ void BackupVectorElement::restore(Editor* editor)
         if(layer->type == Layer::VECTOR)
         {
             *(  ((LayerVector*)layer)->getLastVectorImageAtFrame(this->frame, 0)  ) = this->vectorImage;  // restore the image
+            ((LayerVector*)layer)->markModified(this->frame);
             //((LayerVector*)layer)->getLastVectorImageAtFrame(this->frame, 0)->setModified(true); // why?
             //editor->scribbleArea->setModified(layer, this->frame);
         }
@@ -838,6 +883,7 @@ void Editor::inbetween()
                         selection.moveRight(3);
                         tobePasted.transform( selection, true );//TODO move its x factor
                         ((LayerBitmap*)layer)->getLastBitmapImageAtFrame(currentFrame, 0)->paste( &tobePasted );
+                        ((LayerBitmap*)layer)->markModified(currentFrame);
                         move_clicked();
                         scribbleArea->updateFrame();
                     }
@@ -902,7 +948,6 @@ void Editor::copyFrames()
         name = text;
     }
     int a =text.toInt();
-    QListIterator<int> z( frameList );
     for (int i = 0; i < a; ++i)
     {
         addKey();
@@ -912,11 +957,11 @@ void Editor::copyFrames()
 
 void Editor::pasteFrames()
 {
-    int a =frameList.count();
-    QListIterator<int> z( frameList );
+    int a = frameList.size();
+    QMapIterator<int, int> z( frameList );
     for (int i = 0; i < a; ++i)
     {
-        int b = z.next();
+        int b = z.next().key();
         qDebug()<< i;
         qDebug()<< a;
         scrubTo(i);
@@ -1113,6 +1158,7 @@ void Editor::helpBox()
 
 bool Editor::maybeSave()
 {
+    waitForSave(); // the object is about to be replaced or the application closed
     if (object->modified)
     {
         int ret = QMessageBox::warning(this, tr("Warning"),
@@ -1124,6 +1170,8 @@ bool Editor::maybeSave()
         if (ret == QMessageBox::Yes)
         {
             saveForce();
+            waitForSave();
+            if(object->modified) return false; // the save failed or was cancelled: the document stays open
             return true;
         }
         else if (ret == QMessageBox::Cancel)
@@ -1131,6 +1179,7 @@ bool Editor::maybeSave()
             return false;
         }
     }
+    removeRecovery(); // the modifications are saved or discarded
     return true;
 }
 
@@ -1138,46 +1187,64 @@ bool Editor::saveObject(QString filePath)
 {
     QFileInfo fileInfo(filePath);
     if(fileInfo.isDir()) return false;
+    waitForSave(); // one save at a time
 
-    QFileInfo dataInfo(filePath+".data");
-    if(!dataInfo.exists())
+    // the frames are saved in a directory with the same name +".data", or in the document itself if it is an archive
+    QString dataPath = Archive::dataPath(filePath);
+    bool archive = Archive::isArchive(filePath);
+    if(archive)
+    {
+        Archive* container = Archive::open(filePath, true);
+        if(container == NULL) return false;
+        if(filePath != savedName) container->clear(); // another document was saved there
+    }
+    else if(!QFileInfo(dataPath).exists())
     {
         QDir dir(fileInfo.absolutePath()); // the directory where filePath is or will be saved
-        dir.mkpath(filePath+".data"); // creates a directory with the same name +".data"
+        dir.mkpath(dataPath);
     }
 
     savedName=filePath;
     mainWindow->setWindowTitle(savedName);
 
-    QProgressDialog progress("Saving document...", "Abort", 0, 100, mainWindow);
-    progress.setWindowModality(Qt::WindowModal);
-    progress.show();
-    int progressValue = 0;
-
-    // save data
+    // copy the modified frames (they are written by a pool of threads while the editing goes on)
+    saveFiles.clear();
+    saveLayerIds.clear();
     int nLayers = object->getLayerCount();
     for(int i=0; i < nLayers; i++)
     {
         Layer* layer = object->getLayer(i);
         qDebug() << "Saving Layer " << i << "(" <<layer->name << ")";
-        progressValue = (i*100)/nLayers;
-        progress.setValue(progressValue);
-        if(layer->type == Layer::BITMAP) ((LayerBitmap*)layer)->saveImages(filePath+".data", i);
-        if(layer->type == Layer::VECTOR) ((LayerVector*)layer)->saveImages(filePath+".data", i);
-        if(layer->type == Layer::SOUND) ((LayerSound*)layer)->saveImages(filePath+".data", i);
+        if(layer->type == Layer::BITMAP || layer->type == Layer::VECTOR) saveLayerIds << layer->id;
+        if(layer->type == Layer::BITMAP) ((LayerBitmap*)layer)->saveImages(dataPath, i, saveFiles);
+        if(layer->type == Layer::VECTOR) ((LayerVector*)layer)->saveImages(dataPath, i, saveFiles);
+        if(layer->type == Layer::SOUND) ((LayerSound*)layer)->saveImages(dataPath, i, saveFiles);
     }
 
-    // save palette
-    object->savePalette(filePath+".data");
+    // save palette (next to the current one, it replaces it once the frames are written -- an archive replaces all its files at once)
+    object->exportPalette(dataPath + (archive ? "/palette.xml" : "/palette.xml.tmp"));
 
-    // -------- save main XML file -----------
-    QFile* file = new QFile(filePath);
-    if (!file->open(QFile::WriteOnly | QFile::Text))
-    {
-        //QMessageBox::warning(this, "Warning", "Cannot write file");
-        return false;
-    }
-    QTextStream out(file);
+    // main XML file (written next to the current one once the frames are written, see saveFinished)
+    saveDocument = createDocument(false);
+
+    object->modified = false;
+    timeLine->updateContent();
+
+    saveFilePath = filePath;
+    autosaving = false;
+    mainWindow->statusBar()->showMessage(tr("Saving document..."));
+    saveWatcher.setFuture( QtConcurrent::map(saveFiles, LayerImage::writeFrameFile) );
+    return true;
+}
+
+bool Editor::writeDocument(QString filePath, bool recovery)
+{
+    int IndentSize = 2;
+    return Archive::writeData(filePath, createDocument(recovery).toByteArray(IndentSize)); // the document may be in an archive
+}
+
+QDomDocument Editor::createDocument(bool recovery)
+{
     QDomDocument doc("PencilDocument");
     QDomElement root = doc.createElement("document");
     doc.appendChild(root);
@@ -1189,17 +1256,260 @@ bool Editor::saveObject(QString filePath)
     QDomElement objectElement = object->createDomElement(doc);
     root.appendChild(objectElement);
 
-    int IndentSize = 2;
-    doc.save(out, IndentSize);
-    // -----------------------------------
+    if(recovery)
+    {
+        // the recovery document refers to the files of the last autosave, and remembers the document it recovers
+        root.setAttribute("original", savedName);
+        QDomElement layerTag = objectElement.firstChildElement("layer");
+        for(int i=0; i < object->getLayerCount() && !layerTag.isNull(); i++)
+        {
+            Layer* layer = object->getLayer(i);
+            if(layer->type == Layer::BITMAP || layer->type == Layer::VECTOR || layer->type == Layer::SOUND) ((LayerImage*)layer)->setAutosaveSources(layerTag);
+            layerTag = layerTag.nextSiblingElement("layer");
+        }
+    }
+    return doc;
+}
 
-    progress.setValue(100);
+void Editor::autosaveObject()
+{
+    if(object == NULL) return;
+    if(!saveFilePath.isEmpty())
+    {
+        autosaveTimer->start(); // a save is being written: try again later
+        return;
+    }
+    QString filePath = recoveryFilePath();
+    QDir().mkpath(filePath+".data");
 
-    object->modified = false;
-    timeLine->updateContent();
+    // copy the frames modified since the last autosave (the recovery document refers to the saved files for the others)
+    saveFiles.clear();
+    autosaveFiles.clear();
+    int nLayers = object->getLayerCount();
+    for(int i=0; i < nLayers; i++)
+    {
+        Layer* layer = object->getLayer(i);
+        if(layer->type == Layer::BITMAP || layer->type == Layer::VECTOR || layer->type == Layer::SOUND)
+        {
+            LayerImage* layerImage = (LayerImage*)layer;
+            layerImage->autosaveImages(filePath+".data", saveFiles);
+            QStringList sources = layerImage->getAutosaveSources();
+            for(int j=0; j < sources.size(); j++)
+            {
+                if(QFileInfo(sources.at(j)).isRelative()) autosaveFiles << sources.at(j);
+            }
+        }
+    }
+    object->exportPalette(filePath+".data/palette.xml");
+    if(!writeDocument(filePath+".tmp", true))
+    {
+        qDebug() << "Cannot write the recovery document" << filePath;
+        for(int i=0; i < nLayers; i++)
+        {
+            Layer* layer = object->getLayer(i);
+            if(layer->type == Layer::BITMAP || layer->type == Layer::VECTOR) ((LayerImage*)layer)->clearAutosave();
+        }
+        saveFiles.clear();
+        return;
+    }
+
+    saveFilePath = filePath;
+    autosaving = true;
+    saveWatcher.setFuture( QtConcurrent::map(saveFiles, LayerImage::writeFrameFile) );
+}
+
+void Editor::autosaveFinished(QString filePath, bool success)
+{
+    if(success) success = replaceFile(filePath+".tmp", filePath);
+    if(success)
+    {
+        // the files of the previous autosaves no longer used are removed
+        QDir dir(filePath+".data");
+        QStringList files = dir.entryList(QDir::Files);
+        for(int i=0; i < files.size(); i++)
+        {
+            if(files.at(i) != "palette.xml" && !autosaveFiles.contains(files.at(i))) dir.remove(files.at(i));
+        }
+    }
+    else
+    {
+        // the next autosave copies all the modified frames again
+        for(int i=0; i < object->getLayerCount(); i++)
+        {
+            Layer* layer = object->getLayer(i);
+            if(layer->type == Layer::BITMAP || layer->type == Layer::VECTOR) ((LayerImage*)layer)->clearAutosave();
+        }
+    }
+    autosaveFiles.clear();
+}
+
+QString Editor::recoveryFilePath()
+{
+    return QDesktopServices::storageLocation(QDesktopServices::DataLocation) + "/recovery/autosave.pcl";
+}
+
+void Editor::removeRecovery()
+{
+    autosaveTimer->stop();
+    QString filePath = recoveryFilePath();
+    QDir dir(filePath+".data");
+    QStringList files = dir.entryList(QDir::Files);
+    for(int i=0; i < files.size(); i++)
+    {
+        dir.remove(files.at(i));
+    }
+    QFile::remove(filePath);
+    if(object == NULL) return;
+    for(int i=0; i < object->getLayerCount(); i++)
+    {
+        Layer* layer = object->getLayer(i);
+        if(layer->type == Layer::BITMAP || layer->type == Layer::VECTOR) ((LayerImage*)layer)->clearAutosave();
+    }
+}
+
+bool Editor::checkRecovery()
+{
+    QString filePath = recoveryFilePath();
+    if(!QFile::exists(filePath)) return false;
+    int ret = QMessageBox::question(this, tr("Recovery"),
+                                    tr("Pencil was not closed properly.\n"
+                                       "Do you want to recover the animation saved automatically?"),
+                                    QMessageBox::Yes | QMessageBox::Default,
+                                    QMessageBox::No | QMessageBox::Escape);
+    if (ret != QMessageBox::Yes)
+    {
+        removeRecovery();
+        return false;
+    }
+
+    QString originalName;
+    QFile file(filePath);
+    if (file.open(QFile::ReadOnly))
+    {
+        QDomDocument doc;
+        if (doc.setContent(&file)) originalName = doc.documentElement().attribute("original");
+        file.close();
+    }
+    if(!openObject(filePath)) return false;
+
+    // the recovered animation is saved (as a whole) to the document it comes from
+    savedName = originalName;
+    QSettings settings("Pencil","Pencil");
+    if(savedName != "") settings.setValue("lastFilePath", QVariant(savedName));
+    mainWindow->setWindowTitle(savedName != "" ? savedName : tr("Recovered animation"));
+    for(int i=0; i < object->getLayerCount(); i++)
+    {
+        Layer* layer = object->getLayer(i);
+        if(layer->type == Layer::BITMAP || layer->type == Layer::VECTOR)
+        {
+            ((LayerImage*)layer)->loadImages(); // the files of the recovery document are removed once it is saved
+            ((LayerImage*)layer)->abortSave();
+        }
+    }
+    object->modified = true;
     return true;
 }
 
+void Editor::saveProgress(int value)
+{
+    if(autosaving) return;
+    int maximum = saveWatcher.progressMaximum();
+    if(maximum > 0) mainWindow->statusBar()->showMessage(tr("Saving document... %1%").arg((value*100)/maximum));
+}
+
+void Editor::saveFinished()
+{
+    if(saveFilePath.isEmpty()) return; // already done by waitForSave()
+    QString filePath = saveFilePath;
+    saveFilePath = "";
+
+    bool success = true;
+    for(int i=0; i < saveFiles.size(); i++)
+    {
+        if(!saveFiles.at(i).written)
+        {
+            qDebug() << "Cannot write " << saveFiles.at(i).filePath;
+            success = false;
+        }
+    }
+    // the files named after their content are only named once they are hashed by the threads writing them
+    QHash<QString, QString> contentNames;
+    for(int i=0; i < saveFiles.size(); i++)
+    {
+        if(!saveFiles.at(i).contentName.isEmpty()) contentNames.insert(saveFiles.at(i).contentName, QFileInfo(saveFiles.at(i).filePath).fileName());
+    }
+    saveFiles.clear();
+    if(autosaving)
+    {
+        autosaving = false;
+        autosaveFinished(filePath, success);
+        return;
+    }
+    for(int i=0; i < object->getLayerCount(); i++)
+    {
+        Layer* layer = object->getLayer(i);
+        if(saveLayerIds.contains(layer->id)) ((LayerImage*)layer)->resolveContentNames(contentNames);
+    }
+    QDomNodeList images = saveDocument.elementsByTagName("image");
+    for(int i=0; i < images.size(); i++)
+    {
+        QDomElement image = images.at(i).toElement();
+        QHash<QString, QString>::const_iterator it = contentNames.constFind(image.attribute("src"));
+        if(it != contentNames.constEnd()) image.setAttribute("src", it.value());
+    }
+
+    // the document is written next to the current one, then the palette and the document are put in place
+    bool archive = Archive::isArchive(filePath);
+    int IndentSize = 2;
+    if(success) success = Archive::writeData(archive ? Archive::documentFile(filePath) : filePath+".tmp", saveDocument.toByteArray(IndentSize));
+    saveDocument = QDomDocument();
+    if(success && !archive) success = replaceFile(filePath+".data/palette.xml.tmp", filePath+".data/palette.xml");
+    if(success && !archive) success = replaceFile(filePath+".tmp", filePath);
+
+    // the document refers to the new files: the files no longer used can be removed
+    // (the layers are found by their id, as layers may have been added or removed during the save)
+    for(int i=0; i < object->getLayerCount(); i++)
+    {
+        Layer* layer = object->getLayer(i);
+        if(saveLayerIds.contains(layer->id))
+        {
+            if(success) ((LayerImage*)layer)->commitImages(Archive::dataPath(filePath));
+            else ((LayerImage*)layer)->abortSave();
+        }
+    }
+    saveLayerIds.clear();
+    if(success && archive) success = Archive::open(filePath)->commit(); // the archive now refers to the new files
+
+    if(success)
+    {
+        removeRecovery(); // the document has all the work
+        mainWindow->statusBar()->showMessage(tr("Document saved"), 2000);
+    }
+    else
+    {
+        object->modified = true;
+        mainWindow->statusBar()->clearMessage();
+        QMessageBox::warning(this, tr("Warning"), tr("The document could not be saved to %1").arg(filePath));
+    }
+}
+
+void Editor::waitForSave()
+{
+    saveWatcher.waitForFinished();
+    saveFinished();
+}
+
+bool Editor::replaceFile(QString from, QString to)
+{
+    // the target is replaced in a single step, so that there is a complete file at its place whenever the save stops
+#ifdef Q_OS_WIN
+    return MoveFileExW((const wchar_t*)QDir::toNativeSeparators(from).utf16(), (const wchar_t*)QDir::toNativeSeparators(to).utf16(),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return ::rename(QFile::encodeName(from).constData(), QFile::encodeName(to).constData()) == 0;
+#endif
+}
+
 void Editor::resetUI()
 {    
     updateObject();
@@ -1214,8 +1524,10 @@ void Editor::setObject(Object* object)
 { 
     if (this->object != NULL && object != this->object)
     {
+        waitForSave();
         disconnect( this->object, 0, 0, 0); // disconnect the current object from everything
         delete this->object;
+        Archive::closeAll(); // the archive of the document is read again from the disk if it is opened again
     }
     this->object = object;
     if (object != NULL)
@@ -1228,7 +1540,7 @@ void Editor::setObject(Object* object)
         currentLayer = 0; // the default selected layer is the first one
         currentFrame = 1;
         frameList.clear();
-        frameList << 1;
+        frameList.insert(1, 1);
     }
 }
 
@@ -1253,10 +1565,11 @@ void Editor::updateObject()
 bool Editor::openObject(QString filePath)
 {
     // ---- test before opening ----
-    QFile* file = new QFile(filePath);
-    if (!file->open(QFile::ReadOnly)) return false;
+    bool read;
+    QByteArray content = Archive::readData(Archive::documentFile(filePath), &read); // the document may be an archive
+    if (!read) return false;
     QDomDocument doc;
-    if (!doc.setContent(file)) return false; // this is not a XML file
+    if (!doc.setContent(content)) return false; // this is not a XML file
     QDomDocumentType type = doc.doctype();
     if(type.name() != "PencilDocument" && type.name() != "MyObject") return false; // this is not a Pencil document
     // -----------------------------
@@ -1271,7 +1584,7 @@ bool Editor::openObject(QString filePath)
     mainWindow->setWindowTitle(savedName);
 
     Object* newObject = new Object();
-    if(!newObject->loadPalette(savedName+".data")) newObject->loadDefaultPalette();
+    if(!newObject->loadPalette(Archive::dataPath(savedName))) newObject->loadDefaultPalette();
     setObject(newObject);
 
     // ------- reads the XML file -------
@@ -1480,6 +1793,53 @@ void Editor::createExportMovieDialog()
 }
 
 
+void Editor::createImportMovieDialog()
+{
+    importMovieDialog = new QDialog(this, Qt::Dialog);
+    QGridLayout* mainLayout = new QGridLayout;
+
+    QGroupBox* rangeBox = new QGroupBox(tr("Frames"));
+    importMovieDialog_firstFrame = new QSpinBox(this);
+    importMovieDialog_firstFrame->setMinimum(1);
+    importMovieDialog_firstFrame->setMaximum(999999);
+    importMovieDialog_firstFrame->setValue(1);
+    importMovieDialog_firstFrame->setFixedWidth(80);
+    importMovieDialog_frameCount = new QSpinBox(this);
+    importMovieDialog_frameCount->setMinimum(0);
+    importMovieDialog_frameCount->setMaximum(999999);
+    importMovieDialog_frameCount->setSpecialValueText(tr("All"));
+    importMovieDialog_frameCount->setValue(0);
+    importMovieDialog_frameCount->setFixedWidth(80);
+    QGridLayout* rangeLayout = new QGridLayout;
+    rangeLayout->addWidget(new QLabel(tr("From")),0,0);
+    rangeLayout->addWidget(importMovieDialog_firstFrame,0,1);
+    rangeLayout->addWidget(new QLabel(tr("Count")),0,2);
+    rangeLayout->addWidget(importMovieDialog_frameCount,0,3);
+    rangeBox->setLayout(rangeLayout);
+
+    QGroupBox* resolutionBox = new QGroupBox(tr("Resolution"));
+    importMovieDialog_width = new QSpinBox(this);
+    importMovieDialog_width->setMinimum(0);
+    importMovieDialog_width->setMaximum(10000);
+    importMovieDialog_width->setSpecialValueText(tr("Original"));
+    importMovieDialog_width->setValue(0);
+    importMovieDialog_width->setFixedWidth(80);
+    QGridLayout* resolutionLayout = new QGridLayout;
+    resolutionLayout->addWidget(new QLabel(tr("Width")),0,0);
+    resolutionLayout->addWidget(importMovieDialog_width,0,1);
+    resolutionBox->setLayout(resolutionLayout);
+
+    QDialogButtonBox* buttonBox = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+    connect(buttonBox, SIGNAL(accepted()), importMovieDialog, SLOT(accept()));
+    connect(buttonBox, SIGNAL(rejected()), importMovieDialog, SLOT(reject()));
+
+    mainLayout->addWidget(rangeBox, 0, 0);
+    mainLayout->addWidget(resolutionBox, 1, 0);
+    mainLayout->addWidget(buttonBox, 2, 0);
+    importMovieDialog->setLayout(mainLayout);
+    importMovieDialog->setWindowTitle(tr("Options"));
+    importMovieDialog->setModal(true);
+}
 
 void Editor::createExportFlashDialog()
 {
@@ -1993,6 +2353,30 @@ void Editor::duplicateKey()
     }
 }
 
+void Editor::linkKey()
+{
+    // adds a key showing the same drawing as the current one (editing either key changes both)
+    Layer* layer = object->getLayer(currentLayer);
+    if(layer != NULL)
+    {
+        if(layer->type == Layer::BITMAP || layer->type == Layer::VECTOR)
+        {
+            LayerImage* layerImage = (LayerImage*)layer;
+            int sourceIndex = layerImage->getLastIndexAtFrame(currentFrame);
+            if(sourceIndex == -1) return;
+            int sourceFrame = layerImage->getFramePositionAt(sourceIndex);
+            int frameNumber = currentFrame;
+            while( layerImage->getIndexAtFrame(frameNumber) != -1 ) frameNumber++;
+            if( layerImage->addLinkedImageAtFrame(frameNumber, sourceFrame) )
+            {
+                scrubTo(frameNumber);
+                timeLine->updateContent();
+                updateMaxFrame();
+            }
+        }
+    }
+}
+
 void Editor::addKey(int layerNumber, int& frameNumber)
 {
     Layer* layer = object->getLayer(layerNumber);
@@ -2036,10 +2420,8 @@ void Editor::removeKey()
 
 void Editor::addFrame(int frameNumber)   // adding a frame to the cache
 {
-    frameList << frameNumber;
-    qSort(frameList);
+    frameList[frameNumber]++;
     scribbleArea->updateFrame();
-    qDebug()<< frameList;
     qDebug()<< frameNumber;
     timeLine->update();
 }
@@ -2048,9 +2430,8 @@ void Editor::addFrame(int frameNumber1, int frameNumber2)   // adding a range of
 {
     for(int i=frameNumber1; i<=frameNumber2; i++)
     {
-        frameList << i;
+        frameList[i]++;
     }
-    qSort(frameList);
 
     scribbleArea->updateFrame();
     timeLine->update();
@@ -2058,29 +2439,35 @@ void Editor::addFrame(int frameNumber1, int frameNumber2)   // adding a range of
 
 void Editor::removeFrame(int frameNumber)
 {
-    frameList.removeAt( getLastIndexAtFrame(frameNumber) );
+    // removes one occurrence of the last frame at or before frameNumber
+    QMap<int, int>::iterator it = frameList.upperBound(frameNumber);
+    if(it != frameList.begin())
+    {
+        --it;
+        it.value()--;
+        if(it.value() <= 0) frameList.erase(it);
+    }
     scribbleArea->updateFrame();
     timeLine->update();
 }
 
-int Editor::getLastIndexAtFrame(int frameNumber)
+int Editor::getLastFrameAtFrame(int frameNumber)
 {
-    int position  = -1;
-    int index = -1;
-    for(int i=0; i < frameList.size(); i++)
-    {
-        if(frameList.at(i) > position && frameList.at(i) <= frameNumber)
-        {
-            position = frameList.at(i);
-            index = i;
-        }
-    }
-    return index;
+    return getPreviousFrameInList(frameNumber+1);
 }
 
-int Editor::getLastFrameAtFrame(int frameNumber)
+int Editor::getPreviousFrameInList(int frameNumber)   // last frame of the list strictly before frameNumber, or -1
+{
+    QMap<int, int>::const_iterator it = frameList.lowerBound(frameNumber);
+    if(it == frameList.constBegin()) return -1;
+    --it;
+    return it.key();
+}
+
+int Editor::getLastFrameInList()
 {
-    return frameList.at( getLastIndexAtFrame(frameNumber) );
+    if(frameList.isEmpty()) return -1;
+    return (frameList.constEnd()-1).key();
 }
 
 
@@ -2182,6 +2569,20 @@ void Editor::setLoop(bool checked)
     looping = checked;
 }
 
+void Editor::setBinaryVectors(bool checked)
+{
+    // only the vector frames written from now on use the new format
+    object->vectorFormat = checked ? "VECB" : "VEC";
+    object->modification();
+}
+
+void Editor::setFastBitmaps(bool checked)
+{
+    // only the bitmap frames written from now on use the new format (the files are recognised by their content)
+    object->bitmapFormat = checked ? "PTL" : "PNG";
+    object->modification();
+}
+
 void Editor::setSound()
 {
     if(sound) sound = false;
@@ -2593,13 +2994,8 @@ void Editor::onionPrev(bool state){
 
 void Editor::endPlay()
 {
-    int a =frameList.count();
-    QListIterator<int> z( frameList );
-    for (int i = 0; i < a; ++i)
-    {
-        int b = z.next();
-        scrubTo(b);
-    }
+    int lastFrame = getLastFrameInList();
+    if(lastFrame != -1) scrubTo(lastFrame);
 
 
 }
@@ -2609,12 +3005,7 @@ void Editor::startPlay()
 {
 //scrubTo(1);
 
-    QListIterator<int> z( frameList );
-    for (int i = 0; i < 1; ++i)
-    {
-        int b = z.next();
-        scrubTo(b);
-    }
+    if(!frameList.isEmpty()) scrubTo(frameList.constBegin().key());
 }
 
 void Editor::saveSvg()
@@ -18,6 +18,9 @@ GNU General Public License for more details.
 
 
 #include <QList>
+#include <QMap>
+#include <QFutureWatcher>
+#include <QTime>
 #include <QMainWindow>
 #include <QLabel>
 #include <QToolButton>
@@ -50,7 +53,7 @@ public:
     int currentLayer; // the current layer to be edited/displayed by the editor
     int currentFrame; // the current frame to be edited/displayed by the editor
     int maxFrame; // the number of the last frame for the current object
-    QList<int> frameList; // the frames that are to be cached -- should we use a QMap, or a QHash?
+    QMap<int, int> frameList; // the frames that are to be cached, with the number of keys at each of them (kept sorted by the map)
 
     int fps; // the number of frames per second used by the editor
     QTimer* timer; // the timer used for animation in the editor
@@ -73,7 +76,7 @@ public:
     int getOnionLayer2Opacity() {return onionLayer2Opacity;}
     int getOnionLayer3Opacity() {return onionLayer3Opacity;}
 
-    void importMovie (QString filePath, int fps);
+    void importMovie (QString filePath, int fps, int firstFrame = 1, int frameCount = 0, int width = 0); // imports frameCount frames (all of them if 0) from firstFrame, scaled to width if it is not 0
 
     // backup
     int backupIndex;
@@ -132,6 +135,7 @@ public slots:
     void gridview();
 
     bool maybeSave();
+    bool checkRecovery(); // proposes to recover the animation autosaved by a session which was not closed properly
     void importImage();
     void importImage(QString filePath);
     //void importSound();
@@ -151,6 +155,8 @@ public slots:
     void changeFps(int);
     int getFps();
     void setLoop(bool checked);
+    void setBinaryVectors(bool checked);
+    void setFastBitmaps(bool checked);
     void setSound();
 
     //void scrubKF();
@@ -162,14 +168,16 @@ public slots:
 
     void addKey();
     void duplicateKey();
+    void linkKey();
     void addKey(int layerNumber, int& frameNumber);
     void removeKey();
 
     void addFrame(int frameNumber);
     void addFrame(int frameNumber1, int frameNumber2);
     void removeFrame(int frameNumber);
-    int getLastIndexAtFrame(int frameNumber);
     int getLastFrameAtFrame(int frameNumber);
+    int getPreviousFrameInList(int frameNumber);
+    int getLastFrameInList();
 
     void showPreferences();
 
@@ -251,6 +259,9 @@ public slots:
 
 private slots:    
     bool saveDocument();
+    void saveProgress(int value);
+    void saveFinished();
+    void autosaveObject();
 
     bool exportX();
     bool exportImage();
@@ -269,6 +280,27 @@ private slots:
 
 private:
     bool saveObject(QString);
+    void waitForSave(); // finishes the background save, if any
+    QDomDocument createDocument(bool recovery);
+    bool writeDocument(QString filePath, bool recovery);
+    static bool replaceFile(QString from, QString to);
+
+    // autosave (to a recovery document, written in the background like a save)
+    QTimer* autosaveTimer;
+    QTime autosaveDelay; // started by the first modification which is not autosaved yet
+    void delayAutosave();
+    bool autosaving;
+    QSet<QString> autosaveFiles; // the files of the recovery data directory used by the autosave being written
+    void autosaveFinished(QString filePath, bool success);
+    static QString recoveryFilePath();
+    void removeRecovery();
+
+    // background save
+    QFutureWatcher<void> saveWatcher;
+    QList<FrameFile> saveFiles; // the frames being written
+    QList<int> saveLayerIds; // the layers whose files are committed when the save is done
+    QDomDocument saveDocument; // made when the save starts, and written once the files named after their content are named
+    QString saveFilePath;
 
     ScribbleArea* scribbleArea;
     TimeLine* timeLine;
@@ -306,11 +338,13 @@ private:
     void createExportFramesDialog();
     void createExportMovieDialog();
     void createExportFlashDialog();
+    void createImportMovieDialog();
     void createNewDocumentDialog();
     QDialog* newDocumentDialog;
     QDialog* exportFramesDialog;
     QDialog* exportMovieDialog;
     QDialog* exportFlashDialog;
+    QDialog* importMovieDialog;
     QSpinBox* exportFramesDialog_hBox;
     QSpinBox* exportFramesDialog_vBox;
     QSpinBox* exportMovieDialog_hBox;
@@ -319,6 +353,9 @@ private:
     QSpinBox* exportMovieDialog_fpsBox;
     QComboBox* exportMovieDialog_format;
     QSlider* exportFlashDialog_compression;
+    QSpinBox* importMovieDialog_firstFrame;
+    QSpinBox* importMovieDialog_frameCount; // 0 for all the frames
+    QSpinBox* importMovieDialog_width; // 0 for the size of the movie
 
     // saving (XML)
     QDomElement createDomElement(QDomDocument& doc);
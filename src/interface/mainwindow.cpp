@@ -94,6 +94,14 @@ void MainWindow::createMenus()
     savAct->setShortcut(tr("Ctrl+S"));
     connect(savAct, SIGNAL(triggered()), editor, SLOT(saveForce()));
 
+    binaryVectorsAct = new QAction(tr("&Binary Vector Files"), this);
+    binaryVectorsAct->setCheckable(true);
+    connect(binaryVectorsAct, SIGNAL(triggered(bool)), editor, SLOT(setBinaryVectors(bool)));
+
+    fastBitmapsAct = new QAction(tr("&Fast Bitmap Files"), this);
+    fastBitmapsAct->setCheckable(true);
+    connect(fastBitmapsAct, SIGNAL(triggered(bool)), editor, SLOT(setFastBitmaps(bool)));
+
     QAction* printAct = new QAction(QIcon(":icons/printer3.png"), tr("&Print"), this);
     printAct->setShortcut(tr("Ctrl+P"));
     connect(printAct, SIGNAL(triggered()), editor, SLOT(print()));
@@ -306,6 +314,10 @@ void MainWindow::createMenus()
     duplicateFrameAct->setShortcut(Qt::Key_F6);
     connect(duplicateFrameAct, SIGNAL(triggered()), editor, SLOT(duplicateKey()));
 
+    linkFrameAct = new QAction(tr("&Link Frame"), this);
+    linkFrameAct->setShortcut(Qt::Key_F6 + Qt::SHIFT);
+    connect(linkFrameAct, SIGNAL(triggered()), editor, SLOT(linkKey()));
+
     removeFrameAct = new QAction(QIcon(":icons/remove.png"), tr("&Remove Frame"), this);
     removeFrameAct->setShortcut(tr("Shift+F5"));
     connect(removeFrameAct, SIGNAL(triggered()), editor, SLOT(removeKey()));
@@ -399,6 +411,8 @@ void MainWindow::createMenus()
     fileMenu->addMenu(openRecentMenu);
     fileMenu->addAction(savAct);
     fileMenu->addAction(saveAct);
+    fileMenu->addAction(binaryVectorsAct);
+    fileMenu->addAction(fastBitmapsAct);
     fileMenu->addSeparator();
     fileMenu->addMenu(importMenu);
     fileMenu->addMenu(exportMenu);
@@ -406,6 +420,7 @@ void MainWindow::createMenus()
     fileMenu->addAction(printAct);
     fileMenu->addSeparator();
     fileMenu->addAction(exitAct);
+    connect(fileMenu, SIGNAL(aboutToShow()), this, SLOT(updateFileMenu()));
 
     zoomMenu = new QMenu(tr("Zoom"), this);
     zoomMenu->addAction(zoomAct);
@@ -478,6 +493,7 @@ void MainWindow::createMenus()
     animationMenu->addAction(extendFrameAct);
     animationMenu->addAction(addFrameAct);
     animationMenu->addAction(duplicateFrameAct);
+    animationMenu->addAction(linkFrameAct);
     animationMenu->addAction(removeFrameAct);
 
     toolsMenu = new QMenu(tr("Tools"), this);
@@ -629,7 +645,7 @@ void MainWindow::openDocument()
         QString fileName = QFileDialog::getOpenFileName(this,
                                                         tr("Open File..."),
                                                         myPath,
-                                                        tr("PCL (*.pcl);;Any files (*)"));
+                                                        tr("PCL (*.pcl *.pca);;Any files (*)"));
         if ( fileName.isEmpty() )
         {
             return ;
@@ -810,6 +826,13 @@ void MainWindow::toggleLoop(bool checked)
     loopAnimationAct->setChecked(checked);
 }
 
+void MainWindow::updateFileMenu()
+{
+    // the format is a property of the document, which may have changed since the menu was last shown
+    binaryVectorsAct->setChecked(editor->object->vectorFormat == "VECB");
+    fastBitmapsAct->setChecked(editor->object->bitmapFormat == "PTL");
+}
+
 void MainWindow::undoActSetText(void)
 {
     if (this->editor->backupIndex < 0)
@@ -54,6 +54,7 @@ public slots:
 private slots:
     void exportFile();
     void toggleLoop(bool);
+    void updateFileMenu();
 
     void newDocument();
     void openDocument();
@@ -108,6 +109,8 @@ private:
     QAction* exportPaletteAct;
     QAction* importPaletteAct;
     QAction* savAct;
+    QAction* binaryVectorsAct;
+    QAction* fastBitmapsAct;
     QAction* importAct;
     QAction* undoAct;
     QAction* redoAct;
@@ -133,6 +136,7 @@ private:
     QAction* extendFrameAct;
     QAction* addFrameAct;
     QAction* duplicateFrameAct;
+    QAction* linkFrameAct;
     QAction* removeFrameAct;
     QAction* nextFrameAct;
     QAction* prevFrameAct;
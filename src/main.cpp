@@ -36,6 +36,7 @@ int main(int argc, char* argv[])
     if (argc == 1)
     {
         mainWindow.show();
+        mainWindow.editor->checkRecovery();
         return app.exec();
     }
     else
@@ -116,7 +117,7 @@ int main(int argc, char* argv[])
         else if ( inputFile != "" )
         {
             mainWindow.show();
-            mainWindow.editor->openObject(inputFile);
+            if(!mainWindow.editor->checkRecovery()) mainWindow.editor->openObject(inputFile);
             return app.exec();
         }
         else
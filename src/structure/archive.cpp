@@ -0,0 +1,451 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#include <QtDebug>
+#include <QDataStream>
+#include <QDir>
+#include "archive.h"
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+QHash<QString, Archive*> Archive::archives;
+QMutex Archive::archivesMutex;
+
+static const char archiveMagic[] = "PencilAr"; // 8 characters
+static const quint32 archiveVersion = 1;
+static const quint64 headerSize = 32; // magic, version, reserved, index offset and size
+
+Archive::Archive(QString filePath) : file(filePath)
+{
+    fileSize = headerSize;
+    map = NULL;
+    mapSize = 0;
+}
+
+Archive::~Archive()
+{
+    if(map) file.unmap(map);
+    file.close();
+}
+
+QString Archive::dataPath(QString documentPath)
+{
+    if(isArchive(documentPath)) return documentPath;
+    return documentPath + ".data";
+}
+
+QString Archive::documentFile(QString documentPath)
+{
+    if(isArchive(documentPath)) return documentPath + "/document.xml";
+    return documentPath;
+}
+
+Archive* Archive::open(QString filePath, bool create)
+{
+    QMutexLocker locker(&archivesMutex);
+    QString key = QFileInfo(filePath).absoluteFilePath();
+    Archive* archive = archives.value(key);
+    if(archive) return archive;
+    archive = new Archive(key);
+    bool ok = false;
+    if(QFile::exists(key))
+    {
+        ok = (archive->file.open(QFile::ReadWrite) || archive->file.open(QFile::ReadOnly)) && archive->load();
+    }
+    else if(create)
+    {
+        ok = archive->file.open(QFile::ReadWrite) && archive->writeHeader();
+    }
+    if(!ok)
+    {
+        qDebug() << "Cannot open the archive" << filePath;
+        delete archive;
+        return NULL;
+    }
+    archives.insert(key, archive);
+    return archive;
+}
+
+void Archive::closeAll()
+{
+    QMutexLocker locker(&archivesMutex);
+    qDeleteAll(archives);
+    archives.clear();
+}
+
+Archive* Archive::find(QString path, QString& name)
+{
+    QFileInfo info(path);
+    QString container = info.path();
+    if(!isArchive(container) || QFileInfo(container).isDir()) return NULL;
+    name = info.fileName();
+    return open(container);
+}
+
+// ------ operations on paths
+
+bool Archive::exists(QString path)
+{
+    QString name;
+    Archive* archive = find(path, name);
+    if(archive) return archive->contains(name);
+    return QFile::exists(path);
+}
+
+bool Archive::remove(QString path)
+{
+    QString name;
+    Archive* archive = find(path, name);
+    if(archive) return archive->removeEntry(name);
+    return QFile::remove(path);
+}
+
+bool Archive::rename(QString from, QString to)
+{
+    QString fromName, toName;
+    Archive* fromArchive = find(from, fromName);
+    Archive* toArchive = find(to, toName);
+    if(fromArchive == NULL && toArchive == NULL) return QFile::rename(from, to);
+    if(fromArchive == toArchive) return fromArchive->renameEntry(fromName, toName);
+    return copy(from, to) && remove(from);
+}
+
+bool Archive::copy(QString from, QString to)
+{
+    QString fromName, toName;
+    if(find(from, fromName) == NULL && find(to, toName) == NULL) return QFile::copy(from, to);
+    bool ok;
+    QByteArray data = readData(from, &ok);
+    return ok && writeData(to, data);
+}
+
+QByteArray Archive::readData(QString path, bool* ok)
+{
+    QString name;
+    Archive* archive = find(path, name);
+    if(archive)
+    {
+        if(ok) *ok = archive->contains(name);
+        return archive->read(name);
+    }
+    QFile file(path);
+    if(!file.open(QFile::ReadOnly))
+    {
+        if(ok) *ok = false;
+        return QByteArray();
+    }
+    if(ok) *ok = true;
+    return file.readAll();
+}
+
+bool Archive::writeData(QString path, const QByteArray& data)
+{
+    QString name;
+    Archive* archive = find(path, name);
+    if(archive) return archive->write(name, data);
+    QFile file(path);
+    if(!file.open(QFile::WriteOnly | QFile::Truncate)) return false;
+    bool result = ( file.write(data) == data.size() );
+    file.close();
+    return result && file.error() == QFile::NoError;
+}
+
+QString Archive::localFile(QString path)
+{
+    QString name;
+    Archive* archive = find(path, name);
+    if(archive == NULL) return path;
+    QDir dir(QDir::temp().filePath("pencil/" + QString::number(qHash(archive->file.fileName()))));
+    dir.mkpath(".");
+    QString localPath = dir.filePath(name);
+    QFile::remove(localPath);
+    if(!writeData(localPath, archive->read(name))) qDebug() << "Cannot extract" << path << "to" << localPath;
+    return localPath;
+}
+
+// ------ entries
+
+bool Archive::contains(QString name)
+{
+    QMutexLocker locker(&mutex);
+    return entries.contains(name);
+}
+
+QByteArray Archive::read(QString name)
+{
+    QMutexLocker locker(&mutex);
+    if(!entries.contains(name)) return QByteArray();
+    return readChunk(entries.value(name));
+}
+
+QByteArray Archive::readChunk(const Chunk& chunk)
+{
+    // the data is copied while the mutex is held, as a commit may remap the file and a write may reuse the place of the chunk
+    if(map && chunk.offset + chunk.size <= mapSize) return QByteArray((const char*)map + chunk.offset, chunk.size);
+    // written since the file was mapped
+    if(!file.seek(chunk.offset)) return QByteArray();
+    return file.read(chunk.size);
+}
+
+bool Archive::write(QString name, const QByteArray& data)
+{
+    QMutexLocker locker(&mutex);
+    Chunk chunk(allocate(data.size()), data.size());
+    if(!file.seek(chunk.offset) || file.write(data) != data.size())
+    {
+        qDebug() << "Cannot write" << name << "in the archive" << file.fileName();
+        release(chunk);
+        return false;
+    }
+    if(entries.contains(name)) release(entries.value(name));
+    entries.insert(name, chunk);
+    return true;
+}
+
+bool Archive::removeEntry(QString name)
+{
+    QMutexLocker locker(&mutex);
+    if(!entries.contains(name)) return false;
+    release(entries.take(name));
+    return true;
+}
+
+bool Archive::renameEntry(QString from, QString to)
+{
+    QMutexLocker locker(&mutex);
+    if(!entries.contains(from)) return false;
+    if(from == to) return true;
+    if(entries.contains(to)) release(entries.take(to));
+    entries.insert(to, entries.take(from));
+    return true;
+}
+
+void Archive::clear()
+{
+    QMutexLocker locker(&mutex);
+    QHashIterator<QString, Chunk> it(entries);
+    while(it.hasNext())
+    {
+        release(it.next().value());
+    }
+    entries.clear();
+}
+
+bool Archive::commit()
+{
+    QMutexLocker locker(&mutex);
+    QByteArray index;
+    QDataStream out(&index, QIODevice::WriteOnly);
+    out << quint32(entries.size());
+    QHashIterator<QString, Chunk> it(entries);
+    while(it.hasNext())
+    {
+        it.next();
+        out << it.key() << it.value().offset << it.value().size;
+    }
+
+    // the files and the new index are on the disk before the header refers to it
+    Chunk previousIndex = savedIndex;
+    savedIndex = Chunk(allocate(index.size()), index.size());
+    if(!file.seek(savedIndex.offset) || file.write(index) != index.size() || !sync() || !writeHeader() || !sync())
+    {
+        qDebug() << "Cannot write the index of the archive" << file.fileName();
+        release(savedIndex);
+        savedIndex = previousIndex;
+        return false;
+    }
+
+    // the previous versions of the files can now be overwritten, and the free space at the end of the file is given back
+    savedOffsets.clear();
+    it.toFront();
+    while(it.hasNext())
+    {
+        savedOffsets << it.next().value().offset;
+    }
+    savedOffsets << savedIndex.offset;
+    updateFreeSpace();
+    if(map) file.unmap(map);
+    map = NULL;
+    mapSize = 0;
+    if(!freeSpace.isEmpty())
+    {
+        QMap<quint64, quint64>::iterator last = freeSpace.end() - 1;
+        if(last.key() + last.value() >= fileSize)
+        {
+            fileSize = last.key();
+            freeSpace.erase(last);
+            file.resize(fileSize);
+        }
+    }
+    mapFile();
+    return true;
+}
+
+// ------ file layout
+
+bool Archive::load()
+{
+    QByteArray header = file.read(headerSize);
+    if(header.size() != (int)headerSize || !header.startsWith(archiveMagic)) return false;
+    QDataStream in(header.mid(8));
+    quint32 version, reserved;
+    in >> version >> reserved >> savedIndex.offset >> savedIndex.size;
+    if(version > archiveVersion) return false;
+    fileSize = file.size();
+    mapFile();
+    if(savedIndex.size > 0)
+    {
+        QDataStream indexIn(readChunk(savedIndex));
+        quint32 count;
+        indexIn >> count;
+        for(quint32 i=0; i < count && indexIn.status() == QDataStream::Ok; i++)
+        {
+            QString name;
+            Chunk chunk;
+            indexIn >> name >> chunk.offset >> chunk.size;
+            entries.insert(name, chunk);
+            savedOffsets << chunk.offset;
+        }
+        if(indexIn.status() != QDataStream::Ok) return false;
+        savedOffsets << savedIndex.offset;
+    }
+    updateFreeSpace();
+    return true;
+}
+
+bool Archive::writeHeader()
+{
+    QByteArray header;
+    QDataStream out(&header, QIODevice::WriteOnly);
+    out.writeRawData(archiveMagic, 8);
+    out << archiveVersion << quint32(0) << savedIndex.offset << savedIndex.size;
+    if(!file.seek(0) || file.write(header) != header.size()) return false;
+    return file.flush();
+}
+
+bool Archive::sync()
+{
+    return syncFile(file);
+}
+
+bool Archive::syncFile(QFile& file)
+{
+    if(!file.flush()) return false;
+#ifdef Q_OS_WIN
+    return _commit(file.handle()) == 0;
+#else
+    return fsync(file.handle()) == 0;
+#endif
+}
+
+bool Archive::syncDirectory(QString path)
+{
+#ifdef Q_OS_WIN
+    Q_UNUSED(path);
+    return true; // a directory cannot be flushed on Windows (the entries are written with the files)
+#else
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+    if(fd < 0) return false;
+    bool ok = (fsync(fd) == 0);
+    ::close(fd);
+    return ok;
+#endif
+}
+
+void Archive::mapFile()
+{
+    if(map) file.unmap(map);
+    map = NULL;
+    mapSize = 0;
+    if(fileSize > headerSize)
+    {
+        map = file.map(0, fileSize);
+        if(map) mapSize = fileSize;
+    }
+}
+
+quint64 Archive::allocate(quint64 size)
+{
+    if(size > 0)
+    {
+        QMap<quint64, quint64>::iterator it;
+        for(it = freeSpace.begin(); it != freeSpace.end(); ++it)
+        {
+            if(it.value() >= size)
+            {
+                quint64 offset = it.key();
+                quint64 left = it.value() - size;
+                freeSpace.erase(it);
+                if(left > 0) freeSpace.insert(offset + size, left);
+                return offset;
+            }
+        }
+    }
+    quint64 offset = fileSize;
+    fileSize += size;
+    return offset;
+}
+
+void Archive::release(const Chunk& chunk)
+{
+    if(chunk.size == 0 || savedOffsets.contains(chunk.offset)) return; // the index on disk still refers to it
+    quint64 offset = chunk.offset;
+    quint64 size = chunk.size;
+    // the free places next to each other are merged
+    QMap<quint64, quint64>::iterator next = freeSpace.lowerBound(offset);
+    if(next != freeSpace.end() && next.key() == offset + size)
+    {
+        size += next.value();
+        next = freeSpace.erase(next);
+    }
+    if(next != freeSpace.begin())
+    {
+        QMap<quint64, quint64>::iterator previous = next - 1;
+        if(previous.key() + previous.value() == offset)
+        {
+            offset = previous.key();
+            size += previous.value();
+            freeSpace.erase(previous);
+        }
+    }
+    freeSpace.insert(offset, size);
+}
+
+void Archive::updateFreeSpace()
+{
+    // the free places are the gaps between the chunks in use
+    QMap<quint64, quint64> used;
+    QHashIterator<QString, Chunk> it(entries);
+    while(it.hasNext())
+    {
+        const Chunk& chunk = it.next().value();
+        if(chunk.size > 0) used.insert(chunk.offset, chunk.size);
+    }
+    if(savedIndex.size > 0) used.insert(savedIndex.offset, savedIndex.size);
+    freeSpace.clear();
+    quint64 position = headerSize;
+    QMapIterator<quint64, quint64> usedIt(used);
+    while(usedIt.hasNext())
+    {
+        usedIt.next();
+        if(usedIt.key() > position) freeSpace.insert(position, usedIt.key() - position);
+        position = qMax(position, usedIt.key() + usedIt.value());
+    }
+    if(fileSize > position) freeSpace.insert(position, fileSize - position);
+}
@@ -0,0 +1,96 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <QString>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+
+// a document in a single file: the document, its palette and its frames are chunks of the file, located by an index
+// the chunks the index on disk refers to are never overwritten: a new version of a file is written in a free place of the archive
+// or appended to it, and the header refers to the new index only once it is written, so an interrupted save leaves the previous document
+class Archive
+{
+public:
+    ~Archive();
+
+    static QString suffix() { return "pca"; }
+    static bool isArchive(QString documentPath) { return QFileInfo(documentPath).suffix() == suffix(); }
+    static QString dataPath(QString documentPath); // where the files of a document are: the archive itself, or the directory next to the document
+    static QString documentFile(QString documentPath); // where the XML of a document is
+    static Archive* open(QString filePath, bool create = false); // the archives stay open until closeAll, and are shared by all the paths inside them
+    static void closeAll(); // to be called when no document refers to the archives any more (they are opened again when needed)
+
+    // operations on paths which may be in a directory or in an archive ("animation.pca/001.001.png") -- can be called from any thread
+    static bool exists(QString path);
+    static bool remove(QString path);
+    static bool rename(QString from, QString to);
+    static bool copy(QString from, QString to);
+    static QByteArray readData(QString path, bool* ok = NULL);
+    static bool writeData(QString path, const QByteArray& data);
+    static QString localFile(QString path); // a file with the same content (extracted to a temporary directory if it is in an archive)
+
+    // writing through to the disk (flushing only hands the data to the system, which may lose it on a power failure)
+    static bool syncFile(QFile& file);
+    static bool syncDirectory(QString path); // the renames and removals done in the directory
+
+    bool contains(QString name);
+    QByteArray read(QString name); // a copy of the data (taken from the mapped file if possible)
+    bool write(QString name, const QByteArray& data);
+    bool removeEntry(QString name);
+    bool renameEntry(QString from, QString to);
+    void clear();
+    bool commit(); // writes the index: the archive now holds the files as they are
+
+private:
+    struct Chunk
+    {
+        Chunk(quint64 offset = 0, quint64 size = 0) : offset(offset), size(size) {}
+        quint64 offset;
+        quint64 size;
+    };
+
+    Archive(QString filePath);
+    bool load();
+    bool writeHeader();
+    void mapFile();
+    QByteArray readChunk(const Chunk& chunk); // the mutex is held
+    bool sync(); // the data written so far is on the disk
+    quint64 allocate(quint64 size); // the first free place big enough, or the end of the file
+    void release(const Chunk& chunk);
+    void updateFreeSpace();
+    static Archive* find(QString path, QString& name); // the archive the path is in
+
+    static QHash<QString, Archive*> archives; // by absolute path
+    static QMutex archivesMutex;
+
+    QFile file;
+    QMutex mutex;
+    QHash<QString, Chunk> entries; // the files as they are now
+    QSet<quint64> savedOffsets; // the chunks the index on disk refers to
+    Chunk savedIndex;
+    QMap<quint64, quint64> freeSpace; // size of the free places, by offset
+    quint64 fileSize;
+    uchar* map;
+    quint64 mapSize;
+};
+
+#endif
@@ -14,7 +14,11 @@ GNU General Public License for more details.
 
 */
 #include "layerbitmap.h"
+#include "object.h"
+#include "archive.h"
+#include "tilecodec.h"
 #include <QtDebug>
+#include <QtConcurrentMap>
 
 LayerBitmap::LayerBitmap(Object* object) : LayerImage(object)
 {
@@ -29,8 +33,9 @@ LayerBitmap::LayerBitmap(Object* object) : LayerImage(object)
 
 LayerBitmap::~LayerBitmap()
 {
-    while(!framesBitmap.empty())
-        delete framesBitmap.takeFirst();
+    qDeleteAll( framesBitmap.toSet() ); // the images shared by several keys are deleted once
+    framesBitmap.clear();
+    imageFiles.clear();
 }
 
 // ------
@@ -43,7 +48,10 @@ BitmapImage* LayerBitmap::getBitmapImageAtIndex(int index)
     }
     else
     {
-        return framesBitmap.at(index);
+        BitmapImage* bitmapImage = framesBitmap.at(index);
+        if(imageFiles.contains(bitmapImage)) loadImage(bitmapImage);
+        keyFrames[index].lastUse = ++useCount;
+        return bitmapImage;
     }
 }
 
@@ -74,17 +82,11 @@ QImage* LayerBitmap::getImageAtIndex(int index)
 
 bool LayerBitmap::addImageAtFrame(int frameNumber)
 {
-    int index = getIndexAtFrame(frameNumber);
-    if(index == -1)
+    int index = insertKeyFrame(frameNumber);
+    if(index != -1)
     {
         //framesImage.append(new QImage(imageSize, QImage::Format_ARGB32_Premultiplied));
-        framesBitmap.append(new BitmapImage(object));
-        framesPosition.append(frameNumber);
-        framesOriginalPosition.append(frameNumber);
-        framesSelected.append(false);
-        framesFilename.append("");
-        framesModified.append(false);
-        bubbleSort();
+        framesBitmap.insert(index, new BitmapImage(object));
         emit imageAdded(frameNumber);
         return true;
     }
@@ -94,19 +96,48 @@ bool LayerBitmap::addImageAtFrame(int frameNumber)
     }
 }
 
+bool LayerBitmap::addLinkedImageAtFrame(int frameNumber, int sourceFrame)
+{
+    int sourceIndex = getIndexAtFrame(sourceFrame);
+    if(sourceIndex == -1) return false;
+    BitmapImage* bitmapImage = framesBitmap.at(sourceIndex);
+    QString filename = keyFrames.at(sourceIndex).filename;
+    int index = insertKeyFrame(frameNumber);
+    if(index == -1) return false;
+    framesBitmap.insert(index, bitmapImage);
+    keyFrames[index].filename = filename;
+    emit imageAdded(frameNumber);
+    return true;
+}
+
+QList<int> LayerBitmap::getFirstLinkedIndices()
+{
+    return firstIndices(framesBitmap);
+}
+
+QList<int> LayerBitmap::getLinkedIndices(int index)
+{
+    QList<int> result;
+    BitmapImage* bitmapImage = framesBitmap.at(index);
+    for(int i=0; i < framesBitmap.size(); i++)
+    {
+        if(framesBitmap.at(i) == bitmapImage) result << i;
+    }
+    return result;
+}
+
 void LayerBitmap::removeImageAtFrame(int frameNumber)
 {
     int index = getIndexAtFrame(frameNumber);
-    if(index != -1  && framesPosition.size() != 1)
-    {
-        delete framesBitmap.at(index);
-        framesBitmap.removeAt(index);
-        framesPosition.removeAt(index);
-        framesOriginalPosition.removeAt(index);
-        framesSelected.removeAt(index);
-        framesFilename.removeAt(index);
-        framesModified.removeAt(index);
-        bubbleSort();
+    if(index != -1  && keyFrames.size() != 1)
+    {
+        BitmapImage* bitmapImage = framesBitmap.takeAt(index);
+        if(!framesBitmap.contains(bitmapImage)) // the image may still be shown by linked keys
+        {
+            imageFiles.remove(bitmapImage);
+            delete bitmapImage;
+        }
+        removeKeyFrame(index);
         emit imageRemoved(frameNumber);
     }
 }
@@ -116,26 +147,160 @@ void LayerBitmap::loadImageAtFrame(QString path, QPoint topLeft, int frameNumber
     //qDebug() << path;
     if(getIndexAtFrame(frameNumber) == -1) addImageAtFrame(frameNumber);
     int index = getIndexAtFrame(frameNumber);
-    framesBitmap[index] = new BitmapImage(object, path, topLeft);
+    BitmapImage* previousImage = framesBitmap.at(index);
+    BitmapImage* bitmapImage = new BitmapImage(object); // the pixels are read when the image is first used
+    bitmapImage->boundaries = QRect(topLeft, QSize(0,0));
+    framesBitmap[index] = bitmapImage;
+    imageFiles.insert(bitmapImage, path);
+    if(!framesBitmap.contains(previousImage))
+    {
+        imageFiles.remove(previousImage);
+        delete previousImage;
+    }
     QFileInfo fi(path);
-    framesFilename[index] = fi.fileName();
+    keyFrames[index].filename = fi.fileName();
+}
+
+static QImage readImage(const QString& path)
+{
+    // the format of a file is recognised from its content (the project format may have changed since it was written)
+    QByteArray data = Archive::readData(path);
+    if(TileCodec::canRead(data)) return TileCodec::read(data);
+    return QImage::fromData(data);
+}
+
+void LayerBitmap::attachImage(BitmapImage* bitmapImage, QString path, const QImage& image)
+{
+    *(bitmapImage->image) = image;
+    if(bitmapImage->image->isNull()) qDebug() << "ERROR: Image " << path << " not loaded";
+    bitmapImage->boundaries.setSize(bitmapImage->image->size());
+}
+
+void LayerBitmap::loadImage(BitmapImage* bitmapImage)
+{
+    QString path = imageFiles.take(bitmapImage);
+    QImage image = readImage(path);
+    attachImage(bitmapImage, path, image);
+    // the identical drawings stored in the same file share the decoded pixels (until one of them is modified)
+    QList<BitmapImage*> copies = imageFiles.keys(path);
+    for(int j=0; j < copies.size(); j++)
+    {
+        imageFiles.remove(copies.at(j));
+        attachImage(copies.at(j), path, image);
+    }
+    object->imageLoaded();
+}
+
+void LayerBitmap::loadImages()
+{
+    // the files are decoded concurrently, and the images are attached in order
+    QList<BitmapImage*> images;
+    QStringList paths;
+    QList<int> decodedIndices;
+    QHash<QString, int> pathIndices;
+    for(int i=0; i < framesBitmap.size(); i++)
+    {
+        BitmapImage* bitmapImage = framesBitmap.at(i);
+        if(imageFiles.contains(bitmapImage))
+        {
+            QString path = imageFiles.take(bitmapImage); // the images shared by several keys are read once
+            if(!pathIndices.contains(path))
+            {
+                pathIndices.insert(path, paths.size()); // and so are the identical images stored in the same file
+                paths << path;
+            }
+            images << bitmapImage;
+            decodedIndices << pathIndices.value(path);
+        }
+    }
+    if(images.isEmpty()) return;
+    QFuture<QImage> decoded = QtConcurrent::mapped(paths, readImage);
+    for(int j=0; j < images.size(); j++)
+    {
+        int k = decodedIndices.at(j);
+        attachImage(images.at(j), paths.at(k), decoded.resultAt(k));
+    }
+    object->imageLoaded();
+}
+
+qint64 LayerBitmap::listLoadedImages(QMultiMap<qint64, int>& unloadable)
+{
+    QHash<BitmapImage*, int> lastKeys; // the most recently used key of each loaded image
+    QSet<qint64> counted; // the pixels shared by identical images are counted once
+    qint64 bytes = 0;
+    for(int i=0; i < framesBitmap.size(); i++)
+    {
+        BitmapImage* bitmapImage = framesBitmap.at(i);
+        if(imageFiles.contains(bitmapImage)) continue;
+        if(!lastKeys.contains(bitmapImage))
+        {
+            if(!counted.contains(bitmapImage->image->cacheKey())) bytes += bitmapImage->image->byteCount();
+            counted << bitmapImage->image->cacheKey();
+            lastKeys.insert(bitmapImage, i);
+        }
+        else if(keyFrames.at(i).lastUse > keyFrames.at(lastKeys.value(bitmapImage)).lastUse)
+        {
+            lastKeys.insert(bitmapImage, i);
+        }
+    }
+    QHashIterator<BitmapImage*, int> it(lastKeys);
+    while(it.hasNext())
+    {
+        int index = it.next().value();
+        if(canUnload(index)) unloadable.insert(keyFrames.at(index).lastUse, index);
+    }
+    return bytes;
+}
+
+qint64 LayerBitmap::unloadImage(int index)
+{
+    BitmapImage* bitmapImage = framesBitmap.at(index);
+    if(imageFiles.contains(bitmapImage) || !canUnload(index)) return 0;
+    qint64 bytes = bitmapImage->image->byteCount();
+    *(bitmapImage->image) = QImage();
+    bitmapImage->boundaries.setSize(QSize(0,0));
+    imageFiles.insert(bitmapImage, QDir(savedPath).filePath(keyFrames.at(index).filename));
+    return bytes;
 }
 
-void LayerBitmap::swap(int i, int j)
+void LayerBitmap::reorder(const QList<int>& order)
 {
-    LayerImage::swap(i, j);
-    framesBitmap.swap(i,j);
+    LayerImage::reorder(order);
+    reorderList(framesBitmap, order);
 }
 
-bool LayerBitmap::saveImage(int index, QString path, int layerNumber)
+FrameFile LayerBitmap::snapshotImage(int index, QString path)
 {
-    int theFrame = framesPosition.at(index);
+    int theFrame = keyFrames.at(index).position;
     QString theFileName = fileName(theFrame, id);
-    framesFilename[index] = theFileName;
-    //qDebug() << "Write " << theFileName;
-    framesBitmap[index]->image->save(path +"/"+ theFileName,"PNG");
-    framesModified[index] = false;
+    keyFrames[index].filename = theFileName;
+    keyFrames[index].modified = false;
+    return copyImage(index, path +"/"+ theFileName);
+}
+
+FrameFile LayerBitmap::copyImage(int index, QString filePath)
+{
+    FrameFile file;
+    file.type = Layer::BITMAP;
+    file.filePath = filePath;
+    file.format = object->bitmapFormat;
+    BitmapImage* bitmapImage = framesBitmap.at(index);
+    if(imageFiles.contains(bitmapImage))
+    {
+        file.sourcePath = imageFiles.value(bitmapImage); // the file is copied as it is
+    }
+    else
+    {
+        file.image = *(bitmapImage->image);
+    }
+    return file;
+}
 
+bool LayerBitmap::isNamedAfterContent(int index)
+{
+    // an image which is not loaded keeps its file if it is already named after its content (the loaded ones are hashed when they are written)
+    BitmapImage* bitmapImage = framesBitmap.at(index);
+    if(imageFiles.contains(bitmapImage)) return isContentName(QFileInfo(imageFiles.value(bitmapImage)).fileName());
     return true;
 }
 
@@ -145,7 +310,7 @@ QString LayerBitmap::fileName(int frame, int layerID)
     QString frameNumberString = QString::number(frame);
     while( layerNumberString.length() < 3) layerNumberString.prepend("0");
     while( frameNumberString.length() < 3) frameNumberString.prepend("0");
-    return layerNumberString+"."+frameNumberString+".png";
+    return layerNumberString+"."+frameNumberString+(object->bitmapFormat == "PTL" ? ".ptl" : ".png");
 }
 
 QDomElement LayerBitmap::createDomElement(QDomDocument& doc)
@@ -155,15 +320,19 @@ QDomElement LayerBitmap::createDomElement(QDomDocument& doc)
     layerTag.setAttribute("name", name);
     layerTag.setAttribute("visibility", visible);
     layerTag.setAttribute("type", type);
-    for(int index=0; index < framesPosition.size() ; index++)
+    QList<int> sources = getFirstLinkedIndices();
+    for(int index=0; index < keyFrames.size() ; index++)
     {
         QDomElement imageTag = doc.createElement("image");
-        imageTag.setAttribute("frame", framesPosition.at(index));
-        imageTag.setAttribute("src", framesFilename.at(index));
+        imageTag.setAttribute("frame", keyFrames.at(index).position);
+        imageTag.setAttribute("src", keyFrames.at(index).filename);
+        // the keys sharing a file named after its content are only linked if they share their drawing
+        if(isContentName(keyFrames.at(index).filename)) imageTag.setAttribute("drawing", sources.at(index));
         imageTag.setAttribute("topLeftX", framesBitmap[index]->topLeft().x());
         imageTag.setAttribute("topLeftY", framesBitmap[index]->topLeft().y());
         layerTag.appendChild(imageTag);
     }
+    if(!saveToken.isEmpty()) layerTag.setAttribute("save", saveToken);
     return layerTag;
 }
 
@@ -173,7 +342,12 @@ void LayerBitmap::loadDomElement(QDomElement element, QString filePath)
     name = element.attribute("name");
     visible = (element.attribute("visibility") == "1");
     type = element.attribute("type").toInt();
+    QString dataPath = Archive::dataPath(filePath);
+    recoverImages(dataPath, element.attribute("save"));
+    savedPath = dataPath;
+    knownFiles.clear();
 
+    QHash<QString, int> loadedFrames; // the keys using the same file (and the same drawing) share the same image
     QDomNode imageTag = element.firstChild();
     while(!imageTag.isNull())
     {
@@ -182,13 +356,22 @@ void LayerBitmap::loadDomElement(QDomElement element, QString filePath)
         {
             if(imageElement.tagName() == "image")
             {
-                QString path =  filePath +".data/" + imageElement.attribute("src"); // the file is supposed to be in the data directory
-                QFileInfo fi(path);
-                if(!fi.exists()) path = imageElement.attribute("src");
+                QString src = imageElement.attribute("src");
+                QString drawing = src + "#" + imageElement.attribute("drawing");
                 int position = imageElement.attribute("frame").toInt();
-                int x = imageElement.attribute("topLeftX").toInt();
-                int y = imageElement.attribute("topLeftY").toInt();
-                loadImageAtFrame( path, QPoint(x,y), position );
+                if( !src.isEmpty() && loadedFrames.contains(drawing) && getIndexAtFrame(position) == -1 )
+                {
+                    addLinkedImageAtFrame( position, loadedFrames.value(drawing) );
+                }
+                else
+                {
+                    QString path = dataPath + "/" + src; // the file is supposed to be in the data directory (or in the archive)
+                    if(Archive::exists(path)) knownFiles << src; else path = src;
+                    int x = imageElement.attribute("topLeftX").toInt();
+                    int y = imageElement.attribute("topLeftY").toInt();
+                    loadImageAtFrame( path, QPoint(x,y), position );
+                    loadedFrames.insert(drawing, position);
+                }
             }
             /*if(imageElement.tagName() == "image") {
             	int frame = imageElement.attribute("frame").toInt();
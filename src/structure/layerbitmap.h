@@ -35,11 +35,18 @@ public:
     // method from layerImage
     QImage* getImageAtIndex(int index);
     bool addImageAtFrame(int frameNumber);
+    bool addLinkedImageAtFrame(int frameNumber, int sourceFrame);
     void removeImageAtFrame(int frameNumber);
+    QList<int> getLinkedIndices(int index);
+    QList<int> getFirstLinkedIndices();
 
     void loadImageAtFrame(QString, QPoint, int);
-    bool saveImage(int, QString, int);
+    FrameFile snapshotImage(int index, QString path);
+    FrameFile copyImage(int index, QString filePath);
     QString fileName(int index, int layerNumber);
+    void loadImages();
+    qint64 listLoadedImages(QMultiMap<qint64, int>& unloadable);
+    qint64 unloadImage(int index);
 
     QDomElement createDomElement(QDomDocument& doc);
     void loadDomElement(QDomElement element, QString filePath);
@@ -51,7 +58,13 @@ public:
 
 protected:
     QList<BitmapImage*> framesBitmap;
-    void swap(int i, int j);
+    QHash<BitmapImage*, QString> imageFiles; // the images which are not loaded yet (they have no pixels), with the file they are read from
+    void loadImage(BitmapImage* bitmapImage);
+    void attachImage(BitmapImage* bitmapImage, QString path, const QImage& image);
+    void reorder(const QList<int>& order);
+    bool isNamedAfterContent(int index);
+    void filesMoved(const QList< QPair<QString, QString> >& moves) { moveImageFiles(imageFiles, moves); }
+    void relocateImages(QString path) { relocateImageFiles(imageFiles, framesBitmap, path); }
 };
 
 #endif
@@ -150,9 +150,9 @@ QMatrix LayerCamera::getViewAtFrame(int frameNumber)
     int frame1 = -1;
     int frame2 = -1;
     Camera* camera1 = getCameraAtIndex(index);
-    if(camera1) frame1 = framesPosition.at(index);
+    if(camera1) frame1 = keyFrames.at(index).position;
     Camera* camera2 = getCameraAtIndex(index+1);
-    if(camera2) frame2 = framesPosition.at(index+1);
+    if(camera2) frame2 = keyFrames.at(index+1).position;
     if(camera1 == NULL && camera2 == NULL)
     {
         return QMatrix();
@@ -199,22 +199,18 @@ QImage* LayerCamera::getImageAtIndex(int index)
 
 bool LayerCamera::addImageAtFrame(int frameNumber)
 {
-    int index = getIndexAtFrame(frameNumber);
-    if(index == -1)
+    if(getIndexAtFrame(frameNumber) == -1)
     {
         //framesImage.append(new QImage(imageSize, QImage::Format_ARGB32_Premultiplied));
         Camera* camera = new Camera();
         camera->view = getViewAtFrame(frameNumber);
-        framesCamera.append(camera);
-        framesPosition.append(frameNumber);
-        framesSelected.append(false);
-        framesFilename.append("");
-        framesModified.append(false);
-        bubbleSort();
+        int index = insertKeyFrame(frameNumber);
+        framesCamera.insert(index, camera);
+        // the interpolated views change between the previous and the next keys
         int frameNumber1 = frameNumber;
         int frameNumber2 = frameNumber;
-        if(index>0) frameNumber1 = framesPosition.at(index-1);
-        if(index<framesPosition.size()-1) frameNumber1 = framesPosition.at(index+1);
+        if(index>0) frameNumber1 = keyFrames.at(index-1).position;
+        if(index<keyFrames.size()-1) frameNumber2 = keyFrames.at(index+1).position;
         emit imageAdded(frameNumber1, frameNumber2);
         return true;
     }
@@ -227,15 +223,11 @@ bool LayerCamera::addImageAtFrame(int frameNumber)
 void LayerCamera::removeImageAtFrame(int frameNumber)
 {
     int index = getIndexAtFrame(frameNumber);
-    if(index != -1  && framesPosition.size() != 1)
+    if(index != -1  && keyFrames.size() != 1)
     {
         delete framesCamera.at(index);
         framesCamera.removeAt(index);
-        framesPosition.removeAt(index);
-        framesSelected.removeAt(index);
-        framesFilename.removeAt(index);
-        framesModified.removeAt(index);
-        bubbleSort();
+        removeKeyFrame(index);
         emit imageRemoved(frameNumber);
     }
 }
@@ -249,24 +241,24 @@ void LayerCamera::loadImageAtFrame(int frameNumber, QMatrix view)
     emit imageAdded(frameNumber);
 }
 
-void LayerCamera::swap(int i, int j)
+void LayerCamera::reorder(const QList<int>& order)
 {
-    LayerImage::swap(i, j);
-    framesCamera.swap(i,j);
+    LayerImage::reorder(order);
+    reorderList(framesCamera, order);
 }
 
 bool LayerCamera::saveImage(int index, QString path, int layerNumber)
 {
     QString layerNumberString = QString::number(layerNumber);
-    QString frameNumberString = QString::number(framesPosition.at(index));
+    QString frameNumberString = QString::number(keyFrames.at(index).position);
     while( layerNumberString.length() < 3) layerNumberString.prepend("0");
     while( frameNumberString.length() < 3) frameNumberString.prepend("0");
     //framesFilename[index] = path+"/"+layerNumberString+"."+frameNumberString+".png";
-    framesFilename[index] = layerNumberString+"."+frameNumberString+".png";
+    keyFrames[index].filename = layerNumberString+"."+frameNumberString+".png";
     //qDebug() << "Write " << framesFilename.at(index);
 
     //framesCamera[index]->image->save(path +"/"+ framesFilename.at(index),"PNG");
-    framesModified[index] = false;
+    keyFrames[index].modified = false;
 
     return true;
 }
@@ -295,10 +287,10 @@ QDomElement LayerCamera::createDomElement(QDomDocument& doc)
     layerTag.setAttribute("type", type);
     layerTag.setAttribute("width", viewRect.width());
     layerTag.setAttribute("height", viewRect.height());
-    for(int index=0; index < framesPosition.size() ; index++)
+    for(int index=0; index < keyFrames.size() ; index++)
     {
         QDomElement keyTag = doc.createElement("camera");
-        keyTag.setAttribute("frame", framesPosition.at(index));
+        keyTag.setAttribute("frame", keyFrames.at(index).position);
 
         keyTag.setAttribute("m11", framesCamera[index]->view.m11());
         keyTag.setAttribute("m12", framesCamera[index]->view.m12());
@@ -84,7 +84,7 @@ protected:
     CameraPropertiesDialog* dialog;
 
     QList<Camera*> framesCamera;
-    void swap(int i, int j);
+    void reorder(const QList<int>& order);
 };
 
 #endif
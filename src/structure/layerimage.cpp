@@ -14,47 +14,81 @@ GNU General Public License for more details.
 
 */
 #include <QtDebug>
+#include <QDateTime>
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDataStream>
 #include "layerimage.h"
 #include "object.h"
+#include "archive.h"
+#include "tilecodec.h"
 #include "timeline.h"
 
+int LayerImage::autosaveCount = 0;
+qint64 LayerImage::useCount = 0;
+
 LayerImage::LayerImage(Object* object) : Layer(object)
 {
     //imageSize = desiredSize;
     //addImageAtFrame(1);
     frameClicked = -1;
     frameOffset = 0;
+    saving = false;
 }
 
 LayerImage::~LayerImage()
 {
 }
 
-int LayerImage::getIndexAtFrame(int frameNumber)
+int LayerImage::lowerBound(int frameNumber)
 {
-    int index = -1;
-    for(int i=0; i< framesPosition.size(); i++)
+    int first = 0;
+    int last = keyFrames.size();
+    while(first < last)
     {
-        if(framesPosition.at(i) == frameNumber) index = i;
+        int middle = (first + last)/2;
+        if(keyFrames.at(middle).position < frameNumber)
+        {
+            first = middle + 1;
+        }
+        else
+        {
+            last = middle;
+        }
     }
-    return index;
+    return first;
+}
+
+int LayerImage::getIndexAtFrame(int frameNumber)
+{
+    int index = lowerBound(frameNumber);
+    if(index < keyFrames.size() && keyFrames.at(index).position == frameNumber) return index;
+    return -1;
 }
 
 int LayerImage::getLastIndexAtFrame(int frameNumber)
 {
-    int position  = -1;
-    int index = -1;
-    for(int i=0; i < framesPosition.size(); i++)
-    {
-        if(framesPosition.at(i) > position && framesPosition.at(i) <= frameNumber)
-        {
-            position = framesPosition.at(i);
-            index = i;
-        }
-    }
+    return lowerBound(frameNumber+1) - 1; // -1 if there is no key before this frame
+}
+
+int LayerImage::insertKeyFrame(int frameNumber)
+{
+    int index = lowerBound(frameNumber);
+    if(index < keyFrames.size() && keyFrames.at(index).position == frameNumber) return -1;
+    keyFrames.insert(index, KeyFrame(frameNumber));
     return index;
 }
 
+void LayerImage::removeKeyFrame(int index)
+{
+    keyFrames.removeAt(index);
+}
+
+void LayerImage::reorder(const QList<int>& order)
+{
+    reorderList(keyFrames, order);
+}
+
 QImage* LayerImage::getImageAtIndex(int index)
 {
     return NULL; // no image -> implemented in subclasses
@@ -145,13 +179,13 @@ void LayerImage::paintImages(QPainter& painter, TimeLineCells* cells, int x, int
     painter.setPen(QPen(QBrush(QColor(40,40,40)), 1, Qt::SolidLine, Qt::RoundCap,Qt::RoundJoin));
     if(visible)
     {
-        for(int i=0; i < framesPosition.size(); i++)
+        for(int i=0; i < keyFrames.size(); i++)
         {
-            if(framesSelected.at(i))
+            if(keyFrames.at(i).selected)
             {
                 painter.setBrush(QColor(60,60,60));
                 //painter.drawRect(x+(framesPosition.at(i)+frameOffset-1)*frameSize+2, y+1, frameSize-2, height-4);
-                painter.drawRect( cells->getFrameX(framesPosition.at(i)+frameOffset)-frameSize+2, y+1, frameSize-2, height-4);
+                painter.drawRect( cells->getFrameX(keyFrames.at(i).position+frameOffset)-frameSize+2, y+1, frameSize-2, height-4);
             }
             else
             {
@@ -159,8 +193,8 @@ void LayerImage::paintImages(QPainter& painter, TimeLineCells* cells, int x, int
                     painter.setBrush(QColor(125,125,125));
                 else
                     painter.setBrush(QColor(125,125,125,125));
-                if(framesModified.at(i)) painter.setBrush(QColor(255,125,125,125));
-                painter.drawRect( cells->getFrameX(framesPosition.at(i))-frameSize+2, y+1, frameSize-2, height-4 );
+                if(keyFrames.at(i).modified) painter.setBrush(QColor(255,125,125,125));
+                painter.drawRect( cells->getFrameX(keyFrames.at(i).position)-frameSize+2, y+1, frameSize-2, height-4 );
                 //painter.drawRect(x+(framesPosition.at(i)-1)*frameSize+2, y+1, frameSize-2, height-4);
                 //painter.drawText(QPoint( (framesPosition.at(i)-1)*frameSize+5, y+(2*height)/3), QString::number(i) );
             }
@@ -178,17 +212,17 @@ void LayerImage::mousePress(QMouseEvent* event, int frameNumber)
     }
     else
     {
-        if( (event->modifiers() != Qt::ShiftModifier) && (!framesSelected.at(index)) && (event->buttons() != Qt::RightButton) )
+        if( (event->modifiers() != Qt::ShiftModifier) && (!keyFrames.at(index).selected) && (event->buttons() != Qt::RightButton) )
         {
             deselectAllFrames();
         }
-        framesSelected[index] = true;
+        keyFrames[index].selected = true;
     }
     if(event->modifiers() == Qt::AltModifier)
     {
-        for(int i=index; i < framesPosition.size(); i++)
+        for(int i=index; i < keyFrames.size(); i++)
         {
-            framesSelected[i] = true;
+            keyFrames[i].selected = true;
         }
     }
 }
@@ -198,9 +232,9 @@ void LayerImage::mouseDoubleClick(QMouseEvent* event, int frameNumber)
     int index = getIndexAtFrame(frameNumber);
     if(index != -1)
     {
-        for(int i=index; i < framesPosition.size(); i++)
+        for(int i=index; i < keyFrames.size(); i++)
         {
-            framesSelected[i] = true;
+            keyFrames[i].selected = true;
         }
     }
 }
@@ -209,56 +243,80 @@ void LayerImage::mouseDoubleClick(QMouseEvent* event, int frameNumber)
 void LayerImage::mouseMove(QMouseEvent* event, int frameNumber)
 {
     frameOffset = frameNumber - frameClicked;
-    bool ok = true;
-    for(int i=0; i < framesPosition.size(); i++)
+    if(!canMoveSelectedFrames(frameOffset)) frameOffset = 0;
+}
+
+void LayerImage::mouseRelease(QMouseEvent* event, int frameNumber)
+{
+    moveSelectedFrames(frameOffset);
+    frameOffset = 0;
+}
+
+bool LayerImage::canMoveSelectedFrames(int offset)
+{
+    // the selected keys, shifted by offset, and the other keys are two sorted sequences:
+    // they are walked together to find a collision, in linear time
+    int j = 0;
+    for(int i=0; i < keyFrames.size(); i++)
     {
-        if(framesSelected.at(i))
+        if(keyFrames.at(i).selected)
         {
-            if(framesPosition.at(i) + frameOffset < 1) ok = false;
-            for(int j=0; j < framesPosition.size(); j++)
-            {
-                if(!framesSelected.at(j))
-                {
-                    if(framesPosition.at(i) + frameOffset == framesPosition.at(j))
-                    {
-                        ok = false;
-                    }
-                }
-            }
+            int target = keyFrames.at(i).position + offset;
+            if(target < 1) return false;
+            while( j < keyFrames.size() && (keyFrames.at(j).selected || keyFrames.at(j).position < target) ) j++;
+            if(j == keyFrames.size()) return true; // no other key after this one
+            if(keyFrames.at(j).position == target) return false;
         }
     }
-    if(ok == false) frameOffset = 0;
+    return true;
 }
 
-void LayerImage::mouseRelease(QMouseEvent* event, int frameNumber)
+void LayerImage::moveSelectedFrames(int offset)
 {
-    for(int i=0; i < framesPosition.size(); i++)
+    if(offset == 0) return;
+    QList<int> selectedIndices;
+    QList<int> otherIndices;
+    for(int i=0; i < keyFrames.size(); i++)
     {
-        if(framesSelected.at(i) && frameOffset != 0)
+        if(keyFrames.at(i).selected)
         {
-            int originalFrame = framesPosition[i];
-            framesPosition[i] = originalFrame + frameOffset;
-            //framesModified[i] = true;
+            int originalFrame = keyFrames.at(i).position;
+            keyFrames[i].position = originalFrame + offset;
+            selectedIndices.append(i);
             emit imageRemoved(originalFrame); // this is to indicate to the cache that an image have been removed here
-            emit imageAdded(originalFrame + frameOffset); // this is to indicate to the cache that an image have been added here
-            object->modification();
+            emit imageAdded(originalFrame + offset); // this is to indicate to the cache that an image have been added here
+        }
+        else
+        {
+            otherIndices.append(i);
         }
     }
-    bubbleSort();
-    frameOffset = 0;
+    if(selectedIndices.isEmpty()) return;
+    object->modification();
+
+    // both sequences are still sorted, so the new order is given by merging them
+    QList<int> order;
+    int i = 0;
+    int j = 0;
+    while( i < selectedIndices.size() || j < otherIndices.size() )
+    {
+        if( j == otherIndices.size() || (i < selectedIndices.size() && keyFrames.at(selectedIndices.at(i)).position < keyFrames.at(otherIndices.at(j)).position) )
+        {
+            order.append(selectedIndices.at(i++));
+        }
+        else
+        {
+            order.append(otherIndices.at(j++));
+        }
+    }
+    reorder(order);
 }
 
 bool LayerImage::addImageAtFrame(int frameNumber)
 {
-    int index = getIndexAtFrame(frameNumber);
-    if(index == -1)
+    int index = insertKeyFrame(frameNumber);
+    if(index != -1)
     {
-        framesPosition.append(frameNumber);
-        framesOriginalPosition.append(frameNumber);
-        framesSelected.append(false);
-        framesFilename.append("");
-        framesModified.append(false);
-        bubbleSort();
         emit imageAdded(frameNumber);
         return true;
     }
@@ -268,161 +326,483 @@ bool LayerImage::addImageAtFrame(int frameNumber)
     }
 }
 
+bool LayerImage::addLinkedImageAtFrame(int frameNumber, int sourceFrame)
+{
+    return false; // no image -> implemented in subclasses
+}
+
+QList<int> LayerImage::getLinkedIndices(int index)
+{
+    QList<int> result;
+    result << index;
+    return result;
+}
+
+QList<int> LayerImage::getFirstLinkedIndices()
+{
+    QList<int> result;
+    for(int i=0; i < keyFrames.size(); i++) result << i;
+    return result;
+}
+
 void LayerImage::removeImageAtFrame(int frameNumber)
 {
     int index = getIndexAtFrame(frameNumber);
     if(index != -1)
     {
-        framesPosition.removeAt(index);
-        framesOriginalPosition.removeAt(index);
-        framesSelected.removeAt(index);
-        framesFilename.removeAt(index);
-        framesModified.removeAt(index);
+        removeKeyFrame(index);
         emit imageRemoved(frameNumber);
     }
-    bubbleSort();
 }
 
-void LayerImage::bubbleSort()
+void LayerImage::markModified(int frameNumber)
 {
-    // from http://fr.wikipedia.org/wiki/Tri_a_bulles
-    int i   = 0; /* Indice de repetition du tri */
-    int j   = 0; /* Variable de boucle */
-    int MAX = framesPosition.size(); /* taille du tableau */
-    /* Booleen marquant l'arret du tri si le tableau est ordonne */
-    bool en_desordre = true;
-    /* Boucle de repetition du tri et le test qui arrete le tri des que le tableau est ordonne */
-    for(i = 0 ; (i < MAX ) && en_desordre; i++)
+    int index = getLastIndexAtFrame(frameNumber);
+    if(index != -1)
     {
-        /* Supposons le tableau ordonne */
-        en_desordre = false;
-        /* Verification des elements des places j et j-1 */
-        for(j = 1 ; j < MAX - i ; j++)
+        QList<int> linkedIndices = getLinkedIndices(index);
+        for(int i=0; i < linkedIndices.size(); i++)
         {
-            /* Si les 2 elements sont mal tries */
-            if(framesPosition[j] < framesPosition[j-1])
-            {
-                /* Inversion des 2 elements */
-                swap(j-1,j);
-                /* Le tableau n'est toujours pas trie */
-                en_desordre = true;
-            }
+            keyFrames[linkedIndices.at(i)].modified = true;
+            keyFrames[linkedIndices.at(i)].autosaveFilename = "";
         }
     }
 }
 
-void LayerImage::swap(int i, int j)
-{
-    framesPosition.swap(i,j);
-    framesOriginalPosition.swap(i,j);
-    framesSelected.swap(i,j);
-    framesFilename.swap(i,j);
-    framesModified.swap(i,j);
-}
-
 void LayerImage::setModified(int frameNumber, bool trueOrFalse)
 {
     int index = getLastIndexAtFrame(frameNumber);
     if(index != -1)
     {
-        framesModified[index] = trueOrFalse;
+        // the drawing is modified for all the keys showing it
+        QList<int> linkedIndices = getLinkedIndices(index);
+        for(int i=0; i < linkedIndices.size(); i++)
+        {
+            keyFrames[linkedIndices.at(i)].modified = trueOrFalse;
+            if(trueOrFalse) keyFrames[linkedIndices.at(i)].autosaveFilename = "";
+        }
         object->modification();
     }
 }
 
 void LayerImage::deselectAllFrames()
 {
-    for(int i=0; i < framesPosition.size(); i++)
+    for(int i=0; i < keyFrames.size(); i++)
     {
-        framesSelected[i] = false;
+        keyFrames[i].selected = false;
     }
 }
 
-bool LayerImage::saveImages(QString path, int layerNumber)
+bool LayerImage::saveImages(QString path, int layerNumber, QList<FrameFile>& files)
 {
     qDebug() << "Saving images of layer n. " << layerNumber;
     QDir dir(path);
-    //qDebug() << dir.exists() << dir.path();
-    //qDebug() << framesPosition;
-    //qDebug() << framesOriginalPosition;
-
-    /*
-    // commented because this optimization does not work as expected
-    // --- we test if all the files already exists
-    for(int i=0; i < framesPosition.size(); i++) {
-    	QString fileName = framesFilename.at(i);
-    	qDebug() << "Testing if (" << i << ") " << fileName << " exists";
-    	bool test = dir.exists(fileName);
-    	if(!test) {
-            qDebug() << "The file (" << i << ", frame " << framesPosition.at(i) << " ) " << fileName << " does not exist";
-            framesModified[i] = true;
-    	} else {
-    	    qDebug() << "The file (" << i << ", frame " << framesPosition.at(i) << " ) " << fileName << " exists";
-    	}
-    }
-    // --- we rename the files for the images which have been moved (if such files exist)
+    bool samePlace = ( !savedPath.isEmpty() && QDir(savedPath).absolutePath() == dir.absolutePath() );
+    if(!samePlace) knownFiles.clear();
+    saving = true;
+    movedFiles.clear();
+    bool renamable = !fileName(0, id).isEmpty(); // the sound files keep their own names
+
+    // --- every move of a file is written in a journal before it is done, so that it can be undone
+    // --- (an archive needs no journal: its index on disk refers to the previous files until it is committed)
+    saveToken = QDateTime::currentDateTime().toString("yyyyMMddhhmmsszzz");
+    QFile journalFile;
+    QTextStream journal;
+    bool journaled = renamable && !Archive::isArchive(path);
+    if(journaled)
+    {
+        journalFile.setFileName(dir.filePath(journalName()));
+        // a journal left by a previous save means that the save was not committed (see commitImages and abortSave):
+        // the document on disk refers to the files as they were before it, so its moves are undone before the journal is reused
+        if(journalFile.exists()) recoverImages(path, "");
+        if(!journalFile.open(QFile::WriteOnly | QFile::Truncate | QFile::Text)) qDebug() << "Cannot write the journal" << journalFile.fileName();
+        journal.setDevice(&journalFile);
+        journal << saveToken << "\n";
+        journal.flush();
+        if(!Archive::syncFile(journalFile)) qDebug() << "Cannot sync the journal" << journalFile.fileName();
+    }
+
+    // --- we find the drawings which have to be written, and the files which only have to be renamed
+    QList<int> sources = getFirstLinkedIndices();
+    QList<int> moved;
+    for(int i=0; i < keyFrames.size(); i++)
+    {
+        keyFrames[i].originalPosition = keyFrames.at(i).position;
+        if(sources.at(i) != i) continue; // a drawing shared by several keys is saved once
+        QString filename = keyFrames.at(i).filename;
+        if(!samePlace || filename.isEmpty() || !Archive::exists(dir.filePath(filename)))
+        {
+            keyFrames[i].modified = true;
+        }
+        else if(renamable && !needsSaving(i) && filename != keyFileName(i) && !isContentName(filename))
+        {
+            moved << i;
+        }
+    }
+
+    // --- we rename the files for the images which have been moved
     // --- we do that in two steps, with temporary names in the first step, in order to avoid conflicting names
-    // don't rename audio files
-    if (this->type != Layer::SOUND ) {
-    for(int i=0; i < framesPosition.size(); i++) {
-    	int frame1 = framesPosition.at(i);
-    	int frame0 = framesOriginalPosition.at(i);
-    	if(frame1 != frame0 && framesFilename.at(i) != "") {
-    		QString fileName0 = fileName(frame0,layerNumber);
-    		QString fileName1 = fileName(frame1,layerNumber);
-    		//qDebug() << fileName0 << fileName1;
-    		bool rename = dir.rename( fileName0, "tmp"+fileName0 );
-    		if(rename) { }
-    	}
-    }
-    for(int i=0; i < framesPosition.size(); i++) {
-    	int frame1 = framesPosition.at(i);
-    	int frame0 = framesOriginalPosition.at(i);
-    	if(frame1 != frame0 && framesFilename.at(i) != "") {
-    		QString fileName0 = fileName(frame0,layerNumber);
-    		QString fileName1 = fileName(frame1,layerNumber);
-    		bool rename = dir.rename( "tmp"+fileName0, fileName1 );
-    		if(rename) {
-    			framesOriginalPosition[i] = frame1;
-    			framesFilename[i] = fileName1;
-    			qDebug() << "File " << fileName0 << " renamed to " << fileName1 << " " << framesFilename.at(i);
-    		} else { // the file doesn't exist, we probably need to create it
-    			qDebug() << "Could not rename to " << framesFilename.at(i);
-    			framesFilename[i] = "";
-    			framesModified[i] = true;
-    		}
-    		}
-    	}
-    }
-    // --- we now save the files for the images which have been modified
-    for(int i=0; i < framesPosition.size(); i++) {
-    	framesOriginalPosition[i]=framesPosition[i];
-    	QString fileName1 = fileName(framesPosition.at(i),layerNumber);
-    	if ( fileName1.compare(framesFilename.at(i)))
-    	qDebug() << "Inconsistent filename: " << framesFilename.at(i);
-    	if(framesModified.at(i)) {
-    		qDebug() << "Trying to save " << framesFilename.at(i);
-    		saveImage(i, path, layerNumber);
-    }
-    }*/
-
-    // always saves all frames, no optimization
-    for(int i=0; i < framesPosition.size(); i++)
-    {
-        framesOriginalPosition[i]=framesPosition[i];
-        qDebug() << "Trying to save " << framesFilename.at(i) << " of layer n. " << layerNumber;
-        saveImage(i, path, layerNumber);
+    for(int j=0; j < moved.size(); j++)
+    {
+        int i = moved.at(j);
+        QString filename = keyFrames.at(i).filename;
+        if(!moveFile(dir, journal, filename, filename + ".tmp")) keyFrames[i].modified = true; // the file will be written instead
+    }
+    for(int j=0; j < moved.size(); j++)
+    {
+        int i = moved.at(j);
+        if(keyFrames.at(i).modified) continue;
+        QString filename = keyFrames.at(i).filename;
+        QString target = keyFileName(i);
+        displaceFile(dir, journal, target);
+        if(moveFile(dir, journal, filename + ".tmp", target))
+        {
+            qDebug() << "File " << filename << " renamed to " << target;
+            keyFrames[i].filename = target;
+        }
+        else
+        {
+            qDebug() << "Could not rename " << filename << " to " << target;
+            leftoverFiles << filename + ".tmp";
+            keyFrames[i].modified = true;
+        }
+    }
+
+    // --- we now copy the images which have been modified, to be written by the caller (a previous version of a file is kept until the document is written)
+    QList<int> modified;
+    QList<bool> contentNamed;
+    for(int i=0; i < keyFrames.size(); i++)
+    {
+        if(sources.at(i) == i && needsSaving(i))
+        {
+            bool named = renamable && isNamedAfterContent(i);
+            if(renamable && !named) displaceFile(dir, journal, fileName(keyFrames.at(i).position, id));
+            modified << i;
+            contentNamed << named;
+        }
+    }
+    filesMoved(movedFiles); // the drawings which are not loaded are copied from where their files are now
+    QSharedPointer<ContentFiles> contents(new ContentFiles);
+    contents->directory = path;
+    QString positionName = fileName(0, id);
+    contents->pattern = positionName.section('.', 0, 0) + ".%1." + positionName.section('.', -1);
+    contents->known = knownFiles;
+    for(int j=0; j < modified.size(); j++)
+    {
+        int i = modified.at(j);
+        if(!contentNamed.at(j))
+        {
+            files << snapshotImage(i, path);
+        }
+        else
+        {
+            // the drawing is hashed (and only written if no file has its content yet) by the thread writing the files, as hashing all the pixels takes time:
+            // until then the key refers to a temporary name, unless the drawing is not loaded and its file already has the name of its content
+            FrameFile file = copyImage(i, "");
+            if(file.sourcePath.isEmpty()) keyFrames[i].filename = saveToken + "." + QString::number(id) + "." + QString::number(j) + ".hash";
+            else keyFrames[i].filename = QFileInfo(file.sourcePath).fileName();
+            keyFrames[i].modified = false;
+            file.contentName = keyFrames.at(i).filename;
+            file.contentFiles = contents;
+            files << file;
+        }
+    }
+    for(int i=0; i < keyFrames.size(); i++)
+    {
+        if(sources.at(i) != i)
+        {
+            keyFrames[i].filename = keyFrames.at(sources.at(i)).filename;
+            keyFrames[i].modified = false;
+        }
+    }
+    pendingFiles.clear();
+    for(int i=0; i < keyFrames.size(); i++)
+    {
+        pendingFiles << keyFrames.at(i).filename;
     }
+    if(journaled) journalFile.close();
+    savedPath = path;
     qDebug() << "Layer " << layerNumber << "done";
     return true;
 }
 
-bool LayerImage::saveImage(int index, QString path, int layerNumber)
+void LayerImage::resolveContentNames(const QHash<QString, QString>& names)
 {
-    // implemented in subclasses
+    if(names.isEmpty()) return;
+    for(int i=0; i < keyFrames.size(); i++)
+    {
+        QHash<QString, QString>::const_iterator it = names.constFind(keyFrames.at(i).filename);
+        if(it != names.constEnd()) keyFrames[i].filename = it.value();
+    }
+    QSet<QString> files;
+    QSetIterator<QString> it(pendingFiles);
+    while(it.hasNext())
+    {
+        QString filename = it.next();
+        files << names.value(filename, filename);
+    }
+    pendingFiles = files;
+}
+
+void LayerImage::commitImages(QString path)
+{
+    saving = false;
+    if(fileName(0, id).isEmpty()) return;
+    QDir dir(path);
+    relocateImages(path);
+    // --- the document refers to the new files: the files no longer used by any key and the previous versions are removed
+    // --- (the keys may have changed since the save started, so the files used are those of the saved document)
+    QSetIterator<QString> it(knownFiles);
+    while(it.hasNext())
+    {
+        QString filename = it.next();
+        if(!pendingFiles.contains(filename))
+        {
+            qDebug() << "Removing unused file " << filename;
+            Archive::remove(dir.filePath(filename));
+        }
+    }
+    for(int j=0; j < leftoverFiles.size(); j++)
+    {
+        Archive::remove(dir.filePath(leftoverFiles.at(j)));
+    }
+    leftoverFiles.clear();
+    knownFiles = pendingFiles;
+    Archive::syncDirectory(dir.path()); // the moves are on the disk before the journal which could undo them disappears
+    dir.remove(journalName());
+}
+
+void LayerImage::abortSave()
+{
+    // the document on disk still refers to the files as they were before the save: its moves are undone in reverse order
+    if(saving && !movedFiles.isEmpty())
+    {
+        bool undone = true;
+        QList< QPair<QString, QString> > rollback;
+        for(int j=movedFiles.size()-1; j >= 0; j--)
+        {
+            QString from = movedFiles.at(j).first;
+            QString to = movedFiles.at(j).second;
+            if(!Archive::exists(to)) continue;
+            Archive::remove(from); // written after the move
+            if(Archive::rename(to, from)) rollback << qMakePair(to, from);
+            else undone = false;
+        }
+        filesMoved(rollback); // the drawings which are not loaded follow their files back
+        if(undone && !savedPath.isEmpty() && Archive::syncDirectory(savedPath)) QDir(savedPath).remove(journalName()); // otherwise the journal is replayed by the next save or load
+    }
+    movedFiles.clear();
+    savedPath = "";
+    leftoverFiles.clear();
+    saving = false;
+}
+
+bool LayerImage::moveFile(QDir& dir, QTextStream& journal, QString from, QString to)
+{
+    QString fromPath = dir.filePath(from);
+    QString toPath = dir.filePath(to);
+    if(Archive::exists(toPath) && !displaceFile(dir, journal, to)) return false; // the file in the way is kept until the document is written
+    if(journal.device())
+    {
+        journal << from << "\t" << to << "\n";
+        journal.flush();
+        // the entry has to be on the disk before the rename, or a rename could survive a power failure without the entry to undo it
+        if(!Archive::syncFile(*(QFile*)journal.device())) return false;
+    }
+    if(!Archive::rename(fromPath, toPath)) return false;
+    movedFiles << qMakePair(fromPath, toPath);
     return true;
 }
 
+bool LayerImage::displaceFile(QDir& dir, QTextStream& journal, QString name)
+{
+    if(!Archive::exists(dir.filePath(name))) return true;
+    // the previous version is renamed (not removed), with a journal entry, so that a rollback can put it back
+    QString displaced = name + ".old";
+    for(int n=1; Archive::exists(dir.filePath(displaced)); n++) displaced = name + "." + QString::number(n) + ".old";
+    if(!moveFile(dir, journal, name, displaced)) return false;
+    leftoverFiles << displaced;
+    return true;
+}
+
+void LayerImage::recoverImages(QString path, QString documentToken)
+{
+    QDir dir(path);
+    QFile journalFile(dir.filePath(journalName()));
+    if(!journalFile.open(QFile::ReadOnly | QFile::Text)) return;
+    QTextStream journal(&journalFile);
+    QString journalToken = journal.readLine();
+    QList<QStringList> moves;
+    while(!journal.atEnd())
+    {
+        QStringList move = journal.readLine().split('\t');
+        if(move.size() == 2) moves << move;
+    }
+    journalFile.close();
+
+    if(journalToken == documentToken)
+    {
+        // the document was written: only the previous versions of the files are left
+        for(int j=0; j < moves.size(); j++)
+        {
+            if(moves.at(j).at(1).endsWith(".old")) dir.remove(moves.at(j).at(1));
+        }
+    }
+    else
+    {
+        // the document refers to the files as they were before the save: the moves are undone in reverse order
+        qDebug() << "Rolling back an interrupted save of layer " << name;
+        QList< QPair<QString, QString> > rollback;
+        for(int j=moves.size()-1; j >= 0; j--)
+        {
+            QString from = moves.at(j).at(0);
+            QString to = moves.at(j).at(1);
+            if(dir.exists(to))
+            {
+                dir.remove(from); // written after the move
+                if(dir.rename(to, from)) rollback << qMakePair(dir.filePath(to), dir.filePath(from));
+            }
+        }
+        filesMoved(rollback); // the drawings which are not loaded follow their files back
+        Archive::syncDirectory(dir.path());
+    }
+    dir.remove(journalName());
+}
+
+FrameFile LayerImage::snapshotImage(int index, QString path)
+{
+    // implemented in subclasses
+    return FrameFile();
+}
+
+FrameFile LayerImage::copyImage(int index, QString filePath)
+{
+    // implemented in subclasses
+    return FrameFile();
+}
+
+void LayerImage::autosaveImages(QString path, QList<FrameFile>& files)
+{
+    static const QString session = QDateTime::currentDateTime().toString("yyyyMMddhhmmss"); // the files of another session are never overwritten
+    QString suffix = "." + fileName(0, id).section('.', -1);
+    autosaveSources.clear();
+    QList<int> sources = getFirstLinkedIndices();
+    for(int i=0; i < keyFrames.size(); i++)
+    {
+        int source = sources.at(i);
+        if(source != i)
+        {
+            autosaveSources << autosaveSources.at(source);
+            continue;
+        }
+        const KeyFrame& key = keyFrames.at(i);
+        if(!savedPath.isEmpty() && !key.filename.isEmpty() && !needsSaving(i))
+        {
+            autosaveSources << QDir(savedPath).absoluteFilePath(key.filename); // the saved file is up to date
+        }
+        else if(!needsAutosaving(i))
+        {
+            autosaveSources << key.autosaveFilename; // copied by a previous autosave, not modified since
+        }
+        else
+        {
+            QString autosaveFilename = session + "." + QString::number(id) + "." + QString::number(++autosaveCount) + suffix;
+            files << copyImage(i, path + "/" + autosaveFilename);
+            keyFrames[i].autosaveFilename = autosaveFilename;
+            autosaveSources << autosaveFilename;
+        }
+    }
+}
+
+void LayerImage::setAutosaveSources(QDomElement& layerTag)
+{
+    int index = 0;
+    QDomElement keyTag = layerTag.firstChildElement();
+    while(!keyTag.isNull() && index < autosaveSources.size())
+    {
+        keyTag.setAttribute("src", autosaveSources.at(index));
+        keyTag = keyTag.nextSiblingElement();
+        index++;
+    }
+}
+
+void LayerImage::clearAutosave()
+{
+    for(int i=0; i < keyFrames.size(); i++)
+    {
+        keyFrames[i].autosaveFilename = "";
+    }
+    autosaveSources.clear();
+}
+
+// the position of the image is saved in the document, so only its pixels are hashed
+static QString imageHash(const QImage& image)
+{
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    QByteArray header;
+    QDataStream out(&header, QIODevice::WriteOnly);
+    out << qint32(image.width()) << qint32(image.height()) << qint32(image.format());
+    hash.addData(header);
+    int lineSize = (image.width() * image.depth() + 7) / 8;
+    for(int y=0; y < image.height(); y++)
+    {
+        hash.addData((const char*)image.scanLine(y), lineSize);
+    }
+    return hash.result().toHex();
+}
+
+void LayerImage::writeFrameFile(FrameFile& file)
+{
+    if(file.contentFiles)
+    {
+        // the file is named after the content of the drawing, and only written if there is no such file yet: only the files of a committed save
+        // (or of the loaded document) are trusted, as a file written by a save which did not complete may be partial
+        ContentFiles* contents = file.contentFiles.data();
+        QString name = file.sourcePath.isEmpty() ? contents->pattern.arg(imageHash(file.image)) : file.contentName;
+        file.filePath = contents->directory + "/" + name;
+        QMutexLocker locker(&contents->mutex);
+        bool stored = contents->claimed.contains(name) || (contents->known.contains(name) && Archive::exists(file.filePath));
+        contents->claimed << name;
+        locker.unlock();
+        if(stored)
+        {
+            file.written = true;
+            return;
+        }
+    }
+    if(!file.sourcePath.isEmpty())
+    {
+        file.written = Archive::copy(file.sourcePath, file.filePath);
+        if(file.type == Layer::SOUND) file.written = true; // fails if the sound is already there
+        return;
+    }
+    // the drawing is encoded in memory, and written in a directory or in an archive
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    bool encoded = false;
+    if(file.type == Layer::BITMAP) encoded = (file.format == "PTL") ? TileCodec::write(file.image, &buffer) : file.image.save(&buffer, "PNG");
+    if(file.type == Layer::VECTOR) encoded = file.vectorImage.write(&buffer, file.format);
+    buffer.close();
+    file.written = encoded && Archive::writeData(file.filePath, data);
+}
+
+bool LayerImage::canUnload(int index)
+{
+    if(saving || savedPath.isEmpty()) return false;
+    const KeyFrame& key = keyFrames.at(index);
+    return !key.filename.isEmpty() && !needsSaving(index) && Archive::exists(QDir(savedPath).filePath(key.filename));
+}
+
+QString LayerImage::keyFileName(int index)
+{
+    // a drawing which is not written again keeps the format of its file (the format of the document only applies to the drawings written)
+    QString name = fileName(keyFrames.at(index).position, id);
+    QString filename = keyFrames.at(index).filename;
+    if(!filename.isEmpty() && !needsSaving(index)) name = name.section('.', 0, -2) + "." + filename.section('.', -1);
+    return name;
+}
+
 QString LayerImage::fileName(int index, int layerNumber)
 {
     // implemented in subclasses
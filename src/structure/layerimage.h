@@ -21,10 +21,58 @@ GNU General Public License for more details.
 #include <QList>
 #include <QString>
 #include <QPainter>
+#include <QSet>
+#include <QMap>
+#include <QPair>
+#include <QDir>
+#include <QTextStream>
+#include <QMutex>
+#include <QSharedPointer>
 #include "layer.h"
+#include "vectorimage.h"
 
 class TimeLineCells;
 
+// the files named after their content in the data directory of a layer, shared by the threads writing the files of a save
+struct ContentFiles
+{
+    QString directory;
+    QString pattern; // name of a file, with %1 for the hash of its content
+    QSet<QString> known; // the files of the last committed save (or of the loaded document): only those are trusted to be complete
+    QSet<QString> claimed; // the files written by this save
+    QMutex mutex;
+};
+
+// a file to be written by a save: the drawing is copied when the save starts, so that it can be written while the editing goes on
+struct FrameFile
+{
+    FrameFile() : type(Layer::UNDEFINED), format("VEC"), written(false) {}
+    int type; // the type of the layer of the key
+    QString filePath;
+    QString format; // format of the file: "PNG" or "PTL" for a bitmap drawing, "VEC" or "VECB" for a vector drawing
+    QImage image; // bitmap drawing (implicitly shared: its pixels are only copied if the drawing is modified during the save)
+    VectorImage vectorImage; // vector drawing (copied, the curves and areas are implicitly shared)
+    QString sourcePath; // file to be copied as it is (a sound, or a drawing which is not loaded)
+    // a drawing named after its content is hashed by the thread writing it: until then, its key and the document refer to contentName,
+    // and filePath is only known once the file is written (see LayerImage::resolveContentNames)
+    QString contentName;
+    QSharedPointer<ContentFiles> contentFiles;
+    bool written;
+};
+
+// a key of an image layer: its position in the timeline and the information common to all the image layers
+struct KeyFrame
+{
+    KeyFrame(int frameNumber = 0) : position(frameNumber), originalPosition(frameNumber), modified(false), selected(false), lastUse(0) {}
+    int position;
+    int originalPosition; // position of the key when the layer was last saved
+    QString filename;
+    QString autosaveFilename; // file of the recovery document holding the drawing as it is now ("" if it was modified since)
+    bool modified;
+    bool selected; // graphic representation -- could be put in another class
+    qint64 lastUse; // when the drawing was last accessed (see LayerImage::useCount)
+};
+
 class LayerImage : public Layer
 {
     Q_OBJECT
@@ -32,8 +80,9 @@ class LayerImage : public Layer
 public:
     LayerImage(Object* object);
     ~LayerImage();
-    int getMaxFrame() { return framesPosition.last(); }
-    int getFramePositionAt(int index) { return framesPosition.at(index); }
+    int getMaxFrame() { return keyFrames.last().position; }
+    int getFramePositionAt(int index) { return keyFrames.at(index).position; }
+    int getKeyFrameCount() { return keyFrames.size(); }
     int getIndexAtFrame(int frameNumber);
     int getLastIndexAtFrame(int frameNumber);
 
@@ -41,14 +90,38 @@ public:
     QImage* getImageAtFrame(int frameNumber);
     QImage* getLastImageAtFrame(int frameNumber, int increment);
     virtual bool addImageAtFrame(int frameNumber);
+    virtual bool addLinkedImageAtFrame(int frameNumber, int sourceFrame); // adds a key showing the same drawing as the key at sourceFrame
     virtual void removeImageAtFrame(int frameNumber);
+    virtual QList<int> getLinkedIndices(int index); // indices of all the keys sharing the drawing of the key at index (in increasing order)
+    virtual QList<int> getFirstLinkedIndices(); // for each key, the index of the first key sharing its drawing (in a single pass over the keys)
     virtual void setModified(int frameNumber, bool trueOrFalse);
+    void markModified(int frameNumber); // the drawing shown at frameNumber will be written at the next save
     void deselectAllFrames();
+    bool canMoveSelectedFrames(int offset);
+    void moveSelectedFrames(int offset);
 
-    bool saveImages(QString path, int layerNumber);
-    virtual bool saveImage(int index, QString path, int layerNumber);
+    bool saveImages(QString path, int layerNumber, QList<FrameFile>& files); // renames the files of the moved keys and copies the modified drawings into files
+    void resolveContentNames(const QHash<QString, QString>& names); // the keys refer to the files named after their content, once they are written
+    void commitImages(QString path); // to be called once the files are written and the document refering to them is written
+    void abortSave(); // undoes the moves of the save, and the next save writes all the files again
+    virtual FrameFile snapshotImage(int index, QString path); // names the file of the key and copies its drawing
+    virtual FrameFile copyImage(int index, QString filePath); // copies the drawing of the key
+    static void writeFrameFile(FrameFile& file); // can be called from any thread
+
+    // autosave: the recovery document has a copy of the drawings modified since the last save, and refers to the saved files for the others
+    virtual void autosaveImages(QString path, QList<FrameFile>& files); // copies the drawings modified since the last autosave into files
+    virtual bool needsAutosaving(int index) { return keyFrames.at(index).autosaveFilename.isEmpty(); }
+    QStringList getAutosaveSources() { return autosaveSources; }
+    void setAutosaveSources(QDomElement& layerTag); // makes the layer element of the recovery document refer to its files
+    void clearAutosave(); // the recovery document was removed
+    virtual bool needsSaving(int index) { return keyFrames.at(index).modified; }
     virtual QString fileName(int index, int layerNumber);
 
+    // lazy loading: the drawings are read from their files when they are first used, and the least recently used ones can be unloaded
+    virtual void loadImages() {} // reads all the drawings which are not loaded
+    virtual qint64 listLoadedImages(QMultiMap<qint64, int>& unloadable) { return 0; } // returns the memory used by the loaded drawings, and lists the keys of those which can be unloaded by time of last use
+    virtual qint64 unloadImage(int index) { return 0; } // returns the memory freed
+
     // graphic representation -- could be put in another class
     void paintTrack(QPainter& painter, TimeLineCells* cells, int x, int y, int width, int height, bool selected, int frameSize);
     virtual void paintImages(QPainter& painter, TimeLineCells* cells, int x, int y, int width, int height, bool selected, int frameSize);
@@ -66,17 +139,101 @@ protected:
     //QSize imageSize;
     //QList<QImage*> framesImage;
     //QList<QImage> framesAlpha;
-    QList<int> framesPosition;
-    QList<int> framesOriginalPosition;
-    QList<QString> framesFilename;
-    QList<bool> framesModified;
+    QList<KeyFrame> keyFrames; // always sorted by position; the subclasses keep their images in lists with the same indices
     // graphic representation -- could be put in another class
-    QList<bool> framesSelected;
     int frameClicked;
     int frameOffset;
 
-    void bubbleSort();
-    virtual void swap(int i, int j);
+    // incremental save: the files are only written when their drawing changes, and every file move is journaled
+    QString savedPath; // the data directory the files were last loaded from or saved to
+    QSet<QString> knownFiles; // the files of savedPath referred to by the loaded document or the last committed save (the only ones it may remove)
+    QSet<QString> pendingFiles; // the files used by the keys when the last save started
+    QStringList leftoverFiles; // previous versions of the files, removed once the document is written
+    QString saveToken; // identifies the last save in the document and in the journal
+    QString journalName() { return fileName(0, id).section('.', 0, -2) + ".journal"; } // the same whatever the format of the files
+    QString keyFileName(int index); // the name of the file of the key at index, after its position
+    QStringList autosaveSources; // the file of each key in the recovery document (relative to its data directory, or absolute)
+    static int autosaveCount; // numbers the files of the recovery document
+    bool moveFile(QDir& dir, QTextStream& journal, QString from, QString to);
+    bool displaceFile(QDir& dir, QTextStream& journal, QString name); // renames the file, if there is one, to a free name ending in ".old"
+    void recoverImages(QString path, QString documentToken); // completes or rolls back a save interrupted before the document was written
+    QList< QPair<QString, QString> > movedFiles; // the files moved by the current save, in order
+    bool saving; // true from the start of a save until it is committed or aborted
+    virtual void filesMoved(const QList< QPair<QString, QString> >& moves) {} // the drawings which are not loaded follow their files
+    virtual void relocateImages(QString path) {} // the drawings which are not loaded are read from the saved files
+
+    // deduplication: identical drawings are stored once, in a file named after a hash of their content (such a file is never modified, moved or displaced)
+    virtual bool isNamedAfterContent(int index) { return false; } // false if the drawing is stored in a file named after the position of its key
+    static bool isContentName(QString filename) { return filename.section('.', 1, 1).length() == 32; }
+
+    static qint64 useCount; // counts the accesses to the drawings
+    bool canUnload(int index); // the drawing can be read again from its saved file
+
+    int lowerBound(int frameNumber); // index of the first key at or after frameNumber (binary search)
+    // the place of a key is found in O(log n), but inserting or removing it shifts the following entries of the lists (O(n) pointer moves):
+    // the keys are kept in index-addressed lists (shared with the image lists of the subclasses) rather than in a tree
+    int insertKeyFrame(int frameNumber); // inserts a key at its sorted place and returns its index, or -1 if there is already a key there
+    void removeKeyFrame(int index);
+    virtual void reorder(const QList<int>& order); // the key at index i is replaced by the key which was at index order.at(i) -- to be extended by subclasses
+
+    template <typename T> static QList<int> firstIndices(const QList<T*>& images)
+    {
+        QList<int> result;
+        QHash<T*, int> first;
+        for(int i=0; i < images.size(); i++)
+        {
+            typename QHash<T*, int>::const_iterator it = first.constFind(images.at(i));
+            if(it == first.constEnd())
+            {
+                first.insert(images.at(i), i);
+                result << i;
+            }
+            else
+            {
+                result << it.value();
+            }
+        }
+        return result;
+    }
+
+    template <typename T> static void reorderList(QList<T>& list, const QList<int>& order)
+    {
+        QList<T> result;
+        for(int i=0; i < order.size(); i++) result.append( list.at(order.at(i)) );
+        list = result;
+    }
+
+    // the drawings which are not loaded yet are listed with the file they are read from
+    template <typename T> static void moveImageFiles(QHash<T*, QString>& imageFiles, const QList< QPair<QString, QString> >& moves)
+    {
+        if(imageFiles.isEmpty() || moves.isEmpty()) return;
+        QHash<QString, T*> images; // the moves are followed in order, by file
+        QHashIterator<T*, QString> it(imageFiles);
+        while(it.hasNext())
+        {
+            it.next();
+            images.insert(it.value(), it.key());
+        }
+        for(int j=0; j < moves.size(); j++)
+        {
+            T* image = images.take(moves.at(j).first);
+            if(image) images.insert(moves.at(j).second, image);
+        }
+        QHashIterator<QString, T*> newIt(images);
+        while(newIt.hasNext())
+        {
+            newIt.next();
+            imageFiles.insert(newIt.value(), newIt.key());
+        }
+    }
+    template <typename T> void relocateImageFiles(QHash<T*, QString>& imageFiles, const QList<T*>& frames, QString path)
+    {
+        QDir dir(path);
+        for(int i=0; i < frames.size(); i++)
+        {
+            if(imageFiles.contains(frames.at(i))) imageFiles.insert(frames.at(i), dir.filePath(keyFrames.at(i).filename));
+        }
+    }
 };
 
 #endif
@@ -16,6 +16,8 @@ GNU General Public License for more details.
 #include <QtDebug>
 #include "layersound.h"
 #include "object.h"
+#include "archive.h"
+#include "soundfile.h"
 #include <phonon>
 //#include "unistd.h"
 
@@ -38,8 +40,8 @@ void LayerSound::paintImages(QPainter& painter, TimeLineCells* cells, int x, int
 
     for(int i=0; i < sound.size(); i++)
     {
-        qreal h = x + (framesPosition.at(i)-1)*frameSize+2;
-        if(framesSelected.at(i))
+        qreal h = x + (keyFrames.at(i).position-1)*frameSize+2;
+        if(keyFrames.at(i).selected)
         {
             painter.setBrush(QColor(60,60,60));
             h = h + frameOffset*frameSize;
@@ -56,25 +58,19 @@ void LayerSound::paintImages(QPainter& painter, TimeLineCells* cells, int x, int
         QPointF points[3] = { QPointF(h, y+4), QPointF(h, y+height-4), QPointF(h+15, y+0.5*height) };
         painter.drawPolygon( points, 3 );
         //painter.drawRect((startingFrame.at(i)-1)*frameSize+2, verticalPosition+1, frameSize-2, layerHeight-4);
-        painter.drawText(QPoint( h + 20, y+(2*height)/3), framesFilename.at(i) );
+        painter.drawText(QPoint( h + 20, y+(2*height)/3), keyFrames.at(i).filename );
         //}
     }
 }
 
 bool LayerSound::addImageAtFrame(int frameNumber)
 {
-    int index = getIndexAtFrame(frameNumber);
-    if(index == -1)
+    int index = insertKeyFrame(frameNumber);
+    if(index != -1)
     {
-        sound.append(NULL);
-        soundFilepath.append("");
-        framesPosition.append(frameNumber);
-        framesOriginalPosition.append(frameNumber);
-        framesSelected.append(false);
-        framesFilename.append("");
-        framesModified.append(false);
-        soundSize.append(0);
-        bubbleSort();
+        sound.insert(index, NULL);
+        soundFilepath.insert(index, "");
+        soundSize.insert(index, 0);
         return true;
     }
     else
@@ -86,17 +82,13 @@ bool LayerSound::addImageAtFrame(int frameNumber)
 void LayerSound::removeImageAtFrame(int frameNumber)
 {
     int index = getIndexAtFrame(frameNumber);
-    if(index != -1  && framesPosition.size() != 0)
+    if(index != -1  && keyFrames.size() != 0)
     {
         delete sound.at(index);
+        sound.removeAt(index);
         soundFilepath.removeAt(index);
-        framesPosition.removeAt(index);
-        framesOriginalPosition.removeAt(index);
-        framesSelected.removeAt(index);
-        framesFilename.removeAt(index);
-        framesModified.removeAt(index);
         soundSize.removeAt(index);
-        bubbleSort();
+        removeKeyFrame(index);
     }
 }
 
@@ -115,52 +107,65 @@ void LayerSound::loadSoundAtFrame(QString filePathString, int frameNumber)
         Phonon::MediaObject* media = new Phonon::MediaObject();
         connect(media, SIGNAL(totalTimeChanged(qint64)), this, SLOT(addTimelineKey(qint64)));
         media->setCurrentSource(filePathString);
-        // quick and dirty trick to calculate soundSize
-        // totalTime() return a value only after a call to media.play()
-        //  ( and when signal totaltimechanged is emitted totalTime() returns the correct value )
-        Phonon::AudioOutput* audioOutput;
-        audioOutput = new Phonon::AudioOutput(Phonon::MusicCategory, this);
-        Phonon::createPath(media, audioOutput);
-        media->play();
-        media->stop();
-        soundSize[index] = media->totalTime(); // totalTime() returns 0 now
+        SoundFile soundFile;
+        if(soundFile.open(filePathString))
+        {
+            // the duration is known from the header of the file, the media is only started when it is played
+            soundSize[index] = soundFile.getDuration();
+        }
+        else
+        {
+            // quick and dirty trick to calculate soundSize
+            // totalTime() return a value only after a call to media.play()
+            //  ( and when signal totaltimechanged is emitted totalTime() returns the correct value )
+            Phonon::AudioOutput* audioOutput;
+            audioOutput = new Phonon::AudioOutput(Phonon::MusicCategory, this);
+            Phonon::createPath(media, audioOutput);
+            media->play();
+            media->stop();
+            soundSize[index] = media->totalTime(); // totalTime() returns 0 now
+        }
         sound[index] = media;
         soundFilepath[index] = filePathString;
-        framesFilename[index] = fi.fileName();
-        framesModified[index] = true;
+        keyFrames[index].filename = fi.fileName();
+        keyFrames[index].modified = true;
     }
     else
     {
         sound[index] = NULL;
         soundFilepath[index] = "Wrong file";
-        framesFilename[index] = "Wrong file" + filePathString;
+        keyFrames[index].filename = "Wrong file" + filePathString;
     }
 }
 
-void LayerSound::swap(int i, int j)
+void LayerSound::reorder(const QList<int>& order)
 {
-    LayerImage::swap(i, j);
-    sound.swap(i, j);
-    soundFilepath.swap(i,j);
+    LayerImage::reorder(order);
+    reorderList(sound, order);
+    reorderList(soundFilepath, order);
+    reorderList(soundSize, order);
 }
 
 
-bool LayerSound::saveImage(int index, QString path, int layerNumber)
+void LayerSound::autosaveImages(QString path, QList<FrameFile>& files)
+{
+    // the recovery document refers to the sound files where they are
+    autosaveSources.clear();
+    for(int i=0; i < keyFrames.size(); i++)
+    {
+        autosaveSources << QFileInfo(soundFilepath.at(i)).absoluteFilePath();
+    }
+}
+
+FrameFile LayerSound::snapshotImage(int index, QString path)
 {
-    /*QString layerNumberString = QString::number(layerNumber);
-    QString frameNumberString = QString::number(framesPosition.at(index));
-    while( layerNumberString.length() < 3) layerNumberString.prepend("0");
-    while( frameNumberString.length() < 3) frameNumberString.prepend("0");*/
-    //framesFilename[index] = path+"/"+layerNumberString+"."+frameNumberString+".png";
-    //framesFilename[index] = layerNumberString+"."+frameNumberString+".png";
-    //framesFilename[index] = layerNumberString+"."+frameNumberString+".png";
-    //qDebug() << "Write " << framesFilename.at(index);
-    //framesImage[index]->save(framesFilename.at(index),"PNG");
-    QFile originalFile( soundFilepath.at(index) );
-    originalFile.copy( path + "/" + framesFilename.at(index) );
-    framesModified[index] = false;
+    keyFrames[index].modified = false;
 
-    return true;
+    FrameFile file;
+    file.type = Layer::SOUND;
+    file.filePath = path + "/" + keyFrames.at(index).filename;
+    file.sourcePath = soundFilepath.at(index);
+    return file;
 }
 
 /*#
@@ -182,7 +187,7 @@ void LayerSound::playSound(int frame,int fps)
         Phonon::MediaObject* media = sound.at(i);
         if (media != NULL && visible)
         {
-            int position = framesPosition.at(i);
+            int position = keyFrames.at(i).position;
             if (frame < position)
             {
                 media->stop();
@@ -242,11 +247,11 @@ QDomElement LayerSound::createDomElement(QDomDocument& doc)
     layerTag.setAttribute("name", name);
     layerTag.setAttribute("visibility", visible);
     layerTag.setAttribute("type", type);
-    for(int index=0; index < framesPosition.size() ; index++)
+    for(int index=0; index < keyFrames.size() ; index++)
     {
         QDomElement soundTag = doc.createElement("sound");
-        soundTag.setAttribute("position", framesPosition.at(index));
-        soundTag.setAttribute("src", framesFilename.at(index));
+        soundTag.setAttribute("position", keyFrames.at(index).position);
+        soundTag.setAttribute("src", keyFrames.at(index).filename);
         layerTag.appendChild(soundTag);
     }
     return layerTag;
@@ -267,11 +272,10 @@ void LayerSound::loadDomElement(QDomElement element, QString filePath)
         {
             if(soundElement.tagName() == "sound")
             {
-                QString path = filePath + ".data/" + soundElement.attribute("src"); // the file is supposed to be in the data directory
-                QFileInfo fi(path);
-                if(!fi.exists()) path = soundElement.attribute("src");
+                QString path = Archive::dataPath(filePath) + "/" + soundElement.attribute("src"); // the file is supposed to be in the data directory (or in the archive)
+                if(!Archive::exists(path)) path = soundElement.attribute("src");
                 int position = soundElement.attribute("position").toInt();
-                loadSoundAtFrame( path, position );
+                loadSoundAtFrame( Archive::localFile(path), position ); // the sound is played from a file
             }
         }
         soundTag = soundTag.nextSibling();
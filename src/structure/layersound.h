@@ -41,7 +41,8 @@ public:
 
     void loadSoundAtFrame( QString filePathString, int frame );
 
-    bool saveImage(int index, QString path, int layerNumber);
+    FrameFile snapshotImage(int index, QString path);
+    void autosaveImages(QString path, QList<FrameFile>& files);
     void playSound(int frame,int fps);
     void stopSound();
 
@@ -65,7 +66,7 @@ protected:
     QList<qint64> soundSize;
 //#	QList<QSound*> sound;
     // graphic representation -- could be put in another class
-    void swap(int i, int j);
+    void reorder(const QList<int>& order);
 
 
     QList<Phonon::MediaObject*> sound;
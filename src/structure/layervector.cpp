@@ -14,7 +14,14 @@ GNU General Public License for more details.
 
 */
 #include "layervector.h"
+#include "object.h"
+#include "archive.h"
+#include "rastercache.h"
 #include <QtDebug>
+#include <QtConcurrentMap>
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QtCore/qmath.h>
 
 LayerVector::LayerVector(Object* object) : LayerImage(object)
 {
@@ -26,10 +33,12 @@ LayerVector::LayerVector(Object* object) : LayerImage(object)
 
 LayerVector::~LayerVector()
 {
-    while (!framesVector.empty())
-        delete framesVector.takeFirst();
-    while (!framesImage.empty())
-        delete framesImage.takeFirst();
+    // the pictures shared by several keys are deleted once
+    qDeleteAll( framesVector.toSet() );
+    framesVector.clear();
+    imageFiles.clear();
+    qDeleteAll( framesImage.toSet() );
+    framesImage.clear();
 }
 
 // ------
@@ -48,10 +57,25 @@ QImage* LayerVector::getImageAtIndex(int index, QSize size, bool simplified, boo
         {
             if( image->size() != size)
             {
-                delete image;
-                framesImage[index] = image = new QImage(size, QImage::Format_ARGB32_Premultiplied);
+                *image = QImage(size, QImage::Format_ARGB32_Premultiplied); // in place, as the image may be shared by linked keys
+            }
+            // a pan or a zoom to a level already rendered only draws the rendering again
+            // (a picture being edited is rendered directly: its intermediate states would only fill the cache, at the cost of a hash per stroke)
+            qreal level = zoomLevel(myView);
+            LevelImage* rendering = (vectorImage->isUnsaved() || level == 0.0) ? NULL : getLevelImage(vectorImage, level, simplified, showThinLines, curveOpacity, antialiasing, gradients);
+            if(rendering == NULL)
+            {
+                levelImages.remove(vectorImage);
+                vectorImage->outputImage(image, size, myView, simplified, showThinLines, curveOpacity, antialiasing, gradients);
+            }
+            else
+            {
+                image->fill(qRgba(0,0,0,0));
+                QPainter painter(image);
+                painter.setRenderHint(QPainter::SmoothPixmapTransform, !qFuzzyCompare(level, myView.m11()));
+                painter.setWorldMatrix(QMatrix(1.0/level, 0, 0, 1.0/level, rendering->origin.x(), rendering->origin.y()) * myView);
+                painter.drawImage(0, 0, rendering->image);
             }
-            vectorImage->outputImage(image, size, myView, simplified, showThinLines, curveOpacity, antialiasing, gradients);
             vectorImage->setModified(false);
         }
         return image;
@@ -85,6 +109,65 @@ QImage* LayerVector::getLastImageAtFrame(int frameNumber, int increment, QSize s
     }
 }
 
+qreal LayerVector::zoomLevel(const QMatrix& view)
+{
+    // the levels are the powers of two from the size of thumbnails (1/8) to a close up (8)
+    // the level just above the zoom is used, so that the rendering is only reduced when it is drawn
+    // (0 for a rotated view or a zoom beyond the levels, which are rendered directly)
+    if(view.m12() != 0.0 || view.m21() != 0.0 || view.m11() != view.m22() || view.m11() <= 0.0) return 0.0;
+    qreal level = 0.125;
+    while(level < view.m11() && !qFuzzyCompare(level, view.m11())) level *= 2.0;
+    return level <= 8.0 ? level : 0.0;
+}
+
+LayerVector::LevelImage* LayerVector::getLevelImage(VectorImage* vectorImage, qreal level, bool simplified, bool showThinLines, qreal curveOpacity, bool antialiasing, int gradients)
+{
+    QByteArray key = rasterKey(vectorImage, level, simplified, showThinLines, curveOpacity, antialiasing, gradients);
+    if(key.isEmpty()) return NULL;
+    if(levelImages.contains(vectorImage) && levelImages.value(vectorImage).key == key) return &levelImages[vectorImage];
+
+    // the image covers the picture, on the pixels of the level (it is null for an empty picture)
+    QRectF bounds = vectorImage->getBoundingRect();
+    QRect pixels;
+    if(!bounds.isNull())
+    {
+        int left = qFloor(bounds.left()*level);
+        int top = qFloor(bounds.top()*level);
+        pixels = QRect(left, top, qCeil(bounds.right()*level) - left, qCeil(bounds.bottom()*level) - top);
+    }
+    if(pixels.width() > 8192 || pixels.height() > 8192) return NULL; // a huge picture is only rendered where it is seen
+    LevelImage& rendering = levelImages[vectorImage];
+    rendering.key = key;
+    rendering.origin = QPointF(pixels.topLeft()) / level;
+    // the rendering may have been done before, in this session or in a previous one
+    rendering.image = RasterCache::instance()->find(key);
+    if(rendering.image.size() != pixels.size())
+    {
+        rendering.image = QImage(pixels.size(), QImage::Format_ARGB32_Premultiplied);
+        vectorImage->outputImage(&rendering.image, pixels.size(), QMatrix(level, 0, 0, level, -pixels.left(), -pixels.top()), simplified, showThinLines, curveOpacity, antialiasing, gradients);
+        RasterCache::instance()->insert(key, rendering.image);
+    }
+    return &rendering;
+}
+
+QByteArray LayerVector::rasterKey(VectorImage* vectorImage, qreal level, bool simplified, bool showThinLines, qreal curveOpacity, bool antialiasing, int gradients)
+{
+    QByteArray content = vectorImage->contentHash();
+    if(content.isEmpty()) return content;
+    // the rendering also depends on the zoom level, on the options and on the palette
+    QByteArray parameters;
+    QDataStream out(&parameters, QIODevice::WriteOnly);
+    out << double(level) << simplified << showThinLines << double(curveOpacity) << antialiasing << qint32(gradients);
+    for(int i=0; i < object->myPalette.size(); i++)
+    {
+        out << quint32(object->myPalette.at(i).colour.rgba());
+    }
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(content);
+    hash.addData(parameters);
+    return hash.result();
+}
+
 // ------
 
 VectorImage* LayerVector::getVectorImageAtIndex(int index)
@@ -95,7 +178,10 @@ VectorImage* LayerVector::getVectorImageAtIndex(int index)
     }
     else
     {
-        return framesVector.at(index);
+        VectorImage* vectorImage = framesVector.at(index);
+        if(imageFiles.contains(vectorImage)) loadImage(vectorImage);
+        keyFrames[index].lastUse = ++useCount;
+        return vectorImage;
     }
 }
 
@@ -135,6 +221,7 @@ void LayerVector::setModified(int frameNumber, bool trueOrFalse)
 
 bool LayerVector::usesColour(int index)
 {
+    loadImages();
     for(int i=0; i < framesVector.size(); i++)
     {
         if( framesVector[i]->usesColour(index) ) return true;
@@ -144,9 +231,12 @@ bool LayerVector::usesColour(int index)
 
 void LayerVector::removeColour(int index)
 {
-    for(int i=0; i < framesVector.size(); i++)
+    loadImages();
+    QSet<VectorImage*> vectorImages = framesVector.toSet(); // each picture is renumbered once, even if it is shared
+    QSetIterator<VectorImage*> it(vectorImages);
+    while(it.hasNext())
     {
-        framesVector[i]->removeColour(index);
+        it.next()->removeColour(index);
     }
 }
 
@@ -183,19 +273,12 @@ void LayerBitmap::mousePress(int frameNumber) {
 
 bool LayerVector::addImageAtFrame(int frameNumber)
 {
-    int index = getIndexAtFrame(frameNumber);
-    if(index == -1)
+    int index = insertKeyFrame(frameNumber);
+    if(index != -1)
     {
         //framesVector.append(new VectorImage(imageSize, QImage::Format_ARGB32_Premultiplied, object));
-        framesVector.append(new VectorImage(object));
-        framesImage.append(new QImage( QSize(2,2), QImage::Format_ARGB32_Premultiplied)); // very small image to begin with
-
-        framesPosition.append(frameNumber);
-        framesOriginalPosition.append(frameNumber);
-        framesSelected.append(false);
-        framesFilename.append("");
-        framesModified.append(false);
-        bubbleSort();
+        framesVector.insert(index, new VectorImage(object));
+        framesImage.insert(index, new QImage( QSize(2,2), QImage::Format_ARGB32_Premultiplied)); // very small image to begin with
         emit imageAdded(frameNumber);
         return true;
     }
@@ -205,23 +288,57 @@ bool LayerVector::addImageAtFrame(int frameNumber)
     }
 }
 
+bool LayerVector::addLinkedImageAtFrame(int frameNumber, int sourceFrame)
+{
+    int sourceIndex = getIndexAtFrame(sourceFrame);
+    if(sourceIndex == -1) return false;
+    VectorImage* vectorImage = framesVector.at(sourceIndex);
+    QImage* image = framesImage.at(sourceIndex);
+    QString filename = keyFrames.at(sourceIndex).filename;
+    int index = insertKeyFrame(frameNumber);
+    if(index == -1) return false;
+    // the picture and its bitmap output are shared, so the picture is rasterized once for all the keys
+    framesVector.insert(index, vectorImage);
+    framesImage.insert(index, image);
+    keyFrames[index].filename = filename;
+    emit imageAdded(frameNumber);
+    return true;
+}
+
+QList<int> LayerVector::getFirstLinkedIndices()
+{
+    return firstIndices(framesVector);
+}
+
+QList<int> LayerVector::getLinkedIndices(int index)
+{
+    QList<int> result;
+    VectorImage* vectorImage = framesVector.at(index);
+    for(int i=0; i < framesVector.size(); i++)
+    {
+        if(framesVector.at(i) == vectorImage) result << i;
+    }
+    return result;
+}
+
 void LayerVector::removeImageAtFrame(int frameNumber)
 {
     int index = getIndexAtFrame(frameNumber);
-    if(index != -1 && framesPosition.size() != 1)
+    if(index != -1 && keyFrames.size() != 1)
     {
-        delete framesVector.at(index);
-        framesVector.removeAt(index);
-
-        delete framesImage.at(index);
-        framesImage.removeAt(index);
-
-        framesPosition.removeAt(index);
-        framesOriginalPosition.removeAt(index);
-        framesSelected.removeAt(index);
-        framesFilename.removeAt(index);
-        framesModified.removeAt(index);
-        bubbleSort();
+        // the picture may still be shown by linked keys
+        VectorImage* vectorImage = framesVector.takeAt(index);
+        if(!framesVector.contains(vectorImage))
+        {
+            imageFiles.remove(vectorImage);
+            levelImages.remove(vectorImage);
+            delete vectorImage;
+        }
+
+        QImage* image = framesImage.takeAt(index);
+        if(!framesImage.contains(image)) delete image;
+
+        removeKeyFrame(index);
         emit imageRemoved(frameNumber);
     }
 }
@@ -230,9 +347,111 @@ void LayerVector::loadImageAtFrame(QString path, int frameNumber)
 {
     if(getIndexAtFrame(frameNumber) == -1) addImageAtFrame(frameNumber);
     int index = getIndexAtFrame(frameNumber);
-    framesVector[index]->read(path);
+    framesVector[index]->setUnsaved(false); // the picture is read when it is first used
+    imageFiles.insert(framesVector[index], path);
     QFileInfo fi(path);
-    framesFilename[index] = fi.fileName();
+    keyFrames[index].filename = fi.fileName();
+}
+
+static VectorImage readVectorImage(const QString& path)
+{
+    VectorImage vectorImage; // not in the colour index of the object, so that it can be read on any thread
+    QByteArray data = Archive::readData(path);
+    QBuffer buffer(&data);
+    if(!buffer.open(QIODevice::ReadOnly) || !vectorImage.read(&buffer)) qDebug() << "ERROR: Image " << path << " not loaded";
+    return vectorImage;
+}
+
+void LayerVector::attachImage(VectorImage* vectorImage, const VectorImage& picture)
+{
+    bool autosaved = vectorImage->isAutosaved();
+    *vectorImage = picture;
+    vectorImage->setUnsaved(false);
+    vectorImage->setAutosaved(autosaved);
+    vectorImage->setModified(true); // its bitmap output is drawn again
+}
+
+void LayerVector::loadImage(VectorImage* vectorImage)
+{
+    attachImage(vectorImage, readVectorImage(imageFiles.take(vectorImage)));
+    object->imageLoaded();
+}
+
+void LayerVector::loadImages()
+{
+    readImages(false);
+}
+
+void LayerVector::loadUncountedImages()
+{
+    readImages(true);
+}
+
+void LayerVector::loadImages(const QSet<VectorImage*>& pictures)
+{
+    readImages(false, &pictures);
+}
+
+void LayerVector::readImages(bool uncountedOnly, const QSet<VectorImage*>* only)
+{
+    // the files are parsed concurrently, and the pictures are attached in order
+    QList<VectorImage*> pictures;
+    QStringList paths;
+    for(int i=0; i < framesVector.size(); i++)
+    {
+        VectorImage* vectorImage = framesVector.at(i);
+        if(imageFiles.contains(vectorImage) && !(uncountedOnly && vectorImage->isColourCounted()) && !(only && !only->contains(vectorImage)))
+        {
+            pictures << vectorImage;
+            paths << imageFiles.take(vectorImage); // the pictures shared by several keys are read once
+        }
+    }
+    if(pictures.isEmpty()) return;
+    QFuture<VectorImage> parsed = QtConcurrent::mapped(paths, readVectorImage);
+    for(int j=0; j < pictures.size(); j++)
+    {
+        attachImage(pictures.at(j), parsed.resultAt(j));
+    }
+    object->imageLoaded();
+}
+
+qint64 LayerVector::listLoadedImages(QMultiMap<qint64, int>& unloadable)
+{
+    // the memory is mostly used by the bitmap outputs, which are shared like the pictures
+    QHash<VectorImage*, int> lastKeys; // the most recently used key of each loaded picture
+    qint64 bytes = 0;
+    for(int i=0; i < framesVector.size(); i++)
+    {
+        VectorImage* vectorImage = framesVector.at(i);
+        if(imageFiles.contains(vectorImage)) continue;
+        if(!lastKeys.contains(vectorImage))
+        {
+            bytes += framesImage.at(i)->byteCount() + levelImages.value(vectorImage).image.byteCount();
+            lastKeys.insert(vectorImage, i);
+        }
+        else if(keyFrames.at(i).lastUse > keyFrames.at(lastKeys.value(vectorImage)).lastUse)
+        {
+            lastKeys.insert(vectorImage, i);
+        }
+    }
+    QHashIterator<VectorImage*, int> it(lastKeys);
+    while(it.hasNext())
+    {
+        int index = it.next().value();
+        if(canUnload(index)) unloadable.insert(keyFrames.at(index).lastUse, index);
+    }
+    return bytes;
+}
+
+qint64 LayerVector::unloadImage(int index)
+{
+    VectorImage* vectorImage = framesVector.at(index);
+    if(imageFiles.contains(vectorImage) || !canUnload(index)) return 0;
+    qint64 bytes = framesImage.at(index)->byteCount() + levelImages.take(vectorImage).image.byteCount();
+    vectorImage->unload(); // its colour usage stays in the index, so that it is not read again to be counted
+    *(framesImage[index]) = QImage( QSize(2,2), QImage::Format_ARGB32_Premultiplied); // in place, as the image may be shared by linked keys
+    imageFiles.insert(vectorImage, QDir(savedPath).filePath(keyFrames.at(index).filename));
+    return bytes;
 }
 
 /*void LayerVector::loadImageAtFrame(VectorImage* picture, int frameNumber) {
@@ -242,24 +461,42 @@ void LayerVector::loadImageAtFrame(QString path, int frameNumber)
 	framesVector[index] = picture;
 }*/
 
-void LayerVector::swap(int i, int j)
+void LayerVector::reorder(const QList<int>& order)
 {
-    LayerImage::swap(i, j);
-    framesVector.swap(i,j);
-    framesImage.swap(i,j);
+    LayerImage::reorder(order);
+    reorderList(framesVector, order);
+    reorderList(framesImage, order);
 }
 
 
-bool LayerVector::saveImage(int index, QString path, int layerNumber)
+FrameFile LayerVector::snapshotImage(int index, QString path)
 {
-    int theFrame = framesPosition.at(index);
+    int theFrame = keyFrames.at(index).position;
     QString theFileName = fileName(theFrame, id);
-    framesFilename[index] = theFileName;
-    //qDebug() << "Write " << theFileName;
-    framesVector[index]->write(path +"/"+ theFileName,"VEC");
-    framesModified[index] = false;
+    keyFrames[index].filename = theFileName;
+    keyFrames[index].modified = false;
+    framesVector[index]->setUnsaved(false); // the copy is written
+    return copyImage(index, path +"/"+ theFileName);
+}
 
-    return true;
+FrameFile LayerVector::copyImage(int index, QString filePath)
+{
+    framesVector[index]->setAutosaved(true); // the copy is written (to the recovery document, or to the document, which the recovery document then refers to)
+
+    FrameFile file;
+    file.type = Layer::VECTOR;
+    file.filePath = filePath;
+    file.format = object->vectorFormat;
+    VectorImage* vectorImage = framesVector.at(index);
+    if(imageFiles.contains(vectorImage))
+    {
+        file.sourcePath = imageFiles.value(vectorImage); // the file is copied as it is
+    }
+    else
+    {
+        file.vectorImage = *vectorImage;
+    }
+    return file;
 }
 
 QString LayerVector::fileName(int frame, int layerID)
@@ -278,14 +515,29 @@ QDomElement LayerVector::createDomElement(QDomDocument& doc)
     layerTag.setAttribute("name", name);
     layerTag.setAttribute("visibility", visible);
     layerTag.setAttribute("type", type);
-    for(int index=0; index < framesPosition.size() ; index++)
+    for(int index=0; index < keyFrames.size() ; index++)
     {
         //QDomElement imageTag = framesVector[index]->createDomElement(doc); // if we want to embed the data
         QDomElement imageTag = doc.createElement("image");
-        imageTag.setAttribute("frame", framesPosition.at(index));
-        imageTag.setAttribute("src", framesFilename.at(index)); // if we want to link the data to an external file
+        imageTag.setAttribute("frame", keyFrames.at(index).position);
+        imageTag.setAttribute("src", keyFrames.at(index).filename); // if we want to link the data to an external file
+        // the colour usage of the picture, so that the colour index is built without reading the pictures (see Object::updateColourUsage)
+        VectorImage* vectorImage = framesVector.at(index);
+        if(!imageFiles.contains(vectorImage)) vectorImage->updateColourUsage();
+        if(vectorImage->isColourCounted())
+        {
+            QStringList colours;
+            QMapIterator<int, int> it(vectorImage->getColourCount());
+            while(it.hasNext())
+            {
+                it.next();
+                colours << QString::number(it.key()) + ":" + QString::number(it.value());
+            }
+            imageTag.setAttribute("colours", colours.join(" "));
+        }
         layerTag.appendChild(imageTag);
     }
+    if(!saveToken.isEmpty()) layerTag.setAttribute("save", saveToken);
     return layerTag;
 }
 
@@ -295,7 +547,12 @@ void LayerVector::loadDomElement(QDomElement element, QString filePath)
     name = element.attribute("name");
     visible = (element.attribute("visibility") == "1");
     type = element.attribute("type").toInt();
+    QString dataPath = Archive::dataPath(filePath);
+    recoverImages(dataPath, element.attribute("save"));
+    savedPath = dataPath;
+    knownFiles.clear();
 
+    QHash<QString, int> loadedFrames; // the keys using the same file share the same picture
     QDomNode imageTag = element.firstChild();
     while(!imageTag.isNull())
     {
@@ -306,11 +563,33 @@ void LayerVector::loadDomElement(QDomElement element, QString filePath)
             {
                 if(!imageElement.attribute("src").isNull())
                 {
-                    QString path =  filePath +".data/" + imageElement.attribute("src"); // the file is supposed to be in the data irectory
-                    QFileInfo fi(path);
-                    if(!fi.exists()) path = imageElement.attribute("src");
+                    QString src = imageElement.attribute("src");
                     int position = imageElement.attribute("frame").toInt();
-                    loadImageAtFrame( path, position );
+                    if( !src.isEmpty() && loadedFrames.contains(src) && getIndexAtFrame(position) == -1 )
+                    {
+                        addLinkedImageAtFrame( position, loadedFrames.value(src) );
+                    }
+                    else
+                    {
+                        QString path = dataPath + "/" + src; // the file is supposed to be in the data directory (or in the archive)
+                        if(Archive::exists(path)) knownFiles << src; else path = src;
+                        loadImageAtFrame( path, position );
+                        loadedFrames.insert(src, position);
+                        if(imageElement.hasAttribute("colours"))
+                        {
+                            QMap<int, int> colourCount;
+                            QStringList colours = imageElement.attribute("colours").split(" ", QString::SkipEmptyParts);
+                            for(int i=0; i < colours.size(); i++)
+                            {
+                                colourCount.insert(colours.at(i).section(':', 0, 0).toInt(), colours.at(i).section(':', 1, 1).toInt());
+                            }
+                            framesVector.at(getIndexAtFrame(position))->setColourCount(colourCount);
+                        }
+                        else
+                        {
+                            object->uncountedImageOpened();
+                        }
+                    }
                 }
                 else
                 {
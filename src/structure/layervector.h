@@ -36,7 +36,10 @@ public:
     //QImage* getImageAtFrame(int frameNumber);
     //QImage* getLastImageAtFrame(int frameNumber);
     bool addImageAtFrame(int frameNumber);
+    bool addLinkedImageAtFrame(int frameNumber, int sourceFrame);
     void removeImageAtFrame(int frameNumber);
+    QList<int> getLinkedIndices(int index);
+    QList<int> getFirstLinkedIndices();
 
     void loadImageAtFrame(QString, int);
     //void loadImageAtFrame(VectorImage, int);
@@ -44,9 +47,17 @@ public:
     QImage* getImageAtFrame(int, QSize, bool, bool, qreal, bool, int);
     QImage* getLastImageAtFrame(int, int, QSize, bool, bool, qreal, bool, int);
 
-    bool saveImage(int, QString, int);
+    FrameFile snapshotImage(int index, QString path);
+    FrameFile copyImage(int index, QString filePath);
+    bool needsAutosaving(int index) { return LayerImage::needsAutosaving(index) || !framesVector.at(index)->isAutosaved(); }
+    bool needsSaving(int index) { return keyFrames.at(index).modified || framesVector.at(index)->isUnsaved(); }
     void setView(QMatrix view);
     QString fileName(int index, int layerNumber);
+    void loadImages();
+    void loadUncountedImages(); // reads the pictures whose colour usage is not known yet
+    void loadImages(const QSet<VectorImage*>& pictures); // reads those of the pictures which are not read yet
+    qint64 listLoadedImages(QMultiMap<qint64, int>& unloadable);
+    qint64 unloadImage(int index);
     void setModified(bool trueOrFalse);
     void setModified(int frameNumber, bool trueOrFalse);
 
@@ -65,7 +76,24 @@ public:
 protected:
     QList<VectorImage*> framesVector;
     QList<QImage*> framesImage; // bitmap output of the vector pictures
-    void swap(int i, int j);
+    QHash<VectorImage*, QString> imageFiles; // the pictures which are not read yet (they are empty), with the file they are read from
+    void loadImage(VectorImage* vectorImage);
+    void readImages(bool uncountedOnly, const QSet<VectorImage*>* only = NULL);
+    void attachImage(VectorImage* vectorImage, const VectorImage& picture);
+    void reorder(const QList<int>& order);
+    void filesMoved(const QList< QPair<QString, QString> >& moves) { moveImageFiles(imageFiles, moves); }
+    void relocateImages(QString path) { relocateImageFiles(imageFiles, framesVector, path); }
+    // a picture is rendered in image space at a zoom level, and drawn from there with the view
+    struct LevelImage
+    {
+        QByteArray key; // identifies the rendering in the RasterCache
+        QImage image;
+        QPointF origin; // the point of the picture at the top left corner of the image
+    };
+    QHash<VectorImage*, LevelImage> levelImages; // the last rendering of each loaded picture
+    static qreal zoomLevel(const QMatrix& view);
+    LevelImage* getLevelImage(VectorImage* vectorImage, qreal level, bool simplified, bool showThinLines, qreal curveOpacity, bool antialiasing, int gradients);
+    QByteArray rasterKey(VectorImage* vectorImage, qreal level, bool simplified, bool showThinLines, qreal curveOpacity, bool antialiasing, int gradients);
     QMatrix myView;
 };
 
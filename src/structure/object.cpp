@@ -17,6 +17,8 @@ GNU General Public License for more details.
 #include <QDomDocument>
 #include <QTextStream>
 #include <QMessageBox>
+#include <QBuffer>
+#include <QtConcurrentRun>
 
 #include "object.h"
 #include "layer.h"
@@ -24,6 +26,7 @@ GNU General Public License for more details.
 #include "layervector.h"
 #include "layersound.h"
 #include "layercamera.h"
+#include "archive.h"
 
 #include "editor.h"
 #include "bitmapimage.h"
@@ -37,7 +40,13 @@ Object::Object() : QObject(0)
     // default name
     name = "Object";
     modified = false;
+    vectorFormat = "VEC";
+    bitmapFormat = "PNG";
     mirror = false;
+    unloadScheduled = false;
+    QSettings settings("Pencil","Pencil");
+    imageMemoryLimit = settings.value("frameCacheSize", 1024).toLongLong() * 1024 * 1024; // in megabytes
+    colourUsageComplete = true;
 }
 
 Object::~Object()
@@ -51,6 +60,8 @@ Object::~Object()
 QDomElement Object::createDomElement(QDomDocument& doc)
 {
     QDomElement tag = doc.createElement("object");
+    if(vectorFormat != "VEC") tag.setAttribute("vectorFormat", vectorFormat);
+    if(bitmapFormat != "PNG") tag.setAttribute("bitmapFormat", bitmapFormat);
 
     for(int i=0; i < getLayerCount(); i++)
     {
@@ -64,6 +75,8 @@ QDomElement Object::createDomElement(QDomDocument& doc)
 bool Object::loadDomElement(QDomElement docElem, QString filePath)
 {
     if(docElem.isNull()) return false;
+    if(docElem.attribute("vectorFormat") == "VECB") vectorFormat = "VECB";
+    if(docElem.attribute("bitmapFormat") == "PTL") bitmapFormat = "PTL";
     int layerNumber = -1;
     QDomNode tag = docElem.firstChild();
     bool someRelevantData = false;
@@ -117,11 +130,12 @@ bool Object::read(QString filePath)
     QFileInfo fileInfo(filePath);
     if( fileInfo.isDir() ) return false;
 
-    QFile* file = new QFile(filePath);
-    if (!file->open(QFile::ReadOnly)) return false;
+    bool ok;
+    QByteArray content = Archive::readData(Archive::documentFile(filePath), &ok); // the document may be an archive
+    if (!ok) return false;
 
     QDomDocument doc;
-    doc.setContent(file);
+    doc.setContent(content);
 
     QDomElement docElem = doc.documentElement();
     loadDomElement(docElem, filePath);
@@ -138,23 +152,18 @@ bool Object::read(QString filePath)
 
 bool Object::write(QString filePath)
 {
-    QFile* file = new QFile(filePath);
-    if (!file->open(QFile::WriteOnly | QFile::Text))
-    {
-        //QMessageBox::warning(this, "Warning", "Cannot write file");
-        qDebug() << "Object - Cannot write file" << filePath;
-        return false;
-    }
-    QTextStream out(file);
-
     QDomDocument doc("PencilDocument");
     QDomElement root = createDomElement(doc);
     doc.appendChild(root);
 
     int IndentSize = 2;
     qDebug() << "--- Starting to write XML file...";
-    doc.save(out, IndentSize);
-    file->close();
+    if (!Archive::writeData(Archive::documentFile(filePath), doc.toByteArray(IndentSize)))
+    {
+        //QMessageBox::warning(this, "Warning", "Cannot write file");
+        qDebug() << "Object - Cannot write file" << filePath;
+        return false;
+    }
     qDebug() << "--- Writing XML file done.";
     return true;
 }
@@ -281,27 +290,106 @@ void Object::addColour(QColor colour)
     addColour( ColourRef(colour, "Colour "+QString::number(myPalette.size()) ) );
 }
 
-bool Object::removeColour(int index)
+void Object::addColourUser(int colour, VectorImage* image)
 {
-    for(int i=0; i< getLayerCount(); i++)
+    colourUsers[colour].insert(image);
+}
+
+void Object::removeColourUser(int colour, VectorImage* image)
+{
+    QHash<int, QSet<VectorImage*> >::iterator it = colourUsers.find(colour);
+    if(it != colourUsers.end())
     {
-        Layer* layer = getLayer(i);
-        if( layer->type == Layer::VECTOR)
-        {
-            LayerVector* layerVector = ((LayerVector*)layer);
-            if(layerVector->usesColour(index)) return false;
-        }
+        it.value().remove(image);
+        if(it.value().isEmpty()) colourUsers.erase(it); // unused colours are not in the index
     }
-    for(int i=0; i< getLayerCount(); i++)
+}
+
+void Object::colourUsageModification(VectorImage* image, bool trueOrFalse)
+{
+    if(trueOrFalse)
     {
-        Layer* layer = getLayer(i);
-        if( layer->type == Layer::VECTOR)
+        colourUsageModified.insert(image);
+    }
+    else
+    {
+        colourUsageModified.remove(image);
+    }
+}
+
+void Object::updateColourUsage()
+{
+    // the usage of the unread pictures is normally stored in the document: only those of older documents have to be read to be counted
+    if(!colourUsageComplete)
+    {
+        for(int i=0; i < getLayerCount(); i++)
         {
-            LayerVector* layerVector = ((LayerVector*)layer);
-            layerVector->removeColour(index);
+            if(getLayer(i)->type == Layer::VECTOR) ((LayerVector*)getLayer(i))->loadUncountedImages();
         }
+        colourUsageComplete = true;
+    }
+    QSetIterator<VectorImage*> it(colourUsageModified);
+    while(it.hasNext())
+    {
+        it.next()->updateColourUsage();
+    }
+    colourUsageModified.clear();
+}
+
+void Object::loadColourUsers(const QSet<VectorImage*>& users)
+{
+    // the pictures are renumbered in memory, so the unread ones have to be read first
+    for(int i=0; i < getLayerCount(); i++)
+    {
+        if(getLayer(i)->type == Layer::VECTOR) ((LayerVector*)getLayer(i))->loadImages(users);
+    }
+}
+
+bool Object::usesColour(int index)
+{
+    updateColourUsage();
+    return colourUsers.contains(index);
+}
+
+int Object::getColourUserCount(int index)
+{
+    updateColourUsage();
+    return colourUsers.value(index).size();
+}
+
+void Object::remapColour(int oldIndex, int newIndex)
+{
+    if(oldIndex == newIndex) return;
+    updateColourUsage();
+    loadColourUsers(colourUsers.value(oldIndex));
+    QList<VectorImage*> users = colourUsers.value(oldIndex).toList();
+    for(int i=0; i < users.size(); i++)
+    {
+        users.at(i)->remapColour(oldIndex, newIndex);
+    }
+    updateColourUsage();
+}
+
+bool Object::removeColour(int index)
+{
+    if(usesColour(index)) return false;
+    // only the images using a colour after the removed one need to be renumbered
+    QSet<VectorImage*> users;
+    QHashIterator<int, QSet<VectorImage*> > it(colourUsers);
+    while(it.hasNext())
+    {
+        it.next();
+        if(it.key() > index) users.unite(it.value());
+    }
+    loadColourUsers(users);
+    QSetIterator<VectorImage*> userIt(users);
+    while(userIt.hasNext())
+    {
+        userIt.next()->removeColour(index);
     }
+    updateColourUsage();
     myPalette.removeAt(index);
+    paletteModification();
     return true;
     // update the vector pictures using that colour !
 }
@@ -319,14 +407,6 @@ bool Object::savePalette(QString filePath)
 bool Object::exportPalette(QString filePath)
 {
     //qDebug() << "coucou" << filePath;
-    QFile* file = new QFile(filePath);
-    if (!file->open(QFile::WriteOnly | QFile::Text))
-    {
-        //QMessageBox::warning(this, "Warning", "Cannot write file");
-        return false;
-    }
-    QTextStream out(file);
-
     QDomDocument doc("PencilPalette");
     QDomElement root = doc.createElement("palette");
     doc.appendChild(root);
@@ -344,8 +424,7 @@ bool Object::exportPalette(QString filePath)
     //QString xml = doc.toString();
 
     int IndentSize = 2;
-    doc.save(out, IndentSize);
-    return true;
+    return Archive::writeData(filePath, doc.toByteArray(IndentSize)); // the palette of a document may be in an archive
 }
 
 bool Object::loadPalette(QString filePath)
@@ -355,15 +434,16 @@ bool Object::loadPalette(QString filePath)
 
 bool Object::importPalette(QString filePath)
 {
-    QFile* file = new QFile(filePath);
-    if (!file->open(QFile::ReadOnly))
+    bool ok;
+    QByteArray content = Archive::readData(filePath, &ok); // the palette of a document may be in an archive
+    if (!ok)
     {
         //QMessageBox::warning(this, "Warning", "Cannot read file");
         return false;
     }
 
     QDomDocument doc;
-    doc.setContent(file);
+    doc.setContent(content);
 
     myPalette.clear();
     QDomElement docElem = doc.documentElement();
@@ -382,6 +462,7 @@ bool Object::importPalette(QString filePath)
         }
         tag = tag.nextSibling();
     }
+    paletteModification();
     return true;
 }
 
@@ -400,6 +481,7 @@ void Object::defaultInitialisation()
 void Object::loadDefaultPalette()
 {
     myPalette.clear();
+    paletteModification();
     addColour(  ColourRef(QColor(Qt::black), QString("Black"))  );
     addColour(  ColourRef(QColor(Qt::red), QString("Red"))  );
     addColour(  ColourRef(QColor(Qt::darkRed), QString("Dark Red"))  );
@@ -477,6 +559,130 @@ void Object::paintImage(QPainter& painter, int frameNumber, bool background, qre
     }
 }
 
+QList<FrameLayer> Object::copyFrame(int frameNumber)
+{
+    QList<FrameLayer> layers;
+    for(int i=0; i < getLayerCount(); i++)
+    {
+        Layer* layer = getLayer(i);
+        if(!layer->visible) continue;
+        if(layer->type == Layer::BITMAP)
+        {
+            BitmapImage* bitmapImage = ((LayerBitmap*)layer)->getLastBitmapImageAtFrame(frameNumber, 0);
+            if(bitmapImage == NULL) continue;
+            FrameLayer frameLayer;
+            frameLayer.source = bitmapImage;
+            frameLayer.image = *(bitmapImage->image);
+            frameLayer.topLeft = bitmapImage->topLeft();
+            layers << frameLayer;
+        }
+        if(layer->type == Layer::VECTOR)
+        {
+            VectorImage* vectorImage = ((LayerVector*)layer)->getLastVectorImageAtFrame(frameNumber, 0);
+            if(vectorImage == NULL) continue;
+            FrameLayer frameLayer;
+            frameLayer.isVector = true;
+            frameLayer.source = vectorImage;
+            frameLayer.vectorImage = *vectorImage;
+            layers << frameLayer;
+        }
+    }
+    return layers;
+}
+
+void Object::paintFrame(QPainter& painter, QList<FrameLayer>& layers, const RenderContext& context, bool background, qreal curveOpacity, bool antialiasing, int gradients)
+{
+    // same as paintImage, with the copied drawings
+    painter.setRenderHint(QPainter::Antialiasing, true);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    if(background)
+    {
+        painter.setPen(Qt::NoPen);
+        painter.setBrush(Qt::white);
+        painter.setWorldMatrixEnabled(false);
+        painter.drawRect( QRect(0,0, painter.device()->width(), painter.device()->height() ) );
+        painter.setWorldMatrixEnabled(true);
+    }
+    for(int i=0; i < layers.size(); i++)
+    {
+        painter.setOpacity(1.0);
+        if(layers.at(i).isVector)
+        {
+            layers[i].vectorImage.paintImage(painter, context, false, false, curveOpacity, antialiasing, gradients);
+        }
+        else
+        {
+            painter.drawImage(layers.at(i).topLeft, layers.at(i).image);
+        }
+    }
+}
+
+// a frame of an export, rendered and encoded by a worker thread
+struct FrameJob
+{
+    QList<FrameLayer> layers;
+    RenderContext context; // a copy, as the palette may change on the GUI thread during the export
+    QMatrix view;
+    QSize size;
+    bool background;
+    qreal curveOpacity;
+    bool antialiasing;
+    int gradients;
+    QByteArray format;
+    int quality;
+};
+
+static QByteArray renderFrameJob(FrameJob job)
+{
+    QImage image(job.size, QImage::Format_ARGB32_Premultiplied);
+    image.fill(0x00000000);
+    QPainter painter(&image);
+    painter.setWorldMatrix(job.view);
+    Object::paintFrame(painter, job.layers, job.context, job.background, job.curveOpacity, job.antialiasing, job.gradients);
+    painter.end();
+    if(job.format == "RAW")
+    {
+        const QImage& pixels = image; // the lines of a 32-bit image are contiguous
+        return QByteArray((const char*)pixels.bits(), pixels.byteCount());
+    }
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, job.format.constData(), job.quality);
+    return data;
+}
+
+static bool sameDrawings(const QList<FrameLayer>& layers1, const QList<FrameLayer>& layers2)
+{
+    if(layers1.size() != layers2.size()) return false;
+    for(int i=0; i < layers1.size(); i++)
+    {
+        if(layers1.at(i).source != layers2.at(i).source) return false;
+    }
+    return true;
+}
+
+static void writeFrameData(QIODevice* output, QString filePath, const QByteArray& data)
+{
+    if(output)
+    {
+        // the reader of the frames may be slower than the rendering: the writing waits for it, so that its buffer stays small
+        output->write(data);
+        while(output->bytesToWrite() > 2 * data.size())
+        {
+            if(!output->waitForBytesWritten(30000))
+            {
+                qDebug() << "The frames are not read";
+                break;
+            }
+        }
+        return;
+    }
+    QFile file(filePath);
+    if(!file.open(QFile::WriteOnly) || file.write(data) != data.size()) qDebug() << "Cannot write the frame" << filePath;
+}
+
 void Object::exportFrames(int frameStart, int frameEnd, QMatrix view, Layer* currentLayer, QSize exportSize, QString filePath, const char* format, int quality, bool background, bool antialiasing, int gradients, QProgressDialog* progress=NULL, int progressMax=50)
 {
 
@@ -544,7 +750,7 @@ void convertNFrames(int fps,int exportFps,int* frameRepeat,int* frameReminder,in
 
 
 
-void Object::exportFrames1(int frameStart, int frameEnd, QMatrix view, Layer* currentLayer, QSize exportSize, QString filePath, const char* format, int quality, bool background, bool antialiasing, int gradients, QProgressDialog* progress, int progressMax, int fps, int exportFps)
+void Object::exportFrames1(int frameStart, int frameEnd, QMatrix view, Layer* currentLayer, QSize exportSize, QString filePath, const char* format, int quality, bool background, bool antialiasing, int gradients, QProgressDialog* progress, int progressMax, int fps, int exportFps, QIODevice* output)
 {
 
     int frameRepeat;
@@ -584,34 +790,51 @@ void Object::exportFrames1(int frameStart, int frameEnd, QMatrix view, Layer* cu
     frameReminder1 = frameReminder;
     framePutEvery1 = framePutEvery;
     frameSkipEvery1 = frameSkipEvery;
+    QList< QFuture<QByteArray> > pending; // the frames being rendered, in order
+    int maxPending = 2 * QThread::idealThreadCount(); // bounds the memory held by the frames waiting to be written
+    int nextFrame = frameStart;
+    FrameJob previousJob;
+    QFuture<QByteArray> previousFrame;
     for(int currentFrame = frameStart; currentFrame <= frameEnd ; currentFrame++)
     {
-        if ( progress != NULL ) progress->setValue((currentFrame-frameStart)*progressMax/(frameEnd-frameStart));
-        QImage tempImage(exportSize, QImage::Format_ARGB32_Premultiplied);
-        QPainter painter(&tempImage);
-
-        // Make sure that old frame is erased before exporting a new one
-        tempImage.fill(0x00000000);
-
-        if(currentLayer->type == Layer::CAMERA)
-        {
-            QRect viewRect = ((LayerCamera*)currentLayer)->getViewRect();
-            QMatrix mapView = Editor::map( viewRect, QRectF(QPointF(0,0), exportSize) );
-            mapView = ((LayerCamera*)currentLayer)->getViewAtFrame(currentFrame) * mapView;
-            painter.setWorldMatrix(mapView);
-        }
-        else
+        // the frames are rendered and encoded by a pool of threads, and written in order as they are done
+        while(nextFrame <= frameEnd && pending.size() < maxPending)
         {
-            painter.setWorldMatrix(view);
+            FrameJob job;
+            job.layers = copyFrame(nextFrame);
+            job.context = getRenderContext();
+            job.view = view;
+            if(currentLayer->type == Layer::CAMERA)
+            {
+                QRect viewRect = ((LayerCamera*)currentLayer)->getViewRect();
+                QMatrix mapView = Editor::map( viewRect, QRectF(QPointF(0,0), exportSize) );
+                job.view = ((LayerCamera*)currentLayer)->getViewAtFrame(nextFrame) * mapView;
+            }
+            job.size = exportSize;
+            job.background = background;
+            job.curveOpacity = curveOpacity;
+            job.antialiasing = antialiasing;
+            job.gradients = gradients;
+            job.format = output ? "RAW" : format;
+            job.quality = quality;
+            // when all the drawings are held and the camera does not move, the previous frame is written again instead of being rendered
+            if(nextFrame == frameStart || job.view != previousJob.view || !sameDrawings(job.layers, previousJob.layers))
+            {
+                previousFrame = QtConcurrent::run(renderFrameJob, job);
+                previousJob = job;
+            }
+            pending << previousFrame;
+            nextFrame++;
         }
-        paintImage(painter, currentFrame, background, curveOpacity, antialiasing, gradients);
+        QByteArray frameData = pending.takeFirst().result();
+        if ( progress != NULL ) progress->setValue((currentFrame-frameStart)*progressMax/(frameEnd-frameStart));
 
         frameNumber++;
         framePerSecond++;
         QString frameNumberString = QString::number(frameNumber);
         while( frameNumberString.length() < 4) frameNumberString.prepend("0");
 
-        tempImage.save(filePath+frameNumberString+extension, format, quality);
+        writeFrameData(output, filePath+frameNumberString+extension, frameData);
         int delta = 0;
         if (framePutEvery)
         {
@@ -640,7 +863,7 @@ void Object::exportFrames1(int frameStart, int frameEnd, QMatrix view, Layer* cu
             QString frameNumberLink = QString::number(frameNumber);
             while( frameNumberLink.length() < 4) frameNumberLink.prepend("0");
 //                    QFile::link(filePath+frameNumberString+extension, filePath+frameNumberLink+extension+".lnk");
-            tempImage.save(filePath+frameNumberLink+extension, format, quality);
+            writeFrameData(output, filePath+frameNumberLink+extension, frameData); // the repeated frames are only encoded once
         }
         if (framePerSecond == exportFps)
         {
@@ -732,3 +955,46 @@ void Object::imageCheck(int frameNumber)
         emit imageRemoved(frameNumber);
     }
 }
+
+void Object::imageLoaded()
+{
+    // the memory is checked once the current operation is done, so that the drawings it uses are not unloaded under it
+    if(!unloadScheduled)
+    {
+        unloadScheduled = true;
+        QTimer::singleShot(0, this, SLOT(unloadImages()));
+    }
+}
+
+void Object::unloadImages()
+{
+    unloadScheduled = false;
+    qint64 limit = imageMemoryLimit;
+    qint64 bytes = 0;
+    QMultiMap<qint64, QPair<LayerImage*, int> > unloadable; // by time of last use
+    for(int i=0; i < layer.size(); i++)
+    {
+        if(layer[i]->type == Layer::BITMAP || layer[i]->type == Layer::VECTOR)
+        {
+            LayerImage* layerImage = (LayerImage*)layer[i];
+            QMultiMap<qint64, int> keys;
+            bytes += layerImage->listLoadedImages(keys);
+            QMapIterator<qint64, int> it(keys);
+            while(it.hasNext())
+            {
+                it.next();
+                unloadable.insert(it.key(), qMakePair(layerImage, it.value()));
+            }
+        }
+    }
+    if(bytes <= limit) return;
+    // the least recently used drawings are unloaded, down to three quarters of the limit (the last one used is kept)
+    QMapIterator<qint64, QPair<LayerImage*, int> > it(unloadable);
+    int count = 0;
+    while(it.hasNext() && bytes > limit * 3 / 4 && count < unloadable.size() - 1)
+    {
+        it.next();
+        bytes -= it.value().first->unloadImage(it.value().second);
+        count++;
+    }
+}
@@ -23,9 +23,21 @@ GNU General Public License for more details.
 #include "layerbitmap.h"
 #include "layervector.h"
 #include "colourref.h"
+#include "rendercontext.h"
 
 #include "flash.h"
 
+// a drawing shown at a frame, copied so that the frame can be painted on another thread (see Object::paintFrame)
+struct FrameLayer
+{
+    FrameLayer() : isVector(false), source(NULL) {}
+    bool isVector;
+    const void* source; // the drawing which was copied (the same at all the frames where it is held)
+    QImage image; // bitmap drawing
+    QPoint topLeft;
+    VectorImage vectorImage; // vector drawing (the curves and areas are implicitly shared)
+};
+
 class Object : public QObject
 {
     Q_OBJECT
@@ -35,6 +47,7 @@ public slots:
     void toggleMirror() { mirror = !mirror; }//TODO toggles mirror button
     void resetMirror() { mirror = false; }
     void imageCheck(int);
+    void unloadImages(); // unloads the least recently used drawings if they take more memory than allowed
 
 signals:
     void imageAdded(int);
@@ -53,18 +66,25 @@ public:
 
     QString name;
     bool modified;
+    QString vectorFormat; // format in which the vector frames are saved: "VEC" (XML) or "VECB" (binary)
+    QString bitmapFormat; // format in which the bitmap frames are saved: "PNG" or "PTL" (see TileCodec)
     bool mirror; // if true, the returned image is flipped horizontally
     QList<Layer*> layer;
     QList<ColourRef> myPalette;
 
     //void paintImage(QPainter &painter, int frameNumber, const QRectF &source, const QRectF &target, bool background, qreal curveOpacity, bool antialiasing, bool niceGradients);
     void paintImage(QPainter& painter, int frameNumber, bool background, qreal curveOpacity, bool antialiasing, int gradients);
+    QList<FrameLayer> copyFrame(int frameNumber); // copies the drawings shown at a frame, so that it can be painted on another thread
+    static void paintFrame(QPainter& painter, QList<FrameLayer>& layers, const RenderContext& context, bool background, qreal curveOpacity, bool antialiasing, int gradients); // can be called from any thread, with a copy of the render context
 
     ColourRef getColour(int i);
-    void setColour(int index, QColor newColour) { myPalette[index].colour = newColour; }
+    void setColour(int index, QColor newColour) { myPalette[index].colour = newColour; paletteModification(); }
     void addColour(QColor);
-    void addColour(ColourRef newColour) { myPalette.append(newColour); }
+    void addColour(ColourRef newColour) { myPalette.append(newColour); paletteModification(); }
     bool removeColour(int index);
+    void remapColour(int oldIndex, int newIndex);
+    bool usesColour(int index);
+    int getColourUserCount(int index); // number of vector images using this colour
     void renameColour(int i, QString text);
     int getColourCount() { return myPalette.size();}
     bool importPalette(QString filePath);
@@ -73,6 +93,22 @@ public:
     bool loadPalette(QString filePath);
     void loadDefaultPalette();
 
+    // palette resolved into pens and brushes, shared by all the paintings until the palette changes
+    const RenderContext& getRenderContext() const { return renderContext; }
+    void paletteModification() { renderContext = RenderContext(myPalette); } // to be called after each change of myPalette
+
+    // colour usage index of the vector images (maintained by the images themselves, see VectorImage::updateColourUsage)
+    void addColourUser(int colour, VectorImage* image);
+    void removeColourUser(int colour, VectorImage* image);
+    void colourUsageModification(VectorImage* image, bool trueOrFalse);
+    void uncountedImageOpened() { colourUsageComplete = false; } // a picture was opened without its colour usage (see LayerVector::loadDomElement)
+    void updateColourUsage();
+
+    // the drawings are loaded on first use (see LayerImage::loadImages)
+    void imageLoaded();
+    bool unloadScheduled;
+    qint64 imageMemoryLimit; // bytes of loaded drawings above which the least recently used ones are unloaded (read once from the settings)
+
 
     void addNewBitmapLayer();
     void addNewVectorLayer();
@@ -90,12 +126,18 @@ public:
     void defaultInitialisation();
 
     void exportFrames(int frameStart, int frameEnd, QMatrix view, Layer* currentLayer, QSize exportSize, QString filePath, const char* format, int quality, bool background, bool antialiasing, int gradients, QProgressDialog* progress, int progressMax);
-    void exportFrames1(int frameStart, int frameEnd, QMatrix view, Layer* currentLayer, QSize exportSize, QString filePath, const char* format, int quality, bool background, bool antialiasing, int gradients, QProgressDialog* progress, int progressMax, int fps, int exportFps);
+    void exportFrames1(int frameStart, int frameEnd, QMatrix view, Layer* currentLayer, QSize exportSize, QString filePath, const char* format, int quality, bool background, bool antialiasing, int gradients, QProgressDialog* progress, int progressMax, int fps, int exportFps, QIODevice* output = NULL); // if output is given, the frames are written to it as raw 32-bit pixels instead of files
     void exportMovie(int startFrame, int endFrame, QMatrix view, Layer* currentLayer, QSize exportSize, QString filePath, int fps, int exportFps, QString exportFormat);
     void exportX(int frameStart, int frameEnd, QMatrix view, QSize exportSize, QString filePath,  bool antialiasing, int gradients);
     void exportIm(int frameStart, int frameEnd, QMatrix view, QSize exportSize, QString filePath,  bool antialiasing, int gradients);
     void exportFlash(int startFrame, int endFrame, QMatrix view, QSize exportSize, QString filePath, int fps, int compression);
 
+private:
+    RenderContext renderContext; // rebuilt by paletteModification, so that it can be read from any thread
+    QHash<int, QSet<VectorImage*> > colourUsers;
+    QSet<VectorImage*> colourUsageModified; // images whose usage has to be counted again
+    bool colourUsageComplete; // false while some unread pictures are not counted
+    void loadColourUsers(const QSet<VectorImage*>& users);
 };
 
 #endif
@@ -0,0 +1,182 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#include "rastercache.h"
+#include "tilecodec.h"
+#include <QtDebug>
+#include <QDir>
+#include <QFile>
+#include <QBuffer>
+#include <QSet>
+#include <QSettings>
+#include <QTextStream>
+#include <QDesktopServices>
+#include <QtConcurrentRun>
+
+static void writeCacheFile(QString path, QByteArray data)
+{
+    // the file is written under a temporary name, so that a file of the cache is always complete
+    QFile file(path + ".tmp");
+    if(!file.open(QFile::WriteOnly) || file.write(data) != data.size())
+    {
+        qDebug() << "Cannot write the cache file" << file.fileName();
+        file.close();
+        file.remove();
+        return;
+    }
+    file.close();
+    QFile::remove(path);
+    file.rename(path);
+}
+
+RasterCache* RasterCache::instance()
+{
+    static RasterCache cache;
+    return &cache;
+}
+
+RasterCache::RasterCache()
+{
+    QSettings settings("Pencil","Pencil");
+    maxSize = settings.value("rasterCacheSize", 256).toLongLong() * 1024 * 1024; // in megabytes
+    totalSize = 0;
+    useCount = 0;
+    directory = QDesktopServices::storageLocation(QDesktopServices::CacheLocation) + "/rasters";
+    QDir dir(directory);
+    if(!dir.exists() && !dir.mkpath(".")) qDebug() << "Cannot create the cache directory" << directory;
+
+    // the files are ordered by last use: first those listed by the index, then the others (written by a session which did not end) by date
+    QStringList leftovers = dir.entryList(QStringList() << "*.tmp", QDir::Files);
+    for(int i=0; i < leftovers.size(); i++) dir.remove(leftovers.at(i));
+    QHash<QString, qint64> fileSizes;
+    QStringList names;
+    QFileInfoList files = dir.entryInfoList(QStringList() << "*.ptl", QDir::Files, QDir::Time | QDir::Reversed);
+    for(int i=0; i < files.size(); i++)
+    {
+        fileSizes.insert(files.at(i).completeBaseName(), files.at(i).size());
+    }
+    QFile indexFile(dir.filePath("index"));
+    if(indexFile.open(QFile::ReadOnly | QFile::Text))
+    {
+        QTextStream in(&indexFile);
+        while(!in.atEnd()) names << in.readLine();
+    }
+    QSet<QString> indexed = names.toSet();
+    for(int i=0; i < files.size(); i++)
+    {
+        if(!indexed.contains(files.at(i).completeBaseName())) names << files.at(i).completeBaseName();
+    }
+    for(int i=0; i < names.size(); i++)
+    {
+        QString name = names.at(i);
+        if(!fileSizes.contains(name) || lastUse.contains(name)) continue;
+        sizes.insert(name, fileSizes.value(name));
+        totalSize += fileSizes.value(name);
+        touch(name);
+    }
+    evict();
+}
+
+RasterCache::~RasterCache()
+{
+    QFile indexFile(QDir(directory).filePath("index"));
+    if(!indexFile.open(QFile::WriteOnly | QFile::Truncate | QFile::Text)) return;
+    QTextStream out(&indexFile);
+    QMapIterator<qint64, QString> it(byLastUse);
+    while(it.hasNext()) out << it.next().value() << "\n";
+}
+
+QImage RasterCache::find(const QByteArray& key)
+{
+    QString name = key.toHex();
+    if(!lastUse.contains(name)) return QImage();
+    QFile file(filePath(name));
+    if(!file.open(QFile::ReadOnly)) return QImage(); // it may still be written
+    QImage image = TileCodec::read(file.readAll());
+    file.close();
+    if(image.isNull())
+    {
+        qDebug() << "Removing the invalid cache file" << file.fileName();
+        file.remove();
+        forget(name);
+        return image;
+    }
+    touch(name);
+    return image;
+}
+
+void RasterCache::insert(const QByteArray& key, const QImage& image)
+{
+    QString name = key.toHex();
+    if(lastUse.contains(name))
+    {
+        touch(name);
+        return;
+    }
+    // the codec of the frame files is fast enough to encode here, only the writing is left to another thread
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    if(!TileCodec::write(image, &buffer)) return;
+    buffer.close();
+    writes.insert(name, QtConcurrent::run(writeCacheFile, filePath(name), buffer.data()));
+    sizes.insert(name, buffer.data().size());
+    totalSize += buffer.data().size();
+    touch(name);
+    evict();
+}
+
+void RasterCache::touch(QString name)
+{
+    if(lastUse.contains(name)) byLastUse.remove(lastUse.value(name));
+    lastUse.insert(name, ++useCount);
+    byLastUse.insert(useCount, name);
+}
+
+void RasterCache::forget(QString name)
+{
+    byLastUse.remove(lastUse.take(name));
+    totalSize -= sizes.take(name);
+}
+
+bool RasterCache::isWriting(QString name)
+{
+    return writes.contains(name) && !writes.value(name).isFinished();
+}
+
+void RasterCache::evict()
+{
+    // the least recently used files are removed (the last one used is kept)
+    // a file still being written is skipped: it would be renamed into the cache after its removal, and never be counted again
+    QMap<qint64, QString>::iterator it = byLastUse.begin();
+    while(totalSize > maxSize && it != byLastUse.end() && it + 1 != byLastUse.end())
+    {
+        QString name = it.value();
+        if(isWriting(name))
+        {
+            ++it;
+            continue;
+        }
+        it = byLastUse.erase(it);
+        lastUse.remove(name);
+        totalSize -= sizes.take(name);
+        QFile::remove(filePath(name));
+    }
+    // the finished writes are forgotten
+    QMutableHashIterator<QString, QFuture<void> > writing(writes);
+    while(writing.hasNext())
+    {
+        if(writing.next().value().isFinished()) writing.remove();
+    }
+}
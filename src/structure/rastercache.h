@@ -0,0 +1,57 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#ifndef RASTERCACHE_H
+#define RASTERCACHE_H
+
+#include <QImage>
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QMap>
+#include <QFuture>
+
+// persistent cache of rendered frames, shared by all the documents and sessions
+// a rendering is stored in a file named after a hash of the drawing and of the rendering parameters (see LayerVector::rasterKey),
+// so it is found again when the document is reopened; the least recently used files are removed beyond a size limit
+// it is not locked: it is only used from the GUI thread (the files are written in the background, but the bookkeeping is not)
+class RasterCache
+{
+public:
+    static RasterCache* instance();
+    ~RasterCache();
+
+    QImage find(const QByteArray& key); // returns a null image if there is no rendering for this key
+    void insert(const QByteArray& key, const QImage& image); // the file is written in the background
+
+private:
+    RasterCache();
+    QString filePath(QString name) { return directory + "/" + name + ".ptl"; }
+    void touch(QString name);
+    void forget(QString name);
+    void evict();
+    bool isWriting(QString name);
+
+    QString directory;
+    qint64 maxSize; // in bytes (setting "rasterCacheSize", in megabytes)
+    qint64 totalSize;
+    qint64 useCount;
+    QHash<QString, qint64> lastUse; // the files of the cache (named after the key in hexadecimal), with the time of their last use
+    QHash<QString, qint64> sizes;
+    QMap<qint64, QString> byLastUse;
+    QHash<QString, QFuture<void> > writes; // the files being written in the background
+};
+
+#endif
@@ -0,0 +1,180 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#include "soundfile.h"
+#include <QtDebug>
+#include <QFile>
+#include <QDataStream>
+#include <math.h>
+
+static QByteArray readId(QDataStream& in)
+{
+    char id[4];
+    if(in.readRawData(id, 4) != 4) return QByteArray();
+    return QByteArray(id, 4);
+}
+
+// the sample rate of an AIFF file is an 80-bit extended precision number
+static double extendedToDouble(const uchar* bytes)
+{
+    int exponent = ((bytes[0] & 0x7f) << 8) | bytes[1];
+    quint64 mantissa = 0;
+    for(int i=2; i < 10; i++) mantissa = (mantissa << 8) | bytes[i];
+    if(exponent == 0 && mantissa == 0) return 0.0;
+    double value = ldexp(double(mantissa), exponent - 16383 - 63);
+    return (bytes[0] & 0x80) ? -value : value;
+}
+
+SoundFile::SoundFile()
+{
+    sampleRate = 0;
+    channels = 0;
+    bitsPerSample = 0;
+    floatingPoint = false;
+    bigEndian = false;
+    wave = false;
+    frameCount = 0;
+    dataOffset = -1;
+}
+
+bool SoundFile::open(QString filePath)
+{
+    QFile file(filePath);
+    if(!file.open(QFile::ReadOnly)) return false;
+    QDataStream in(&file);
+    QByteArray kind = readId(in);
+    bool ok = false;
+    if(kind == "RIFF")
+    {
+        in.setByteOrder(QDataStream::LittleEndian);
+        quint32 size;
+        in >> size;
+        if(readId(in) == "WAVE") ok = readWave(in, file.size());
+    }
+    else if(kind == "FORM")
+    {
+        in.setByteOrder(QDataStream::BigEndian);
+        quint32 size;
+        in >> size;
+        QByteArray formType = readId(in);
+        if(formType == "AIFF" || formType == "AIFC") ok = readAiff(in, file.size(), formType == "AIFC");
+    }
+    if(ok && !validFormat())
+    {
+        qDebug() << "Unsupported sample format in" << filePath << channels << bitsPerSample;
+        ok = false;
+    }
+    return ok;
+}
+
+bool SoundFile::validFormat() const
+{
+    if(sampleRate <= 0 || channels <= 0 || dataOffset < 0) return false;
+    if(floatingPoint) return bitsPerSample == 32 || bitsPerSample == 64;
+    return bitsPerSample == 8 || bitsPerSample == 16 || bitsPerSample == 24 || bitsPerSample == 32;
+}
+
+bool SoundFile::readWave(QDataStream& in, qint64 fileSize)
+{
+    QIODevice* device = in.device();
+    bigEndian = false;
+    wave = true;
+    bool hasFormat = false;
+    while(!in.atEnd())
+    {
+        QByteArray chunk = readId(in);
+        quint32 size;
+        in >> size;
+        if(in.status() != QDataStream::Ok) break;
+        qint64 start = device->pos();
+        if(chunk == "fmt ")
+        {
+            quint16 format, channelCount, blockAlign, bits;
+            quint32 rate, byteRate;
+            in >> format >> channelCount >> rate >> byteRate >> blockAlign >> bits;
+            if(format == 0xFFFE && size >= 40)
+            {
+                // extensible format: the actual format is the start of the sub-format identifier
+                quint16 extensionSize, validBits, subFormat;
+                quint32 channelMask;
+                in >> extensionSize >> validBits >> channelMask >> subFormat;
+                format = subFormat;
+            }
+            if(format != 1 && format != 3) return false; // compressed
+            floatingPoint = (format == 3);
+            channels = channelCount;
+            sampleRate = rate;
+            bitsPerSample = bits;
+            if(blockAlign != channels * bitsPerSample / 8) return false;
+            hasFormat = true;
+        }
+        else if(chunk == "data")
+        {
+            if(!hasFormat || channels <= 0 || bitsPerSample < 8) return false;
+            dataOffset = start;
+            qint64 dataSize = qMin(qint64(size), fileSize - start); // the size is not always filled in by the programs which write the file as a stream
+            frameCount = dataSize / (channels * bitsPerSample / 8);
+            return true;
+        }
+        if(!device->seek(start + size + (size & 1))) break; // the chunks are aligned on even positions
+    }
+    return false;
+}
+
+bool SoundFile::readAiff(QDataStream& in, qint64 fileSize, bool compressed)
+{
+    QIODevice* device = in.device();
+    bigEndian = true;
+    wave = false;
+    bool hasFormat = false;
+    quint32 frames = 0;
+    while(!in.atEnd())
+    {
+        QByteArray chunk = readId(in);
+        quint32 size;
+        in >> size;
+        if(in.status() != QDataStream::Ok) break;
+        qint64 start = device->pos();
+        if(chunk == "COMM")
+        {
+            qint16 channelCount, bits;
+            uchar rate[10];
+            in >> channelCount >> frames >> bits;
+            in.readRawData((char*)rate, 10);
+            channels = channelCount;
+            bitsPerSample = bits;
+            sampleRate = qRound(extendedToDouble(rate));
+            if(compressed)
+            {
+                QByteArray compression = readId(in);
+                if(compression == "sowt") bigEndian = false; // little-endian samples
+                else if(compression == "fl32" || compression == "FL32" || compression == "fl64" || compression == "FL64") floatingPoint = true;
+                else if(compression != "NONE") return false;
+            }
+            hasFormat = true;
+        }
+        else if(chunk == "SSND")
+        {
+            quint32 offset, blockSize;
+            in >> offset >> blockSize;
+            dataOffset = start + 8 + offset;
+        }
+        if(!device->seek(start + size + (size & 1))) break;
+    }
+    if(!hasFormat || dataOffset < 0 || channels <= 0 || bitsPerSample < 8) return false;
+    qint64 available = (fileSize - dataOffset) / (channels * ((bitsPerSample + 7) / 8));
+    frameCount = qMin(qint64(frames), available);
+    return true;
+}
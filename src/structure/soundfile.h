@@ -0,0 +1,57 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#ifndef SOUNDFILE_H
+#define SOUNDFILE_H
+
+#include <QString>
+#include <QByteArray>
+
+class QDataStream;
+
+// the header of an uncompressed WAV or AIFF file: the format of the samples and where they are
+// reading it is enough to know the duration of a clip, without going through the media backend
+class SoundFile
+{
+public:
+    SoundFile();
+    bool open(QString filePath); // returns false if the file is not an uncompressed WAV or AIFF file
+
+    int getSampleRate() const { return sampleRate; }
+    int getChannels() const { return channels; }
+    int getBitsPerSample() const { return bitsPerSample; }
+    bool isFloatingPoint() const { return floatingPoint; }
+    bool isBigEndian() const { return bigEndian; }
+    bool isUnsigned() const { return wave && bitsPerSample == 8; } // 8-bit samples are unsigned in WAV files, signed in AIFF files
+    qint64 getFrameCount() const { return frameCount; } // number of samples of each channel
+    qint64 getDataOffset() const { return dataOffset; } // position of the first sample in the file
+    qint64 getDuration() const { return sampleRate > 0 ? frameCount * 1000 / sampleRate : 0; } // in milliseconds
+
+private:
+    bool readWave(QDataStream& in, qint64 fileSize);
+    bool readAiff(QDataStream& in, qint64 fileSize, bool compressed);
+    bool validFormat() const;
+
+    int sampleRate;
+    int channels;
+    int bitsPerSample;
+    bool floatingPoint;
+    bool bigEndian;
+    bool wave;
+    qint64 frameCount;
+    qint64 dataOffset;
+};
+
+#endif
@@ -0,0 +1,256 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#include "soundmixer.h"
+#include "soundfile.h"
+#include <QtDebug>
+#include <QFile>
+#include <QTemporaryFile>
+#include <QDir>
+#include <QProcess>
+#include <QApplication>
+#include <QProgressDialog>
+#include <QDataStream>
+#include <QtEndian>
+#include <math.h>
+#include <string.h>
+
+static const int MIX_BLOCK = 4096; // frames mixed at a time
+
+SoundMixer::SoundMixer(int sampleRate, int channels)
+{
+    this->sampleRate = sampleRate;
+    this->channels = channels;
+}
+
+SoundMixer::~SoundMixer()
+{
+    for(int i=0; i < clips.size(); i++)
+    {
+        delete clips.at(i)->device;
+        delete clips.at(i);
+    }
+}
+
+bool SoundMixer::addClip(QString filePath, qint64 position, QProgressDialog* progress)
+{
+    Clip* clip = new Clip;
+    clip->position = position;
+    SoundFile header;
+    if(header.open(filePath))
+    {
+        // uncompressed file: the samples are read directly from it
+        QFile* file = new QFile(filePath);
+        if(!file->open(QIODevice::ReadOnly))
+        {
+            delete file;
+            delete clip;
+            return false;
+        }
+        clip->device = file;
+        clip->sampleRate = header.getSampleRate();
+        clip->channels = header.getChannels();
+        clip->bitsPerSample = header.getBitsPerSample();
+        clip->floatingPoint = header.isFloatingPoint();
+        clip->bigEndian = header.isBigEndian();
+        clip->unsignedSamples = header.isUnsigned();
+        clip->frameCount = header.getFrameCount();
+        clip->dataOffset = header.getDataOffset();
+    }
+    else
+    {
+        // compressed file (mp3, ogg...): ffmpeg decodes it to 16-bit samples at the rate of the mix,
+        // into a temporary file which is then read like an uncompressed one (and removed with the clip)
+        QTemporaryFile* file = new QTemporaryFile(QDir::tempPath() + "/pencil_sound_XXXXXX.raw");
+        if(!file->open())
+        {
+            qDebug() << "ERROR: Could not create a temporary file to decode" << filePath;
+            delete file;
+            delete clip;
+            return false;
+        }
+        file->close(); // ffmpeg writes it
+        QProcess ffmpeg;
+        QString command = "ffmpeg -i \"" + filePath + "\" -f s16le -acodec pcm_s16le -ar " + QString::number(sampleRate) + " -ac " + QString::number(channels) + " -y \"" + file->fileName() + "\"";
+        ffmpeg.start(command);
+        bool decoded = ffmpeg.waitForStarted();
+        // the interface is kept alive while ffmpeg decodes, and the decoding stops if the export is aborted
+        while(decoded && ffmpeg.state() != QProcess::NotRunning && !ffmpeg.waitForFinished(100))
+        {
+            qApp->processEvents();
+            if(progress != NULL && progress->wasCanceled())
+            {
+                ffmpeg.kill();
+                ffmpeg.waitForFinished();
+                delete file;
+                delete clip;
+                return false;
+            }
+        }
+        if(!decoded || ffmpeg.exitStatus() != QProcess::NormalExit || ffmpeg.exitCode() != 0 || !file->open())
+        {
+            qDebug() << "ERROR: Could not decode" << filePath << "with FFmpeg.";
+            delete file;
+            delete clip;
+            return false;
+        }
+        clip->device = file;
+        clip->sampleRate = sampleRate;
+        clip->channels = channels;
+        clip->bitsPerSample = 16;
+        clip->floatingPoint = false;
+        clip->bigEndian = false;
+        clip->unsignedSamples = false;
+        clip->frameCount = file->size() / (2 * channels);
+        clip->dataOffset = 0;
+        if(clip->frameCount == 0)
+        {
+            qDebug() << "ERROR: No sound in" << filePath;
+            delete file;
+            delete clip;
+            return false;
+        }
+    }
+    clips << clip;
+    return true;
+}
+
+// reads count frames of the clip from the frame first, as values between -1 and 1 (the frames outside of the clip are silent)
+bool SoundMixer::readFrames(Clip* clip, qint64 first, int count, QVector<float>& samples)
+{
+    int sampleSize = clip->bitsPerSample / 8;
+    int frameSize = clip->channels * sampleSize;
+    samples.fill(0.0f, count * clip->channels);
+    qint64 begin = qMax(first, qint64(0));
+    qint64 end = qMin(first + count, clip->frameCount);
+    if(begin >= end) return true;
+    if(!clip->device->seek(clip->dataOffset + begin * frameSize)) return false;
+    QByteArray data = clip->device->read((end - begin) * frameSize);
+    const uchar* p = (const uchar*)data.constData();
+    int n = data.size() / sampleSize;
+    float* out = samples.data() + (begin - first) * clip->channels;
+    for(int i=0; i < n; i++, p += sampleSize)
+    {
+        float value = 0.0f;
+        if(clip->floatingPoint)
+        {
+            if(sampleSize == 4)
+            {
+                quint32 bits = clip->bigEndian ? qFromBigEndian<quint32>(p) : qFromLittleEndian<quint32>(p);
+                float f;
+                memcpy(&f, &bits, 4);
+                value = f;
+            }
+            else
+            {
+                quint64 bits = clip->bigEndian ? qFromBigEndian<quint64>(p) : qFromLittleEndian<quint64>(p);
+                double d;
+                memcpy(&d, &bits, 8);
+                value = d;
+            }
+        }
+        else if(sampleSize == 1)
+        {
+            value = clip->unsignedSamples ? (int(p[0]) - 128) / 128.0f : qint8(p[0]) / 128.0f;
+        }
+        else
+        {
+            // the most significant bytes of the sample make a 32-bit integer
+            quint32 bits = 0;
+            for(int b=0; b < sampleSize; b++)
+            {
+                int byte = clip->bigEndian ? b : sampleSize - 1 - b;
+                bits = (bits << 8) | p[byte];
+            }
+            bits <<= 8 * (4 - sampleSize);
+            value = qint32(bits) / 2147483648.0f;
+        }
+        out[i] = value;
+    }
+    return true;
+}
+
+void SoundMixer::mix(qint64 firstFrame, int frameCount, qint16* output)
+{
+    QVector<float> sum(frameCount * channels, 0.0f);
+    QVector<float> samples;
+    for(int c=0; c < clips.size(); c++)
+    {
+        Clip* clip = clips.at(c);
+        double step = double(clip->sampleRate) / sampleRate;
+        double start = (firstFrame - clip->position) * step; // position in the clip of the first frame
+        double stop = (firstFrame + frameCount - 1 - clip->position) * step;
+        if(stop < 0 || start >= clip->frameCount) continue;
+        // the frames of the clip around this piece of the mix, interpolated linearly when the rates differ
+        qint64 first = qint64(floor(start));
+        int count = int(floor(stop)) - first + 2;
+        if(!readFrames(clip, first, count, samples)) continue;
+        for(int i=0; i < frameCount; i++)
+        {
+            double t = start + i * step - first;
+            int index = int(t);
+            float fraction = t - index;
+            const float* a = samples.constData() + index * clip->channels;
+            const float* b = a + clip->channels;
+            for(int ch=0; ch < channels; ch++)
+            {
+                float value;
+                if(clip->channels > 1 && channels == 1)
+                {
+                    value = 0.0f;
+                    for(int k=0; k < clip->channels; k++) value += a[k] + (b[k] - a[k]) * fraction;
+                    value /= clip->channels;
+                }
+                else
+                {
+                    int k = ch % clip->channels; // a mono clip goes to every channel
+                    value = a[k] + (b[k] - a[k]) * fraction;
+                }
+                sum[i * channels + ch] += value;
+            }
+        }
+    }
+    for(int i=0; i < sum.size(); i++)
+    {
+        output[i] = qint16(qBound(-32768, qRound(sum.at(i) * 32768.0f), 32767));
+    }
+}
+
+bool SoundMixer::writeWave(QIODevice* device, qint64 frameCount)
+{
+    quint32 dataSize = frameCount * channels * 2;
+    QDataStream out(device);
+    out.setByteOrder(QDataStream::LittleEndian);
+    out.writeRawData("RIFF", 4);
+    out << quint32(36 + dataSize);
+    out.writeRawData("WAVE", 4);
+    out.writeRawData("fmt ", 4);
+    out << quint32(16) << quint16(1) << quint16(channels) << quint32(sampleRate) << quint32(sampleRate * channels * 2) << quint16(channels * 2) << quint16(16);
+    out.writeRawData("data", 4);
+    out << dataSize;
+    QVector<qint16> block(MIX_BLOCK * channels);
+    for(qint64 frame = 0; frame < frameCount; frame += MIX_BLOCK)
+    {
+        int count = qMin(qint64(MIX_BLOCK), frameCount - frame);
+        mix(frame, count, block.data());
+        for(int i=0; i < count * channels; i++) out << block.at(i);
+        if(out.status() != QDataStream::Ok)
+        {
+            qDebug() << "ERROR: Could not write the sound";
+            return false;
+        }
+    }
+    return true;
+}
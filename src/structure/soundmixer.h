@@ -0,0 +1,60 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#ifndef SOUNDMIXER_H
+#define SOUNDMIXER_H
+
+#include <QList>
+#include <QString>
+#include <QVector>
+
+class QIODevice;
+class QProgressDialog;
+
+// mixes sound clips into 16-bit PCM, a piece at a time: the clips are read from their files as the mix goes on,
+// converted to the sample rate and the number of channels of the mix, and placed at their position
+class SoundMixer
+{
+public:
+    SoundMixer(int sampleRate = 44100, int channels = 2);
+    ~SoundMixer();
+
+    bool addClip(QString filePath, qint64 position, QProgressDialog* progress = NULL); // position in the mix, in sample frames; returns false if the clip cannot be read, or if the decoding is aborted from progress
+    bool isEmpty() const { return clips.isEmpty(); }
+    void mix(qint64 firstFrame, int frameCount, qint16* output); // output has room for frameCount * channels samples
+    bool writeWave(QIODevice* device, qint64 frameCount); // writes the first frameCount frames of the mix as a WAV file
+
+private:
+    struct Clip
+    {
+        QIODevice* device;
+        qint64 position;
+        int sampleRate;
+        int channels;
+        int bitsPerSample;
+        bool floatingPoint;
+        bool bigEndian;
+        bool unsignedSamples;
+        qint64 frameCount;
+        qint64 dataOffset;
+    };
+    bool readFrames(Clip* clip, qint64 first, int count, QVector<float>& samples);
+
+    int sampleRate;
+    int channels;
+    QList<Clip*> clips;
+};
+
+#endif
@@ -0,0 +1,21 @@
+# compares StrokeRasterizer with the path filler of QPainter, and measures both
+# (qmake && make && ./tst_strokerasterizer; add -- -iterations 20 or -callgrind for steadier timings)
+
+QT += testlib xml
+CONFIG += qt console testcase
+CONFIG -= app_bundle
+TEMPLATE = app
+TARGET = tst_strokerasterizer
+MOC_DIR = .moc
+OBJECTS_DIR = .obj
+VECTOR = ../../src/graphics/vector
+INCLUDEPATH += $$VECTOR
+HEADERS += $$VECTOR/beziercurve.h \
+           $$VECTOR/colourref.h \
+           $$VECTOR/rendercontext.h \
+           $$VECTOR/strokerasterizer.h
+SOURCES += tst_strokerasterizer.cpp \
+           $$VECTOR/beziercurve.cpp \
+           $$VECTOR/colourref.cpp \
+           $$VECTOR/rendercontext.cpp \
+           $$VECTOR/strokerasterizer.cpp
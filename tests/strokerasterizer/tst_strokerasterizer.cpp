@@ -0,0 +1,155 @@
+/*
+
+Pencil - Traditional Animation Software
+Copyright (C) 2005-2007 Patrick Corrieri & Pascal Naidon
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation;
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+*/
+#include <QtTest>
+#include <math.h>
+#include "beziercurve.h"
+#include "strokerasterizer.h"
+
+class TestStrokeRasterizer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void matchesPathFiller_data();
+    void matchesPathFiller();
+    void benchmark_data();
+    void benchmark();
+
+private:
+    static BezierCurve makeStroke(int shape, qreal width);
+    static QMatrix makeMatrix(qreal scale, qreal angle);
+};
+
+// a few typical strokes drawn at pressures between 0.2 and 1, in a 200x200 area
+BezierCurve TestStrokeRasterizer::makeStroke(int shape, qreal width)
+{
+    QList<QPointF> points;
+    QList<qreal> pressures;
+    if(shape == 0) // straight line
+    {
+        for(int i=0; i<=10; i++) { points << QPointF(20+16*i, 30+12*i); pressures << 0.2+0.08*i; }
+    }
+    else if(shape == 1) // wave
+    {
+        for(int i=0; i<=40; i++) { points << QPointF(10+4.5*i, 100+50*sin(i/4.0)); pressures << 0.6+0.4*sin(i/3.0); }
+    }
+    else if(shape == 2) // loop crossing itself
+    {
+        for(int i=0; i<=60; i++) { points << QPointF(100+60*sin(i/10.0)+i, 100+60*cos(i/10.0)); pressures << 1.0-0.013*i; }
+    }
+    else // single dot
+    {
+        points << QPointF(100, 100) << QPointF(100.5, 100.5);
+        pressures << 0.5 << 0.5;
+    }
+    BezierCurve curve(points, pressures, 0.5);
+    curve.setWidth(width);
+    curve.setVariableWidth(true);
+    return curve;
+}
+
+QMatrix TestStrokeRasterizer::makeMatrix(qreal scale, qreal angle)
+{
+    QMatrix matrix;
+    matrix.translate(10, 10);
+    matrix.rotate(angle);
+    matrix.scale(scale, scale);
+    return matrix;
+}
+
+void TestStrokeRasterizer::matchesPathFiller_data()
+{
+    QTest::addColumn<int>("shape");
+    QTest::addColumn<qreal>("width");
+    QTest::addColumn<qreal>("scale");
+    QTest::addColumn<qreal>("angle");
+    const char* shapes[] = { "line", "wave", "loop", "dot" };
+    qreal widths[] = { 0.5, 2.0, 8.0, 30.0 };
+    for(int s=0; s<4; s++)
+    {
+        for(int w=0; w<4; w++)
+        {
+            QByteArray name = QByteArray(shapes[s]) + " width " + QByteArray::number(widths[w]);
+            QTest::newRow(name + " identity") << s << widths[w] << 1.0 << 0.0;
+            QTest::newRow(name + " zoomed") << s << widths[w] << 2.5 << 0.0;
+            QTest::newRow(name + " rotated") << s << widths[w] << 0.7 << 30.0;
+        }
+    }
+}
+
+void TestStrokeRasterizer::matchesPathFiller()
+{
+    QFETCH(int, shape);
+    QFETCH(qreal, width);
+    QFETCH(qreal, scale);
+    QFETCH(qreal, angle);
+    BezierCurve curve = makeStroke(shape, width);
+    QMatrix matrix = makeMatrix(scale, angle);
+
+    // the rasterizer must accept these strokes, otherwise the comparison is meaningless
+    QImage image(600, 600, QImage::Format_ARGB32_Premultiplied);
+    image.fill(0);
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::Antialiasing, true);
+    painter.setWorldMatrix(matrix);
+    QVERIFY(StrokeRasterizer::drawVariableWidthCurve(painter, curve, qRgba(0, 0, 0, 255)));
+    painter.end();
+
+    QVERIFY(StrokeRasterizer::matchesPathFiller(curve, matrix, image.size(), 16));
+}
+
+void TestStrokeRasterizer::benchmark_data()
+{
+    QTest::addColumn<bool>("rasterizer");
+    QTest::addColumn<qreal>("width");
+    qreal widths[] = { 2.0, 10.0, 40.0 };
+    for(int w=0; w<3; w++)
+    {
+        QByteArray name = "width " + QByteArray::number(widths[w]);
+        QTest::newRow("path filler, " + name) << false << widths[w];
+        QTest::newRow("stroke rasterizer, " + name) << true << widths[w];
+    }
+}
+
+void TestStrokeRasterizer::benchmark()
+{
+    QFETCH(bool, rasterizer);
+    QFETCH(qreal, width);
+    BezierCurve curve = makeStroke(1, width);
+    QMatrix matrix = makeMatrix(2.0, 0.0);
+    QImage image(600, 600, QImage::Format_ARGB32_Premultiplied);
+    image.fill(0);
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::Antialiasing, true);
+    painter.setWorldMatrix(matrix);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(Qt::black);
+    QBENCHMARK
+    {
+        if(rasterizer)
+        {
+            StrokeRasterizer::drawVariableWidthCurve(painter, curve, qRgba(0, 0, 0, 255));
+        }
+        else
+        {
+            painter.drawPath(curve.getStrokedPath());
+        }
+    }
+    painter.end();
+}
+
+QTEST_MAIN(TestStrokeRasterizer)
+#include "tst_strokerasterizer.moc"